@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// InlineFunction is a move only replacement for std::function that stores the
+// callable in a fixed size buffer within itself, and therefore never allocates.
+// A callable that doesn't fit is a compile time error; capture large state by
+// shared_ptr, or by reference.
+
+template <typename Signature, size_t Capacity = 64>
+class InlineFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity>
+{
+public:
+    InlineFunction() = default;
+    InlineFunction(std::nullptr_t) {}
+
+    template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, InlineFunction>::value>>
+    InlineFunction(F&& f)
+    {
+        using Fn = std::decay_t<F>;
+        static_assert(sizeof(Fn) <= Capacity, "callable is too large for InlineFunction");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "callable is over aligned for InlineFunction");
+        static_assert(std::is_nothrow_move_constructible<Fn>::value, "callable must be nothrow move constructible");
+
+        new (&_storage) Fn(std::forward<F>(f));
+        _invoke = [](void* s, Args... args) -> R
+        {
+            return (*static_cast<Fn*>(s))(std::forward<Args>(args)...);
+        };
+        _manage = [](void* dst, void* src)
+        {
+            if (dst)
+                new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        };
+    }
+
+    InlineFunction(InlineFunction&& rh) noexcept
+    {
+        *this = std::move(rh);
+    }
+
+    InlineFunction& operator= (InlineFunction&& rh) noexcept
+    {
+        if (this != &rh)
+        {
+            reset();
+            if (rh._manage)
+            {
+                rh._manage(&_storage, &rh._storage);
+                _invoke = rh._invoke;
+                _manage = rh._manage;
+                rh._invoke = nullptr;
+                rh._manage = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator= (const InlineFunction&) = delete;
+
+    ~InlineFunction() { reset(); }
+
+    void reset()
+    {
+        if (_manage)
+            _manage(nullptr, &_storage);
+        _invoke = nullptr;
+        _manage = nullptr;
+    }
+
+    explicit operator bool() const { return _invoke != nullptr; }
+
+    R operator()(Args... args) const
+    {
+        return _invoke(const_cast<void*>(static_cast<const void*>(&_storage)), std::forward<Args>(args)...);
+    }
+
+private:
+    std::aligned_storage_t<Capacity, alignof(std::max_align_t)> _storage;
+    R (*_invoke)(void*, Args...) = nullptr;
+    void (*_manage)(void* dst, void* src) = nullptr;
+};
@@ -1,9 +1,79 @@
 #pragma once
 
+#include <cstddef>
+#include <mutex>
+#include <new>
 #include <typeindex>
 #include <sstream>
 #include <string>
 
+// Data objects are created and destroyed for every value passed through the
+// blackboard, so they are recycled through a free list per object size, rather
+// than being returned to the system allocator. Memory is requested in blocks,
+// and is never released.
+template <size_t Size>
+class TypedDataPool
+{
+public:
+    static TypedDataPool& instance()
+    {
+        // deliberately leaked, so that data may be freed during static destruction
+        static TypedDataPool* pool = new TypedDataPool();
+        return *pool;
+    }
+
+    void* allocate()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_free)
+            grow();
+        Node* n = _free;
+        _free = n->next;
+        return n;
+    }
+
+    void deallocate(void* p)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Node* n = static_cast<Node*>(p);
+        n->next = _free;
+        _free = n;
+    }
+
+    void reserve(size_t count)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        size_t available = 0;
+        for (Node* n = _free; n; n = n->next)
+            ++available;
+        while (available < count)
+        {
+            grow();
+            available += block_count;
+        }
+    }
+
+private:
+    struct Node { Node* next; };
+
+    static constexpr size_t stride = (Size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    static constexpr size_t block_count = 64;
+
+    void grow()
+    {
+        char* block = static_cast<char*>(::operator new(stride * block_count));
+        for (size_t i = 0; i < block_count; ++i)
+        {
+            Node* n = reinterpret_cast<Node*>(block + i * stride);
+            n->next = _free;
+            _free = n;
+        }
+    }
+
+    std::mutex _mutex;
+    Node* _free = nullptr;
+};
+
 class TypedData 
 {
 public:
@@ -28,6 +98,22 @@ public:
     virtual const T& value() const { return _data; }
     virtual void setValue(const T& i) { _data = i; }
 
+    // a class derived from Data may be larger, and uses the global allocator
+    static void* operator new(size_t sz)
+    {
+        if (sz != sizeof(Data))
+            return ::operator new(sz);
+        return TypedDataPool<sizeof(Data)>::instance().allocate();
+    }
+
+    static void operator delete(void* p, size_t sz)
+    {
+        if (sz != sizeof(Data))
+            ::operator delete(p);
+        else
+            TypedDataPool<sizeof(Data)>::instance().deallocate(p);
+    }
+
     virtual void copy(const TypedData* rhs) override 
     {
         if (type == rhs->type) 
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+// The allocation profiler attributes every allocation to the subsystem that was
+// active on the allocating thread when it occurred. A subsystem marks itself
+// active with ALLOC_ZONE(Zone) for the rest of the enclosing scope.
+//
+// The profiler replaces the global operator new and delete, and is compiled in
+// only if GUSTEAU_ALLOC_PROFILER is defined. Otherwise the zones compile to
+// nothing, and the statistics are all zero.
+
+enum class AllocZone : int
+{
+    Other = 0, CSP, Blackboard, Journal, ImGui, Lambda,
+    Count
+};
+
+char const* alloc_zone_name(AllocZone zone)
+{
+    switch (zone)
+    {
+    case AllocZone::CSP: return "csp";
+    case AllocZone::Blackboard: return "blackboard";
+    case AllocZone::Journal: return "journal";
+    case AllocZone::ImGui: return "imgui";
+    case AllocZone::Lambda: return "lambda";
+    default: return "other";
+    }
+}
+
+struct AllocZoneStats
+{
+    size_t allocations = 0;     // since startup
+    size_t bytes = 0;           // since startup
+    int64_t live_bytes = 0;
+    int64_t live_bytes_high_water = 0;
+    size_t allocations_per_frame = 0;
+    size_t bytes_per_frame = 0;
+    size_t allocations_per_frame_high_water = 0;
+    size_t bytes_per_frame_high_water = 0;
+};
+
+#ifdef GUSTEAU_ALLOC_PROFILER
+
+struct AllocZoneCounters
+{
+    std::atomic<size_t> allocations{0};
+    std::atomic<size_t> bytes{0};
+    std::atomic<int64_t> live_bytes{0};
+    std::atomic<int64_t> live_bytes_high_water{0};
+
+    // written once per frame by alloc_profiler_frame
+    size_t frame_start_allocations = 0;
+    size_t frame_start_bytes = 0;
+    std::atomic<size_t> allocations_per_frame{0};
+    std::atomic<size_t> bytes_per_frame{0};
+    std::atomic<size_t> allocations_per_frame_high_water{0};
+    std::atomic<size_t> bytes_per_frame_high_water{0};
+};
+
+// plain arrays of atomics are zero initialized before any dynamic initialization,
+// so they are safe to use from allocations made during static construction
+AllocZoneCounters alloc_zone_counters[static_cast<int>(AllocZone::Count)];
+thread_local AllocZone alloc_current_zone = AllocZone::Other;
+
+struct AllocZoneScope
+{
+    AllocZone previous;
+    explicit AllocZoneScope(AllocZone zone) : previous(alloc_current_zone) { alloc_current_zone = zone; }
+    ~AllocZoneScope() { alloc_current_zone = previous; }
+};
+
+#define ALLOC_ZONE_CAT2(a, b) a##b
+#define ALLOC_ZONE_CAT(a, b) ALLOC_ZONE_CAT2(a, b)
+#define ALLOC_ZONE(zone) AllocZoneScope ALLOC_ZONE_CAT(alloc_zone_scope_, __LINE__)(AllocZone::zone)
+
+// Each block is prefixed by a header recording its size and zone, so that a
+// free is credited to the zone that made the allocation.
+struct AllocHeader
+{
+    size_t size;
+    int zone;
+};
+static constexpr size_t alloc_header_size = (sizeof(AllocHeader) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+void* alloc_profiler_allocate(size_t sz)
+{
+    char* p = static_cast<char*>(malloc(sz + alloc_header_size));
+    if (!p)
+        return nullptr;
+
+    int zone = static_cast<int>(alloc_current_zone);
+    AllocHeader* h = reinterpret_cast<AllocHeader*>(p);
+    h->size = sz;
+    h->zone = zone;
+
+    AllocZoneCounters& c = alloc_zone_counters[zone];
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(sz, std::memory_order_relaxed);
+    int64_t live = c.live_bytes.fetch_add(static_cast<int64_t>(sz), std::memory_order_relaxed) + static_cast<int64_t>(sz);
+    int64_t high = c.live_bytes_high_water.load(std::memory_order_relaxed);
+    while (live > high && !c.live_bytes_high_water.compare_exchange_weak(high, live, std::memory_order_relaxed)) {}
+    return p + alloc_header_size;
+}
+
+void alloc_profiler_free(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    char* p = static_cast<char*>(ptr) - alloc_header_size;
+    AllocHeader* h = reinterpret_cast<AllocHeader*>(p);
+    alloc_zone_counters[h->zone].live_bytes.fetch_sub(static_cast<int64_t>(h->size), std::memory_order_relaxed);
+    free(p);
+}
+
+void* operator new(size_t sz)
+{
+    if (void* p = alloc_profiler_allocate(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void* operator new[](size_t sz) { return operator new(sz); }
+void* operator new(size_t sz, const std::nothrow_t&) noexcept { return alloc_profiler_allocate(sz ? sz : 1); }
+void* operator new[](size_t sz, const std::nothrow_t&) noexcept { return alloc_profiler_allocate(sz ? sz : 1); }
+void operator delete(void* p) noexcept { alloc_profiler_free(p); }
+void operator delete[](void* p) noexcept { alloc_profiler_free(p); }
+void operator delete(void* p, size_t) noexcept { alloc_profiler_free(p); }
+void operator delete[](void* p, size_t) noexcept { alloc_profiler_free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { alloc_profiler_free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { alloc_profiler_free(p); }
+
+bool alloc_profiler_enabled() { return true; }
+
+// Call once per frame, to close the current frame's counts.
+void alloc_profiler_frame()
+{
+    for (auto& c : alloc_zone_counters)
+    {
+        size_t allocations = c.allocations.load(std::memory_order_relaxed);
+        size_t bytes = c.bytes.load(std::memory_order_relaxed);
+        size_t frame_allocations = allocations - c.frame_start_allocations;
+        size_t frame_bytes = bytes - c.frame_start_bytes;
+        c.frame_start_allocations = allocations;
+        c.frame_start_bytes = bytes;
+
+        c.allocations_per_frame.store(frame_allocations, std::memory_order_relaxed);
+        c.bytes_per_frame.store(frame_bytes, std::memory_order_relaxed);
+        if (frame_allocations > c.allocations_per_frame_high_water.load(std::memory_order_relaxed))
+            c.allocations_per_frame_high_water.store(frame_allocations, std::memory_order_relaxed);
+        if (frame_bytes > c.bytes_per_frame_high_water.load(std::memory_order_relaxed))
+            c.bytes_per_frame_high_water.store(frame_bytes, std::memory_order_relaxed);
+    }
+}
+
+AllocZoneStats alloc_profiler_stats(AllocZone zone)
+{
+    AllocZoneCounters& c = alloc_zone_counters[static_cast<int>(zone)];
+    AllocZoneStats s;
+    s.allocations = c.allocations.load(std::memory_order_relaxed);
+    s.bytes = c.bytes.load(std::memory_order_relaxed);
+    s.live_bytes = c.live_bytes.load(std::memory_order_relaxed);
+    s.live_bytes_high_water = c.live_bytes_high_water.load(std::memory_order_relaxed);
+    s.allocations_per_frame = c.allocations_per_frame.load(std::memory_order_relaxed);
+    s.bytes_per_frame = c.bytes_per_frame.load(std::memory_order_relaxed);
+    s.allocations_per_frame_high_water = c.allocations_per_frame_high_water.load(std::memory_order_relaxed);
+    s.bytes_per_frame_high_water = c.bytes_per_frame_high_water.load(std::memory_order_relaxed);
+    return s;
+}
+
+#else
+
+#define ALLOC_ZONE(zone)
+
+bool alloc_profiler_enabled() { return false; }
+void alloc_profiler_frame() {}
+AllocZoneStats alloc_profiler_stats(AllocZone) { return {}; }
+
+#endif
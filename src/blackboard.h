@@ -1,38 +1,100 @@
 
-#include <map>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include "TypedData.h"
+#include "alloc_profiler.h"
 
+// Entries live in slots, indexed by id - 1. The slot of an entry that has been
+// taken is recycled for a later entry, so once the blackboard has grown to the
+// number of entries in flight at once, adding an entry doesn't allocate.
 struct Blackboard
 {
     std::mutex bb_mutex;
-    int next_id = 1;
-    std::map<int, TypedData*> values;
+    std::vector<TypedData*> values;
+    std::vector<int> free_ids;
 };
 
+void blackboard_reserve(Blackboard* b, size_t count)
+{
+    if (!b)
+        return;
+
+    ALLOC_ZONE(Blackboard);
+    std::lock_guard<std::mutex> lock(b->bb_mutex);
+    b->values.reserve(count);
+    b->free_ids.reserve(count);
+}
+
 TypedData* blackboard_get(Blackboard* b, int id)
 {
     if (!b)
         return 0;
 
+    ALLOC_ZONE(Blackboard);
     std::lock_guard<std::mutex> lock(b->bb_mutex);
-    auto it = b->values.find(id);
-    if (it == b->values.end())
+    if (id < 1 || id > static_cast<int>(b->values.size()))
         return {};
 
-    auto r = it->second;
-    b->values.erase(it);
+    auto r = b->values[id - 1];
+    if (r)
+    {
+        b->values[id - 1] = nullptr;
+        b->free_ids.push_back(id);
+    }
     return r;
 }
 
+// Takes count entries under one lock; out[i] receives the entry of ids[i], or
+// nullptr if there is none.
+void blackboard_get_many(Blackboard* b, const int* ids, size_t count, TypedData** out)
+{
+    if (!b)
+        return;
+
+    ALLOC_ZONE(Blackboard);
+    std::lock_guard<std::mutex> lock(b->bb_mutex);
+    for (size_t i = 0; i < count; ++i)
+    {
+        int id = ids[i];
+        out[i] = nullptr;
+        if (id < 1 || id > static_cast<int>(b->values.size()))
+            continue;
+
+        out[i] = b->values[id - 1];
+        if (out[i])
+        {
+            b->values[id - 1] = nullptr;
+            b->free_ids.push_back(id);
+        }
+    }
+}
+
 int blackboard_new_entry(Blackboard* b, TypedData* d)
+{
+    if (!b)
+        return 0;
+
+    ALLOC_ZONE(Blackboard);
+    std::lock_guard<std::mutex> lock(b->bb_mutex);
+    if (b->free_ids.size())
+    {
+        int id = b->free_ids.back();
+        b->free_ids.pop_back();
+        b->values[id - 1] = d;
+        return id;
+    }
+    b->values.push_back(d);
+    return static_cast<int>(b->values.size());
+}
+
+// The number of entries waiting to be taken.
+size_t blackboard_size(Blackboard* b)
 {
     if (!b)
         return 0;
 
     std::lock_guard<std::mutex> lock(b->bb_mutex);
-    b->values[b->next_id++] = d;
-    return b->next_id - 1;
+    return b->values.size() - b->free_ids.size();
 }
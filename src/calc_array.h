@@ -0,0 +1,163 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define CALC_SIMD_AVX
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define CALC_SIMD_SSE
+#endif
+
+// A CalcArray is an immutable, reference counted array of floats. A scalar is
+// an array of length one. Since the values are never modified after creation,
+// journal records may hold the operands of an operation by reference instead
+// of copying them.
+struct CalcArray
+{
+    std::shared_ptr<const std::vector<float>> values;
+
+    size_t size() const { return values ? values->size() : 0; }
+    const float* data() const { return values ? values->data() : nullptr; }
+    float operator[](size_t i) const { return (*values)[i]; }
+};
+
+CalcArray calc_array(float value)
+{
+    return { std::make_shared<const std::vector<float>>(1, value) };
+}
+
+CalcArray calc_array(std::vector<float>&& values)
+{
+    return { std::make_shared<const std::vector<float>>(std::move(values)) };
+}
+
+std::ostream& operator<<(std::ostream& os, const CalcArray& a)
+{
+    size_t sz = a.size();
+    if (sz == 1)
+        return os << a[0];
+
+    os << "[";
+    for (size_t i = 0; i < sz; ++i)
+        os << (i ? ", " : "") << a[i];
+    return os << "]";
+}
+
+enum class CalcOp { Add, Subtract, Multiply, Divide };
+
+// Each operation supplies a scalar form, and a form per supported vector width.
+struct CalcAdd
+{
+    static float apply(float a, float b) { return a + b; }
+#ifdef CALC_SIMD_SSE
+    static __m128 apply(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+#endif
+#ifdef CALC_SIMD_AVX
+    static __m256 apply(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+#endif
+};
+
+struct CalcSubtract
+{
+    static float apply(float a, float b) { return a - b; }
+#ifdef CALC_SIMD_SSE
+    static __m128 apply(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+#endif
+#ifdef CALC_SIMD_AVX
+    static __m256 apply(__m256 a, __m256 b) { return _mm256_sub_ps(a, b); }
+#endif
+};
+
+struct CalcMultiply
+{
+    static float apply(float a, float b) { return a * b; }
+#ifdef CALC_SIMD_SSE
+    static __m128 apply(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+#endif
+#ifdef CALC_SIMD_AVX
+    static __m256 apply(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+#endif
+};
+
+struct CalcDivide
+{
+    static float apply(float a, float b) { return a / b; }
+#ifdef CALC_SIMD_SSE
+    static __m128 apply(__m128 a, __m128 b) { return _mm_div_ps(a, b); }
+#endif
+#ifdef CALC_SIMD_AVX
+    static __m256 apply(__m256 a, __m256 b) { return _mm256_div_ps(a, b); }
+#endif
+};
+
+// r[i] = a[i] op b[i]. A broadcast operand is read from element zero only, and
+// is splatted once outside of the loops.
+template <typename Op, bool BroadcastA, bool BroadcastB>
+void calc_kernel(const float* a, const float* b, float* r, size_t n)
+{
+    size_t i = 0;
+#ifdef CALC_SIMD_AVX
+    {
+        const __m256 a8 = _mm256_set1_ps(a[0]);
+        const __m256 b8 = _mm256_set1_ps(b[0]);
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(r + i, Op::apply(BroadcastA ? a8 : _mm256_loadu_ps(a + i),
+                                              BroadcastB ? b8 : _mm256_loadu_ps(b + i)));
+    }
+#endif
+#ifdef CALC_SIMD_SSE
+    {
+        const __m128 a4 = _mm_set1_ps(a[0]);
+        const __m128 b4 = _mm_set1_ps(b[0]);
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(r + i, Op::apply(BroadcastA ? a4 : _mm_loadu_ps(a + i),
+                                           BroadcastB ? b4 : _mm_loadu_ps(b + i)));
+    }
+#endif
+    for (; i < n; ++i)
+        r[i] = Op::apply(a[BroadcastA ? 0 : i], b[BroadcastB ? 0 : i]);
+}
+
+template <typename Op>
+void calc_kernel(const float* a, size_t na, const float* b, size_t nb, float* r, size_t n)
+{
+    if (na == nb)
+        calc_kernel<Op, false, false>(a, b, r, n);
+    else if (na == 1)
+        calc_kernel<Op, true, false>(a, b, r, n);
+    else
+        calc_kernel<Op, false, true>(a, b, r, n);
+}
+
+// Element-wise a op b, writing n results to r. Operands must either be n long,
+// or be scalars, which are broadcast.
+void calc_apply(CalcOp op, const float* a, size_t na, const float* b, size_t nb, float* r, size_t n)
+{
+    switch (op)
+    {
+    case CalcOp::Add:      calc_kernel<CalcAdd>(a, na, b, nb, r, n); break;
+    case CalcOp::Subtract: calc_kernel<CalcSubtract>(a, na, b, nb, r, n); break;
+    case CalcOp::Multiply: calc_kernel<CalcMultiply>(a, na, b, nb, r, n); break;
+    case CalcOp::Divide:   calc_kernel<CalcDivide>(a, na, b, nb, r, n); break;
+    }
+}
+
+// returns false if the operands are empty, or their shapes are not compatible
+bool calc_apply(CalcOp op, const CalcArray& a, const CalcArray& b, CalcArray& result)
+{
+    size_t na = a.size();
+    size_t nb = b.size();
+    if (!na || !nb || (na != nb && na != 1 && nb != 1))
+        return false;
+
+    size_t n = na > nb ? na : nb;
+    std::vector<float> r(n);
+    calc_apply(op, a.data(), na, b.data(), nb, r.data(), n);
+    result = calc_array(std::move(r));
+    return true;
+}
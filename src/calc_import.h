@@ -0,0 +1,213 @@
+#pragma once
+
+#include "calc_array.h"
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The columns of a numeric file, each becoming one calculator stack entry.
+struct CalcColumns
+{
+    std::vector<CalcArray> columns;
+};
+
+std::ostream& operator<<(std::ostream& os, const CalcColumns& c)
+{
+    os << c.columns.size() << " columns";
+    for (auto& i : c.columns)
+        os << " [" << i.size() << "]";
+    return os;
+}
+
+bool calc_import_read_file(char const*const path, std::vector<char>& buffer)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    long sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (sz < 0)
+    {
+        fclose(f);
+        return false;
+    }
+    buffer.resize(static_cast<size_t>(sz));
+    size_t read = fread(buffer.data(), 1, buffer.size(), f);
+    fclose(f);
+    return read == buffer.size();
+}
+
+// A raw file of native endian float32 values is a single column.
+bool calc_import_float32(char const*const path, CalcColumns& result)
+{
+    std::vector<char> buffer;
+    if (!calc_import_read_file(path, buffer) || buffer.size() < sizeof(float))
+        return false;
+
+    std::vector<float> values(buffer.size() / sizeof(float));
+    memcpy(values.data(), buffer.data(), values.size() * sizeof(float));
+    result.columns.clear();
+    result.columns.push_back(calc_array(std::move(values)));
+    return true;
+}
+
+char const* calc_import_parse_float(char const* curr, char const* end, float& value)
+{
+#if defined(__cpp_lib_to_chars) || (defined(_MSC_VER) && _MSC_VER >= 1924)
+    if (curr != end && *curr == '+')
+        ++curr;
+    auto r = std::from_chars(curr, end, value);
+    return r.ec == std::errc() ? r.ptr : curr;
+#else
+    // strtof requires a terminator, every line in the buffer ends before one
+    char* next = nullptr;
+    value = strtof(curr, &next);
+    return next;
+#endif
+}
+
+// Parses up to max_fields numbers from a line. Fields are separated by commas,
+// semicolons, tabs or spaces. Returns the number of fields parsed.
+size_t calc_import_parse_line(char const* p, char const* eol, float* fields, size_t max_fields)
+{
+    size_t count = 0;
+    while (p < eol && count < max_fields)
+    {
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+            ++p;
+        if (p == eol)
+            break;
+        char const* next = calc_import_parse_float(p, eol, fields[count]);
+        if (next == p)
+            break;
+        ++count;
+        p = next;
+        while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+            ++p;
+        if (p < eol && (*p == ',' || *p == ';'))
+            ++p;
+    }
+    return count;
+}
+
+// Parses the lines of one chunk into columns. A line that doesn't start with a
+// number, such as a header, is skipped. Missing fields are NaN, and extra fields
+// are ignored.
+void calc_import_parse_chunk(char const* curr, char const* end, size_t column_count,
+                             std::vector<std::vector<float>>& columns)
+{
+    columns.resize(column_count);
+    std::vector<float> fields(column_count);
+    while (curr < end)
+    {
+        char const* eol = static_cast<char const*>(memchr(curr, '\n', end - curr));
+        if (!eol)
+            eol = end;
+
+        size_t count = calc_import_parse_line(curr, eol, fields.data(), column_count);
+        if (count > 0)
+            for (size_t col = 0; col < column_count; ++col)
+                columns[col].push_back(col < count ? fields[col] : std::nanf(""));
+
+        curr = eol + 1;
+    }
+}
+
+// Parses a text file of numeric columns. The buffer is split at line boundaries
+// into one chunk per thread; chunks are parsed concurrently, and then copied
+// concurrently into their place in the final columns.
+bool calc_import_text(char const*const path, CalcColumns& result,
+                      unsigned thread_count = std::thread::hardware_concurrency())
+{
+    std::vector<char> buffer;
+    if (!calc_import_read_file(path, buffer) || buffer.empty())
+        return false;
+    buffer.push_back('\n');
+    buffer.push_back('\0');
+
+    char const* begin = buffer.data();
+    char const* end = begin + buffer.size() - 1;
+
+    // the number of columns is the number of fields on the first numeric line
+    size_t column_count = 0;
+    for (char const* line = begin; line < end && !column_count; )
+    {
+        char const* eol = static_cast<char const*>(memchr(line, '\n', end - line));
+        float fields[256];
+        column_count = calc_import_parse_line(line, eol, fields, 256);
+        line = eol + 1;
+    }
+    if (!column_count)
+        return false;
+
+    const size_t min_chunk = 1 << 20;
+    size_t sz = end - begin;
+    if (thread_count < 1)
+        thread_count = 1;
+    if (sz / thread_count < min_chunk)
+        thread_count = static_cast<unsigned>(sz / min_chunk + 1);
+
+    std::vector<char const*> bounds(thread_count + 1, end);
+    bounds[0] = begin;
+    for (unsigned i = 1; i < thread_count; ++i)
+    {
+        char const* split = begin + sz * i / thread_count;
+        if (split < bounds[i - 1])
+            split = bounds[i - 1];
+        char const* eol = static_cast<char const*>(memchr(split, '\n', end - split));
+        bounds[i] = eol ? eol + 1 : end;
+    }
+
+    std::vector<std::vector<std::vector<float>>> chunks(thread_count);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads.emplace_back([&, i]() { calc_import_parse_chunk(bounds[i], bounds[i + 1], column_count, chunks[i]); });
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+
+    std::vector<size_t> offsets(thread_count + 1, 0);
+    for (unsigned i = 0; i < thread_count; ++i)
+        offsets[i + 1] = offsets[i] + chunks[i][0].size();
+    if (!offsets[thread_count])
+        return false;
+
+    std::vector<std::vector<float>> columns(column_count, std::vector<float>(offsets[thread_count]));
+    for (unsigned i = 0; i < thread_count; ++i)
+        threads.emplace_back([&, i]()
+        {
+            for (size_t c = 0; c < column_count; ++c)
+                std::copy(chunks[i][c].begin(), chunks[i][c].end(), columns[c].begin() + offsets[i]);
+        });
+    for (auto& t : threads)
+        t.join();
+
+    result.columns.clear();
+    for (auto& c : columns)
+        result.columns.push_back(calc_array(std::move(c)));
+    return true;
+}
+
+// Files ending in .f32 or .raw are raw float32, anything else is text.
+bool calc_import(char const*const path, CalcColumns& result)
+{
+    if (!path)
+        return false;
+
+    size_t len = strlen(path);
+    auto ends_with = [path, len](char const*const ext)
+    {
+        size_t ext_len = strlen(ext);
+        return len >= ext_len && !strcmp(path + len - ext_len, ext);
+    };
+    if (ends_with(".f32") || ends_with(".raw"))
+        return calc_import_float32(path, result);
+    return calc_import_text(path, result);
+}
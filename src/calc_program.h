@@ -0,0 +1,254 @@
+#pragma once
+
+#include "calc_array.h"
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// A CalcProgram is a sequence of calculator operations compiled to a compact
+// postfix bytecode. Inputs are the entries on the calculator stack when the
+// program runs, Input 0 being the top of the stack.
+enum class CalcOpcode : uint8_t
+{
+    Input,      // followed by a one byte input index
+    Constant,   // followed by a one byte constant index
+    Add, Subtract, Multiply, Divide
+};
+
+struct CalcProgram
+{
+    std::vector<uint8_t> code;
+    std::vector<CalcArray> constants;
+    int input_count = 0;
+    int max_depth = 0;
+};
+
+// The recorder watches the calculator and notes what was done. Operations that
+// reach below the values pushed during recording refer to program inputs.
+struct CalcProgramRecorder
+{
+    enum class Kind { Push, Pop, Binary };
+    struct Step
+    {
+        Kind kind;
+        CalcOp op;
+        CalcArray value;
+    };
+    std::vector<Step> steps;
+
+    void clear() { steps.clear(); }
+    void push(const CalcArray& value) { steps.push_back({Kind::Push, CalcOp::Add, value}); }
+    void pop() { steps.push_back({Kind::Pop, CalcOp::Add, {}}); }
+    void binary(CalcOp op) { steps.push_back({Kind::Binary, op, {}}); }
+};
+
+struct CalcProgramNode
+{
+    CalcOpcode opcode;
+    int index;  // input or constant index
+    int lhs;
+    int rhs;
+};
+
+void calc_program_emit(const std::vector<CalcProgramNode>& nodes, int n, int depth, CalcProgram& program)
+{
+    const CalcProgramNode& node = nodes[n];
+    if (node.opcode == CalcOpcode::Input || node.opcode == CalcOpcode::Constant)
+    {
+        program.code.push_back(static_cast<uint8_t>(node.opcode));
+        program.code.push_back(static_cast<uint8_t>(node.index));
+        if (depth + 1 > program.max_depth)
+            program.max_depth = depth + 1;
+        return;
+    }
+    calc_program_emit(nodes, node.lhs, depth, program);
+    calc_program_emit(nodes, node.rhs, depth + 1, program);
+    program.code.push_back(static_cast<uint8_t>(node.opcode));
+}
+
+// Compiles a recording. The recording is replayed against a symbolic stack,
+// producing an expression tree which is then written out in postfix order.
+// Returns false if the recording doesn't leave exactly one result, or uses
+// more than 256 inputs, constants, or stack entries.
+bool calc_program_compile(const CalcProgramRecorder& recorder, CalcProgram& program)
+{
+    program = CalcProgram{};
+
+    std::vector<CalcProgramNode> nodes;
+    std::vector<int> stack;
+    auto pop = [&]() -> int
+    {
+        if (stack.empty())
+        {
+            nodes.push_back({CalcOpcode::Input, program.input_count++, -1, -1});
+            return static_cast<int>(nodes.size()) - 1;
+        }
+        int n = stack.back();
+        stack.pop_back();
+        return n;
+    };
+
+    for (auto& step : recorder.steps)
+    {
+        switch (step.kind)
+        {
+        case CalcProgramRecorder::Kind::Push:
+            nodes.push_back({CalcOpcode::Constant, static_cast<int>(program.constants.size()), -1, -1});
+            program.constants.push_back(step.value);
+            stack.push_back(static_cast<int>(nodes.size()) - 1);
+            break;
+        case CalcProgramRecorder::Kind::Pop:
+            pop();
+            break;
+        case CalcProgramRecorder::Kind::Binary:
+        {
+            int rhs = pop();
+            int lhs = pop();
+            CalcOpcode opcode = static_cast<CalcOpcode>(static_cast<int>(CalcOpcode::Add) + static_cast<int>(step.op));
+            nodes.push_back({opcode, 0, lhs, rhs});
+            stack.push_back(static_cast<int>(nodes.size()) - 1);
+            break;
+        }
+        }
+    }
+
+    if (stack.size() != 1 || program.input_count > 256 || program.constants.size() > 256)
+    {
+        program = CalcProgram{};
+        return false;
+    }
+
+    calc_program_emit(nodes, stack.back(), 0, program);
+    if (program.max_depth > 256)
+    {
+        program = CalcProgram{};
+        return false;
+    }
+    return true;
+}
+
+// Evaluates the program over elements [begin, end) of the output. Operands that
+// come straight from an input or a constant are read in place; intermediate
+// results are written to scratch, one chunk sized buffer per stack depth.
+void calc_program_eval_chunk(const CalcProgram& program, const CalcArray* inputs,
+                             size_t begin, size_t end, float* scratch, float* out)
+{
+    struct Operand { const float* p; size_t n; };
+    Operand stack[256];
+    int sp = 0;
+    const size_t len = end - begin;
+
+    auto operand = [begin, len](const CalcArray& a) -> Operand
+    {
+        if (a.size() == 1)
+            return { a.data(), 1 };
+        return { a.data() + begin, len };
+    };
+
+    const uint8_t* pc = program.code.data();
+    const uint8_t* pc_end = pc + program.code.size();
+    while (pc < pc_end)
+    {
+        CalcOpcode opcode = static_cast<CalcOpcode>(*pc++);
+        switch (opcode)
+        {
+        case CalcOpcode::Input:    stack[sp++] = operand(inputs[*pc++]); break;
+        case CalcOpcode::Constant: stack[sp++] = operand(program.constants[*pc++]); break;
+        default:
+        {
+            Operand b = stack[--sp];
+            Operand a = stack[--sp];
+            // the final operation writes directly to the output, and an
+            // operation on two scalars is a scalar, computed once
+            float* r = pc == pc_end ? out + begin : scratch + len * sp;
+            size_t n = a.n == 1 && b.n == 1 ? 1 : len;
+            CalcOp op = static_cast<CalcOp>(static_cast<int>(opcode) - static_cast<int>(CalcOpcode::Add));
+            calc_apply(op, a.p, a.n, b.p, b.n, r, n);
+            stack[sp++] = { r, n };
+            break;
+        }
+        }
+    }
+
+    // a program that is a single input or constant is a copy, and a scalar
+    // result is broadcast
+    if (sp == 1 && (stack[0].p != out + begin || stack[0].n == 1))
+    {
+        for (size_t i = 0; i < len; ++i)
+            out[begin + i] = stack[0].p[stack[0].n == 1 ? 0 : i];
+    }
+}
+
+// Runs the program. inputs holds program.input_count arrays, top of stack
+// first. Every input and constant must either be the same length, or a scalar.
+// Work is divided into chunks small enough to stay in cache, which are handed
+// out to up to thread_count threads. Returns false if the shapes don't agree.
+bool calc_program_run(const CalcProgram& program, const CalcArray* inputs, CalcArray& result,
+                      unsigned thread_count = std::thread::hardware_concurrency())
+{
+    if (program.code.empty())
+        return false;
+
+    size_t n = 1;
+    auto check = [&n](const CalcArray& a)
+    {
+        size_t sz = a.size();
+        if (!sz || (sz != 1 && n != 1 && sz != n))
+            return false;
+        if (sz > n)
+            n = sz;
+        return true;
+    };
+    for (int i = 0; i < program.input_count; ++i)
+        if (!check(inputs[i]))
+            return false;
+    for (auto& c : program.constants)
+        if (!check(c))
+            return false;
+
+    const size_t chunk = 4096;
+    const size_t chunk_count = (n + chunk - 1) / chunk;
+    std::vector<float> out(n);
+    std::atomic<size_t> next_chunk{0};
+
+    auto worker = [&]()
+    {
+        std::vector<float> scratch(chunk * (program.max_depth + 1));
+        for (size_t c = next_chunk++; c < chunk_count; c = next_chunk++)
+        {
+            size_t begin = c * chunk;
+            size_t end = begin + chunk < n ? begin + chunk : n;
+            calc_program_eval_chunk(program, inputs, begin, end, scratch.data(), out.data());
+        }
+    };
+
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > chunk_count)
+        thread_count = static_cast<unsigned>(chunk_count);
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < thread_count; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+
+    result = calc_array(std::move(out));
+    return true;
+}
+
+// A finished run, handed back from the thread that ran it: the inputs it was
+// given, top of stack first, and the result.
+struct CalcProgramRun
+{
+    std::vector<CalcArray> inputs;
+    CalcArray result;
+};
+
+std::ostream& operator<<(std::ostream& os, const CalcProgramRun& r)
+{
+    return os << r.inputs.size() << " inputs, [" << r.result.size() << "] result";
+}
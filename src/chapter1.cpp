@@ -115,6 +115,20 @@ public:
 
 class ApplicationContextBase;
 
+/// Work that an application context needs done before it can start, but that
+/// doesn't involve the windowing system, such as parsing its definitions or
+/// loading files, is prepared on a worker thread while the windows are being
+/// created. The results are handed to the application context in an object
+/// derived from ApplicationStartupData.
+///<C++
+class ApplicationStartupData
+{
+public:
+    ApplicationStartupData() = default;
+    virtual ~ApplicationStartupData() = default;
+};
+///>
+
 /// The UI Context will know about the user interface state.
 ///<C++
 class UIContext
@@ -137,7 +151,7 @@ class ApplicationContextBase : public std::enable_shared_from_this<ApplicationCo
 public:
     ApplicationContextBase() {}
     virtual ~ApplicationContextBase() = default;
-    virtual void Init() {}
+    virtual void Init(std::unique_ptr<ApplicationStartupData>) {}
     virtual void Update() = 0;
     bool join_now = false;
     std::shared_ptr<UIContext> ui;
@@ -153,6 +167,7 @@ public:
 std::unique_ptr<GraphicsContext> CreateRootGraphicsContext();
 std::shared_ptr<UIContext> CreateUIContext(GraphicsContext&);
 std::shared_ptr<ApplicationContextBase> CreateApplicationContext(GraphicsContext& gc, std::shared_ptr<UIContext> ui);
+std::unique_ptr<ApplicationStartupData> PrepareApplicationContext(int argc, char** argv);
 ///>
 
 
@@ -186,12 +201,93 @@ std::shared_ptr<ApplicationContextBase> CreateApplicationContext(GraphicsContext
     return std::make_shared<ApplicationContext>(gc, ui);
 }
 
+/// Chapter 1 has nothing to prepare.
+std::unique_ptr<ApplicationStartupData> PrepareApplicationContext(int, char**)
+{
+    return {};
+}
+
 ///>
 #endif // GUSTEAU_chapter1
 
+#include <future>
 #include <thread>
 #include <vector>
 #include <iostream>
+#include "clock.h"
+#include "log.h"
+#include "stats.h"
+
+/// Startup is measured in stages. Each stage records when it began and ended,
+/// relative to the start of main, and on which thread; once the first frame has
+/// been drawn, the stages and the time to first frame are logged, and published
+/// to the stats registry.
+///<C++
+struct StartupStage
+{
+    char const* name;
+    double begin;   // seconds since the start of main
+    double end;
+    bool worker;    // run off the main thread
+};
+
+struct StartupProfile
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::thread::id main_thread = std::this_thread::get_id();
+    std::mutex stages_mutex;
+    std::vector<StartupStage> stages;
+    std::atomic<bool> reported{false};
+};
+
+// The first call, at the start of main, sets the time that stages are measured from.
+StartupProfile& startup_profile()
+{
+    static StartupProfile profile;
+    return profile;
+}
+
+double startup_seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startup_profile().start).count();
+}
+
+struct StartupStageScope
+{
+    char const* name;
+    double begin;
+    explicit StartupStageScope(char const* n) : name(n), begin(startup_seconds()) {}
+    ~StartupStageScope()
+    {
+        StartupProfile& p = startup_profile();
+        bool worker = std::this_thread::get_id() != p.main_thread;
+        double end = startup_seconds();
+        std::lock_guard<std::mutex> lock(p.stages_mutex);
+        p.stages.push_back({ name, begin, end, worker });
+    }
+};
+
+#define STARTUP_STAGE_CAT2(a, b) a##b
+#define STARTUP_STAGE_CAT(a, b) STARTUP_STAGE_CAT2(a, b)
+#define STARTUP_STAGE(name) StartupStageScope STARTUP_STAGE_CAT(startup_stage_, __LINE__)(name)
+
+void startup_first_frame()
+{
+    StartupProfile& p = startup_profile();
+    if (p.reported.exchange(true))
+        return;
+
+    double first_frame = startup_seconds();
+    std::lock_guard<std::mutex> lock(p.stages_mutex);
+    for (auto& s : p.stages)
+    {
+        LOG_INFO("startup: %-28s %8.2f ms, from %8.2f ms%s", s.name, (s.end - s.begin) * 1e3, s.begin * 1e3, s.worker ? " (worker)" : "");
+        stats_gauge(std::string("gusteau_startup_stage_seconds{stage=\"") + s.name + "\"}", "Time taken by a stage of startup").set(s.end - s.begin);
+    }
+    LOG_INFO("startup: time to first frame %.2f ms", first_frame * 1e3);
+    stats_gauge("gusteau_time_to_first_frame_seconds", "Time from the start of main to the end of the first frame").set(first_frame);
+}
+///>
 
 /// Engines operate on State.
 ///
@@ -225,13 +321,63 @@ void StateEngine(std::shared_ptr<ApplicationContextBase>);
 ///
 /// All of main is guarded by a try/catch block so that if anything goes wrong
 /// during the run, we have a place to trap and report it.
+///
+/// The windowing system must be initialized on the main thread, so while it
+/// is, the application's own preparation runs on a worker. The application
+/// context is initialized once both are done.
+///
+/// If GUSTEAU_SIMULATE is set, the application runs on simulated time; see
+/// UIEngine.
 ///<C++
 int main(int argc, char** argv) try
 {
-    std::unique_ptr<GraphicsContext> root_graphics_context(CreateRootGraphicsContext());
-    std::shared_ptr<UIContext> ui_context = CreateUIContext(*root_graphics_context.get());
-    std::shared_ptr<ApplicationContextBase> app_context(CreateApplicationContext(*root_graphics_context.get(), ui_context));
-    app_context->Init();
+    startup_profile();
+    if (getenv("GUSTEAU_SIMULATE"))
+        vclock_set_mode(VirtualClockMode::Simulation);
+    std::future<std::unique_ptr<ApplicationStartupData>> prepared = std::async(std::launch::async, [argc, argv]()
+    {
+        STARTUP_STAGE("prepare application context");
+        return PrepareApplicationContext(argc, argv);
+    });
+
+    std::unique_ptr<GraphicsContext> root_graphics_context;
+    {
+        STARTUP_STAGE("root graphics context");
+        root_graphics_context = CreateRootGraphicsContext();
+    }
+    std::shared_ptr<UIContext> ui_context;
+    {
+        STARTUP_STAGE("ui context");
+        ui_context = CreateUIContext(*root_graphics_context.get());
+    }
+    std::shared_ptr<ApplicationContextBase> app_context;
+    {
+        STARTUP_STAGE("application context");
+        app_context = CreateApplicationContext(*root_graphics_context.get(), ui_context);
+    }
+    std::unique_ptr<ApplicationStartupData> startup_data;
+    {
+        STARTUP_STAGE("wait for preparation");
+        startup_data = prepared.get();
+    }
+    {
+        STARTUP_STAGE("init application context");
+        app_context->Init(std::move(startup_data));
+    }
+
+    ///>
+    /// The engine's statistics are exported to a file, or a Unix domain socket,
+    /// if the environment names one.
+    ///<C++
+    StatsExportConfig stats_config;
+    if (char const*const path = getenv("GUSTEAU_STATS_FILE"))
+        stats_config.path = path;
+    if (char const*const socket_path = getenv("GUSTEAU_STATS_SOCKET"))
+        stats_config.socket_path = socket_path;
+    std::string stats_failed;
+    if (stats_config.path.size() || stats_config.socket_path.size())
+        if (!stats_export_start(stats_config, &stats_failed))
+            LOG_WARN("could not export stats to %s", stats_failed);
 
     std::vector<std::thread> jobs(2);
     jobs.emplace_back(std::thread([app_context]() { StateEngine(app_context); }));
@@ -243,6 +389,7 @@ int main(int argc, char** argv) try
         if (j.joinable())
             j.join();
 
+    stats_export_stop();
     return 0;
 }
 catch (std::exception& exc)
@@ -265,7 +412,7 @@ catch (std::exception& exc)
 
 static void error_callback(int error, const char* description)
 {
-    fprintf(stderr, "Error %d: %s\n", error, description);
+    LOG_ERROR("glfw error %d: %s", error, description);
 }
 
 /// THe glfw flags should be set consistently and to a relatively modern version,
@@ -299,30 +446,40 @@ public:
     GLFWGraphicsContext()
     {
         glfwSetErrorCallback(error_callback);
-        if (!glfwInit())
-            throw std::runtime_error("Could not initialize glfw");
+        {
+            STARTUP_STAGE("glfw init");
+            if (!glfwInit())
+                throw std::runtime_error("Could not initialize glfw");
+        }
 
         setGlfwFlags();
         glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-        GLFWwindow* window = glfwCreateWindow(16, 16, "Root graphics context", NULL, NULL);
-        glfwMakeContextCurrent(window);
-        glfwSwapInterval(1); // must be set when a window's context is current
+        GLFWwindow* window;
+        {
+            STARTUP_STAGE("root window");
+            window = glfwCreateWindow(16, 16, "Root graphics context", NULL, NULL);
+            glfwMakeContextCurrent(window);
+            glfwSwapInterval(1); // must be set when a window's context is current
+        }
 
-        glewExperimental = GL_TRUE;
-        glewInit(); // create GLEW after the context has been created
+        {
+            STARTUP_STAGE("glew init");
+            glewExperimental = GL_TRUE;
+            glewInit(); // create GLEW after the context has been created
+        }
 
         if (!GLEW_VERSION_4_1)
-            std::cerr << "glew didn't init properly" << std::endl;
+            LOG_ERROR("glew didn't init properly");
 
         if (!glProgramParameteri)
-            std::cerr << "glew didn't init properly" << std::endl;
+            LOG_ERROR("glew didn't init properly");
 
         // get version info
         const GLubyte* renderer = glGetString(GL_RENDERER); // get renderer string
         const GLubyte* version = glGetString(GL_VERSION); // version as a string
-        std::cout << "OpenGL Renderer: " << renderer << std::endl;
-        std::cout << "OpenGL Version: " << version << std::endl;
+        LOG_INFO("OpenGL Renderer: %s", reinterpret_cast<const char*>(renderer));
+        LOG_INFO("OpenGL Version: %s", reinterpret_cast<const char*>(version));
 
         _window = window;
 
@@ -361,12 +518,42 @@ std::unique_ptr<GraphicsContext> CreateRootGraphicsContext()
 #include <imgui/imgui_internal.h> // for ImGuiContext
 #include <imgui/examples/imgui_impl_glfw.h>
 #include <imgui/examples/imgui_impl_opengl3.h>
+#include "alloc_profiler.h"
+
+/// When the allocation profiler is compiled in, an overlay reports the memory
+/// activity of each subsystem, in the most recent frame and overall.
+///<C++
+void DrawAllocationOverlay()
+{
+    ImGui::SetNextWindowBgAlpha(0.8f);
+    ImGui::Begin("Memory", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+    ImGui::Columns(5, "###alloc_columns");
+    ImGui::TextUnformatted("zone"); ImGui::NextColumn();
+    ImGui::TextUnformatted("allocs/frame"); ImGui::NextColumn();
+    ImGui::TextUnformatted("bytes/frame"); ImGui::NextColumn();
+    ImGui::TextUnformatted("live"); ImGui::NextColumn();
+    ImGui::TextUnformatted("live peak"); ImGui::NextColumn();
+    ImGui::Separator();
+    for (int i = 0; i < static_cast<int>(AllocZone::Count); ++i)
+    {
+        AllocZoneStats s = alloc_profiler_stats(static_cast<AllocZone>(i));
+        ImGui::TextUnformatted(alloc_zone_name(static_cast<AllocZone>(i))); ImGui::NextColumn();
+        ImGui::Text("%zu (%zu)", s.allocations_per_frame, s.allocations_per_frame_high_water); ImGui::NextColumn();
+        ImGui::Text("%zu (%zu)", s.bytes_per_frame, s.bytes_per_frame_high_water); ImGui::NextColumn();
+        ImGui::Text("%lld", static_cast<long long>(s.live_bytes)); ImGui::NextColumn();
+        ImGui::Text("%lld", static_cast<long long>(s.live_bytes_high_water)); ImGui::NextColumn();
+    }
+    ImGui::Columns(1);
+    ImGui::End();
+}
+///>
 
 struct UIContext::Detail
 {
     GLFWwindow* _window{};
     ImGuiContext* _context{};
     std::string _window_name;
+    std::string _window_id;
     std::function<void(ApplicationContextBase&)> _run;
 
     Detail(GraphicsContext& context,
@@ -374,13 +561,23 @@ struct UIContext::Detail
            const std::string& window_name, int width, int height)
         : _window_name(window_name), _run(run)
     {
+        // ensure every window has a unique id
+        char buff[256];
+        sprintf(buff, "###GraphicsWindow_%td", (ptrdiff_t)this);
+        _window_id.assign(buff);
+
         setGlfwFlags();
         glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
 
         GLFWGraphicsContext* gc = dynamic_cast<GLFWGraphicsContext*>(&context);
 
-        _window = glfwCreateWindow(width, height, window_name.c_str(), NULL, gc->_window);
-        glfwMakeContextCurrent(_window);
+        {
+            STARTUP_STAGE("ui window");
+            _window = glfwCreateWindow(width, height, window_name.c_str(), NULL, gc->_window);
+            glfwMakeContextCurrent(_window);
+        }
+
+        STARTUP_STAGE("imgui init");
 
         // Setup Dear ImGui context
         IMGUI_CHECKVERSION();
@@ -438,6 +635,7 @@ struct UIContext::Detail
         if (!_window || context.join_now)
             return;
 
+        ALLOC_ZONE(ImGui);
         glfwMakeContextCurrent(_window);
 
         ActivateContext();
@@ -467,10 +665,7 @@ struct UIContext::Detail
             | ImGuiWindowFlags_NoFocusOnAppearing
             | ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoScrollWithMouse;
 
-        // ensure every window has a unique id
-        char buff[256];
-        sprintf(buff, "###GraphicsWindow_%td", (ptrdiff_t)this);
-        ImGui::Begin(buff, 0, flags);
+        ImGui::Begin(_window_id.c_str(), 0, flags);
 
         const float font_scale = 2.0f;
         ImGui::SetWindowFontScale(font_scale);
@@ -486,6 +681,10 @@ struct UIContext::Detail
         if (_run) _run(context);
 
         ImGui::End(); // end the main window
+
+        if (alloc_profiler_enabled())
+            DrawAllocationOverlay();
+
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
@@ -509,17 +708,58 @@ void UIContext::Render(ApplicationContextBase& context) { m_->Render(context); }
 
 
 
+/// The frame time, and the allocation profiler's counts, are published to the
+/// stats registry.
+///<C++
+void RegisterEngineStats()
+{
+    if (!alloc_profiler_enabled())
+        return;
+
+    for (int i = 0; i < static_cast<int>(AllocZone::Count); ++i)
+    {
+        AllocZone zone = static_cast<AllocZone>(i);
+        std::string label = std::string("{zone=\"") + alloc_zone_name(zone) + "\"}";
+        stats_gauge("gusteau_alloc_live_bytes" + label, "Bytes currently allocated by a subsystem",
+                    [zone]() { return static_cast<double>(alloc_profiler_stats(zone).live_bytes); });
+        stats_gauge("gusteau_alloc_allocations" + label, "Allocations made by a subsystem since startup",
+                    [zone]() { return static_cast<double>(alloc_profiler_stats(zone).allocations); });
+        stats_gauge("gusteau_alloc_allocations_per_frame" + label, "Allocations made by a subsystem in the last frame",
+                    [zone]() { return static_cast<double>(alloc_profiler_stats(zone).allocations_per_frame); });
+    }
+}
+
 void UIEngine(std::shared_ptr<ApplicationContextBase> context)
 {
+    RegisterEngineStats();
+    StatsHistogram& frame_seconds = stats_histogram("gusteau_frame_seconds", "Time taken by a UI frame",
+        { 1.0 / 240, 1.0 / 120, 1.0 / 60, 1.0 / 30, 1.0 / 24, 1.0 / 15, 0.1, 0.25, 1 });
+    const double frame_period = 1.0 / 24.0;
+    int64_t frame_start = vclock_now_ns();
+
     while (!context->join_now)
     {
         // if the graphics viewport is not actively rendering, update at 24hz
         // When the render engine is in place, and has an animation mode,
         // this timeout should be set appropriately to the intended frame rate.
         // We'll come back to this later.
-        glfwWaitEventsTimeout(1.f / 24.f);
+        // On simulated time, there's no waiting; each frame moves the clock on
+        // by a frame period, running the timers that fall due.
+        if (vclock_simulated())
+        {
+            glfwPollEvents();
+            vclock_advance(vclock_ns(frame_period));
+        }
+        else
+            glfwWaitEventsTimeout(static_cast<float>(frame_period));
         context->ui->Render(*context.get());
         context->Update();
+        alloc_profiler_frame();
+        startup_first_frame();
+
+        int64_t now = vclock_now_ns();
+        frame_seconds.observe((now - frame_start) * 1e-9);
+        frame_start = now;
     }
 }
 
@@ -542,7 +782,7 @@ public:
         : UIContext(gc, window_name, width, height)
         {}
 
-    virtual void Run(ApplicationContext& ac) override
+    virtual void Run(ApplicationContextBase& ac) override
     {
         ImGui::Text("Hello world");
         if (ImGui::Button("Quit"))
@@ -552,9 +792,9 @@ public:
     }
 };
 
-std::unique_ptr<UIContext> CreateUIContext(GraphicsContext& gc)
+std::shared_ptr<UIContext> CreateUIContext(GraphicsContext& gc)
 {
-    auto ui = std::make_unique<GusteauChapter1UI>(gc, "gusteau", 1024, 1024);
+    auto ui = std::make_shared<GusteauChapter1UI>(gc, "gusteau", 1024, 1024);
     return ui;
 }
 ///>
@@ -112,10 +112,10 @@ void test_csp()
         CLOCK2 = (tick -> (tock -> CLOCK2 "clock2_tocked") "ticked")
     )csp";
 
-    CSP* csp_clock_sample = csp_parse(csp_clock_sample_src, strlen(csp_clock_sample_src));
+    CSP* csp_clock_sample = csp_parse(nullptr, csp_clock_sample_src, strlen(csp_clock_sample_src));
 
-    csp_bind_lambda(csp_clock_sample, "ticked", [](int){ printf("tick\n"); });
-    csp_bind_lambda(csp_clock_sample, "clock2_tocked", [](int){ printf("tock\n"); });
+    csp_bind_lambda(csp_clock_sample, "ticked", [](int){ LOG_INFO("tick"); });
+    csp_bind_lambda(csp_clock_sample, "clock2_tocked", [](int){ LOG_INFO("tock"); });
     csp_emit(csp_clock_sample, "tick", {});
     csp_emit(csp_clock_sample, "foo", {});   // an event in an unknown alphabet
     csp_emit(csp_clock_sample, "tock", {});
@@ -154,6 +154,62 @@ char* csp_ac_src = R"csp(
 #include "journal.h"
 #include <thread>
 
+/// A journal is read from a file as lines of the form name: data.
+///<C++
+std::vector<JournalEntry> ReadJournal(char const*const path)
+{
+    std::vector<JournalEntry> j;
+    if (!path)
+        return j;
+
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return j;
+
+    const size_t sz = 1024;
+    char buffer[sz];
+    while (fgets(buffer, sz, f))
+    {
+        ///>
+        /// This example is simplistic, as the only journal data that there is
+        /// to be loaded is string data. A following chapter will generaliize
+        /// this mechanism.
+        ///<C++
+        StrView b = lab::Text::Strip({buffer, sz});
+        StrView data_str = lab::Text::ScanForCharacter(b, ':');
+        std::string name{b.curr, size_t(data_str.curr - b.curr)};
+        Data<std::string>* data = new Data<std::string>(std::string{data_str.curr, data_str.sz});
+        j.emplace_back(std::move(JournalEntry(name, data)));
+    }
+
+    fclose(f);
+    return j;
+}
+
+///>
+/// Parsing the CSP definitions, and reading a journal named on the command
+/// line, don't depend on the windowing system, so they are prepared on a worker
+/// thread during startup.
+///<C++
+class Chapter2StartupData : public ApplicationStartupData
+{
+public:
+    ~Chapter2StartupData() { delete csp; }
+
+    CSP* csp = nullptr;
+    std::vector<JournalEntry> journal;
+};
+
+std::unique_ptr<ApplicationStartupData> PrepareApplicationContext(int argc, char** argv)
+{
+    auto data = std::make_unique<Chapter2StartupData>();
+    data->csp = csp_parse(nullptr, csp_ac_src, strlen(csp_ac_src));
+    if (argc > 1)
+        data->journal = ReadJournal(argv[1]);
+    return data;
+}
+///>
+
 ///<C++
 class ApplicationContext : public ApplicationContextBase
 {
@@ -163,14 +219,30 @@ public:
     , blackboard(new Blackboard())
     {
         ui = ui_;
-        CreateCSP();
     }
+
     ///>
-    /// Initialize all the CSP definitions
+    /// Initialization takes the CSP that was prepared during startup, and
+    /// replays the journal, if one was read.
     ///<C++
-    void CreateCSP()
+    virtual void Init(std::unique_ptr<ApplicationStartupData> data) override
     {
-        csp = csp_parse(nullptr, csp_ac_src, strlen(csp_ac_src));
+        auto startup = dynamic_cast<Chapter2StartupData*>(data.get());
+        CreateCSP(startup ? startup->csp : nullptr);
+        if (startup)
+        {
+            startup->csp = nullptr;
+            ReplayJournal(startup->journal);
+        }
+    }
+
+    ///>
+    /// Initialize all the CSP definitions, parsing them unless they've already
+    /// been parsed.
+    ///<C++
+    void CreateCSP(CSP* parsed)
+    {
+        csp = parsed ? parsed : csp_parse(nullptr, csp_ac_src, strlen(csp_ac_src));
 
         csp_bind_lambda(csp, "append_line", [this](int id)
         {
@@ -236,17 +308,12 @@ public:
         csp_bind_lambda(csp, "join_now", [this](int) { join_now = true; });
         ///>
 
-        /// A demonstration thread that runs at 10Hz, emitting ticks as it goes.
-        /// This shows a very simple way that threads can communicate.
+        /// A demonstration timer that runs at 10Hz, emitting ticks as it goes.
+        /// The timer runs on the virtual clock's thread, so this also shows a
+        /// very simple way that threads can communicate. On simulated time,
+        /// the ticks come as fast as the frames do.
         ///<C++
-        clock = std::thread([this]()
-        {
-            while (!join_now)
-            {
-                csp_emit(csp, "tick", 0);
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
-        });
+        clock = csp_every(csp, "tick", 0.1);
     }
     ///>
     /// Given a journal, replay that journal on the current context.
@@ -288,33 +355,7 @@ public:
     ///<C++
     void LoadJournal(char const*const path)
     {
-        if (!path)
-            return;
-
-        FILE* f = fopen(path, "rb");
-        if (!f)
-            return;
-
-        std::vector<JournalEntry> j;
-
-        const size_t sz = 1024;
-        char buffer[sz];
-        while (fgets(buffer, sz, f))
-        {
-            ///>
-            /// This example is simplistic, as the only journal data that there is
-            /// to be loaded is string data. A following chapter will generaliize
-            /// this mechanism.
-            ///<C++
-            StrView b = lab::Text::Strip({buffer, sz});
-            StrView data_str = lab::Text::ScanForCharacter(b, ':');
-            std::string name{b.curr, size_t(data_str.curr - b.curr)};
-            Data<std::string>* data = new Data<std::string>(std::string{data_str.curr, data_str.sz});
-            j.emplace_back(std::move(JournalEntry(name, data)));
-        }
-
-        fclose(f);
-        ReplayJournal(j);
+        ReplayJournal(ReadJournal(path));
     }
     ///>
     /// This version of the constructor also accepts a journal, and replays that
@@ -328,7 +369,7 @@ public:
     , blackboard(new Blackboard())
     {
         ui = ui_;
-        CreateCSP();
+        CreateCSP(nullptr);
         ReplayJournal(journal);
     }
 
@@ -341,9 +382,9 @@ public:
         join_now = true;
 
         ///>
-        /// Allow the clock thread to join gracefully
+        /// Stop the clock before the csp it emits to is deleted
         ///<C++
-        clock.join();
+        vclock_cancel(clock);
 
         delete csp;
         delete blackboard;
@@ -372,7 +413,7 @@ public:
     GraphicsContext& root_graphics_context;
     StateContext state;
     RenderContext render;
-    std::thread clock;
+    uint64_t clock = 0;
 
     int count = 0;
     std::vector<std::string> lines;
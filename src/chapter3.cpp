@@ -26,6 +26,16 @@
 #include "csp.h"
 #include "blackboard.h"
 #include "journal.h"
+#include "calc_array.h"
+#include "calc_program.h"
+#include "calc_import.h"
+#include "csp_analysis.h"
+#include "csp_checkpoint.h"
+#include "csp_image.h"
+#include "csp_inspector.h"
+#include "csp_record.h"
+#include "csp_watch.h"
+#include <atomic>
 #include <thread>
 ///
 /// Typical mechanisms for undo and redo will be illustrated via an application
@@ -41,8 +51,70 @@ char* csp_ac_src = R"csp(
     SUBTRACT = (subtract -> SUBTRACT "subtract")
     MULTIPLY = (multiply -> MULTIPLY "multiply")
     DIVIDE = (divide -> DIVIDE "divide")
+    RECORD = (record_program -> (stop_recording -> RECORD "program_recorded") "recording")
+    RUN_PROGRAM = (run_program -> (program_done -> RUN_PROGRAM "program_done") "run_program")
+    IMPORT_VALUES = (import_values -> IMPORT_VALUES "import_values")
     QUIT = (quit -> STOP "join_now")
 )csp";
+///>
+/// The RECORD process is the first one that isn't a simple loop. Once a
+/// recording has started, a second record_program does nothing until
+/// stop_recording has been seen. RUN_PROGRAM is the same; a program runs on
+/// its own thread, and another run_program does nothing until program_done
+/// has brought back the result.
+///
+/// Reserving the event queue's memory, and parsing the CSP, don't depend on
+/// the windowing system, so they are prepared on a worker thread during
+/// startup. The event queue draws its memory from an arena that is reserved,
+/// preferably as huge pages, and touched before the first event arrives;
+/// touching it is the slowest part of starting up.
+///<C++
+class Chapter3StartupData : public ApplicationStartupData
+{
+public:
+    ~Chapter3StartupData() { delete csp; }
+
+    CSP* csp = nullptr;
+};
+
+///>
+/// If GUSTEAU_CSP_SOURCE names a file, the CSP is defined by that file rather
+/// than by csp_ac_src, and is reloaded whenever the file is saved.
+///
+/// If GUSTEAU_CSP_CACHE names a file, the parsed CSP is kept there as a
+/// compiled image, and later runs load the image instead of parsing.
+///
+/// If GUSTEAU_CSP_RECORD names a file, every event emitted during the run is
+/// recorded there, to be replayed later by csp_odr.
+///
+/// If GUSTEAU_CSP_CHECKPOINT names a file, the state of the CSP is saved there
+/// on exit, and restored from there at the next start, so that the processes
+/// resume where they were.
+///<C++
+CSP* ParseCSP()
+{
+    CSP_Config config;
+    config.initial_capacity = 64 * CSP_QUEUE_BLOCK_SIZE;
+
+    std::string src = csp_ac_src;
+    if (char const*const path = getenv("GUSTEAU_CSP_SOURCE"))
+        if (!csp_watch_read(path, src))
+            LOG_WARN("could not read %s, using the built in CSP", path);
+
+    return csp_parse_cached(csp_create(config), src.data(), src.size(), getenv("GUSTEAU_CSP_CACHE"));
+}
+
+std::unique_ptr<ApplicationStartupData> PrepareApplicationContext(int, char**)
+{
+    CSP_QueuePoolConfig pool_config;
+    pool_config.arena_bytes = size_t(16) << 20;
+    pool_config.huge_pages = true;
+    csp_queue_pool_init(pool_config);
+
+    auto data = std::make_unique<Chapter3StartupData>();
+    data->csp = ParseCSP();
+    return data;
+}
 
 class ApplicationContext : public ApplicationContextBase
 {
@@ -52,6 +124,15 @@ public:
     , blackboard(new Blackboard())
     {
         ui = ui_;
+
+        ///>
+        /// Room for history, and for values in flight, is made up front so
+        /// that the steady state of the application doesn't allocate.
+        ///<C++
+        journal.reserve(4096);
+        blackboard_reserve(blackboard, 256);
+        batch_data.reserve(256);
+        batch_values.reserve(256);
     }
 
     ///>
@@ -59,34 +140,89 @@ public:
     /// the lambdas will need to create shared pointers to the 
     /// ApplicationContext. It's impossible from the constructor
     /// because the shared_pointer won't have been initialized yet.
-    virtual void Init() override
+    virtual void Init(std::unique_ptr<ApplicationStartupData> data) override
     {
-        CreateCSP();
+        auto startup = dynamic_cast<Chapter3StartupData*>(data.get());
+        CreateCSP(startup ? startup->csp : nullptr);
+        if (startup)
+            startup->csp = nullptr;
+
+        if (char const*const path = getenv("GUSTEAU_CSP_SOURCE"))
+            csp_watcher = csp_watch(csp, path);
+        if (char const*const path = getenv("GUSTEAU_CSP_RECORD"))
+            if (!(csp_recorder = csp_record_start(csp, path)))
+                LOG_WARN("could not record events to %s", path);
+        if (char const*const path = getenv("GUSTEAU_CSP_CHECKPOINT"))
+            if (!csp_checkpoint_load(csp, path))
+                LOG_INFO("no CSP checkpoint restored from %s", path);
     }
 
     ///>
-    /// Initialize all the CSP definitions
+    /// Initialize all the CSP definitions, parsing them unless they've already
+    /// been parsed.
     ///<C++
-    void CreateCSP()
+    void CreateCSP(CSP* parsed)
     {
-        csp = csp_parse(nullptr, csp_ac_src, strlen(csp_ac_src));
+        csp = parsed ? parsed : ParseCSP();
+
+        ///>
+        /// The depth of the event queue, and the sizes of the application's
+        /// state, are sampled whenever the stats are exported.
+        ///<C++
+        stats_gauge("gusteau_csp_queue_depth", "Events waiting in the CSP queue",
+                    [this]() { return static_cast<double>(csp->q->size_approx()); });
+        stats_gauge("gusteau_blackboard_entries", "Entries waiting on the blackboard",
+                    [this]() { return static_cast<double>(blackboard_size(blackboard)); });
+        stats_gauge("gusteau_journal_transactions", "Transactions in the undo history",
+                    [this]() { return static_cast<double>(journal.size()); });
 
         /// The execution of actions becomes complicated by the introduction of
         /// undo. The first consideration is that we mustn't keep references to
         /// the application context in all the history's lambdas
         std::shared_ptr<ApplicationContext> app = std::dynamic_pointer_cast<ApplicationContext>(this->shared_from_this());
 
-        csp_bind_lambda(csp, "push_value", [app](int id)
+        ///>
+        /// A burst of values, pasted or imported, arrives as a run of push value
+        /// events, so push_value is bound as a batch lambda. It is given every
+        /// payload in the run at once, takes them from the blackboard together,
+        /// and commits them as one transaction.
+        ///<C++
+        csp_bind_batch_lambda(csp, "push_value", [app](const int* ids, size_t count)
         {
-            if (id && app)
+            if (!app || !count)
+                return;
+
+            ///>
+            /// Each push value event comes with either a single floating
+            /// point value, or an array of them. Either way, it becomes one
+            /// entry on the stack.
+            ///<C++
+            std::vector<TypedData*>& data = app->batch_data;
+            std::vector<CalcArray>& values = app->batch_values;
+            data.resize(count);
+            blackboard_get_many(app->blackboard, ids, count, data.data());
+            for (TypedData* d : data)
             {
+                CalcArray value;
+                if (auto td = dynamic_cast<Data<float>*>(d))
+                    value = calc_array(td->value());
+                else if (auto ta = dynamic_cast<Data<CalcArray>*>(d))
+                    value = ta->value();
+
                 ///>
-                /// The append line event comes with a floating point value 
+                /// The data from the blackboard is not reference counted
+                /// so it must be deleted here. The stack entry shares the array
+                /// and will keep it alive.
                 ///<C++
-                TypedData* d = blackboard_get(app->blackboard, id);
-                auto td = dynamic_cast<Data<float>*>(d);
-                if (td)
-                {
+                delete d;
+
+                if (value.size())
+                    values.push_back(std::move(value));
+            }
+            data.clear();
+            if (values.empty())
+                return;
+
 ///>
 /// The operation modified the ApplicationContext, so record the operation
 /// in the journal. The journal records both the action that was taken, 
@@ -99,37 +235,48 @@ public:
 /// with one undo action. In a moment though, we will see an undo action that
 /// requires multiple steps that have to go together. We introduce therefore
 /// a Journal::Transaction that records a single atomic history/undo pair.
+/// A whole run of pushes is one transaction, and is undone together.
+/// The transaction keeps the values so that it can be redone. A single
+/// value fits in the transaction itself; a longer run is moved into a
+/// vector of its own.
 ///<C++
-                    Journal::Transaction transaction 
-                    {  "push_value", 
-                        [app, td]() 
-                        {
-                            app->value_stack.push_back(td->value());
-                        },
-                        [app]() 
-                        { 
-                            app->value_stack.pop_back(); 
-                        }
-                    };
-                    transaction.action();
-                    app->journal.commit(std::move(transaction));
-                }
-                else
+            size_t pushed = values.size();
+            Journal::Transaction transaction;
+            transaction.name = "push_value";
+            if (pushed == 1)
+            {
+                transaction.action = [app, value = std::move(values[0])]()
                 {
-                    ///>
-                    /// The data from the blackboard is not reference counted
-                    /// so it must be deleted here.
-                    ///<C++
-                    delete d;
-                }
+                    app->value_stack.push_back(value);
+                };
+            }
+            else
+            {
+                std::vector<CalcArray> run(std::make_move_iterator(values.begin()),
+                                           std::make_move_iterator(values.end()));
+                transaction.action = [app, run = std::move(run)]()
+                {
+                    app->value_stack.insert(app->value_stack.end(), run.begin(), run.end());
+                };
             }
+            transaction.undo = [app, pushed]()
+            {
+                app->value_stack.resize(app->value_stack.size() - pushed);
+            };
+            values.clear();
+            transaction.action();
+            app->journal.commit(std::move(transaction));
+
+            if (app->recording)
+                for (size_t i = app->value_stack.size() - pushed; i < app->value_stack.size(); ++i)
+                    app->recorder.push(app->value_stack[i]);
         });
         csp_bind_lambda(csp, "pop_value", [app](int)
         {
             if (app->value_stack.size())
             {
                 // remember the value that was at the back of the value stack.
-                float value = *app->value_stack.rbegin();
+                CalcArray value = *app->value_stack.rbegin();
 
                 /// The inverse of popping a value is to push it again.
                 Journal::Transaction transaction
@@ -146,129 +293,246 @@ public:
                 };
                 transaction.action();
                 app->journal.commit(std::move(transaction));
+
+                if (app->recording)
+                    app->recorder.pop();
             }
         });
-        csp_bind_lambda(csp, "add", [app](int)
+        ///>
+        /// The arithmetic operations all have the same shape, so they are
+        /// bound by a common function.
+        ///<C++
+        BindBinaryOp(app, "add", CalcOp::Add);
+        BindBinaryOp(app, "subtract", CalcOp::Subtract);
+        BindBinaryOp(app, "multiply", CalcOp::Multiply);
+        BindBinaryOp(app, "divide", CalcOp::Divide);
+        ///>
+        /// While recording, every successful push, pop and operation is noted
+        /// by the recorder, as well as performed. When recording stops, the
+        /// recording is compiled into a program. Undo and redo are not recorded.
+        ///<C++
+        csp_bind_lambda(csp, "recording", [app](int)
+        {
+            app->recorder.clear();
+            app->recording = true;
+        });
+        csp_bind_lambda(csp, "program_recorded", [app](int)
         {
-            ///>
-            /// This application is very simple, and doesn't report problems
-            /// such as not enough values on the stack. A real application would.
-            ///<C++
-            if (app->value_stack.size() >= 2)
+            app->recording = false;
+            app->program_valid = calc_program_compile(app->recorder, app->program);
+        });
+        ///>
+        /// Running the program is a single transaction, no matter how many
+        /// operations were recorded, or how long the arrays are. The program's
+        /// inputs are taken from the top of the stack, and replaced by the result.
+        /// Long arrays would stall the interface, so the program is run on its
+        /// own thread, and the result is handed back through the blackboard with
+        /// program_done. Every run_program is answered by a program_done, even
+        /// if there is nothing to run, so that RUN_PROGRAM is ready for the next.
+        ///<C++
+        csp_bind_lambda(csp, "run_program", [app](int)
+        {
+            if (!app->program_valid || app->recording ||
+                app->value_stack.size() < size_t(app->program.input_count))
             {
-                auto it = app->value_stack.rbegin();
-                float value2 = *it++;
-                float value1 = *it++;
-
-                /// the history needs only record that an add occurred.
-                /// The undo must remove the result, and push the original values.
-                /// This is where the transactional nature of the journal comes
-                /// into play.
-                Journal::Transaction transaction
-                {
-                    "add",
-                    [app, value1, value2]() 
-                    {
-                        app->value_stack.pop_back();
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1 + value2);
-                    },
-                    [app, value1, value2]() 
-                    {
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1);
-                        app->value_stack.emplace_back(value2);
-                    }
-                };
-                transaction.action();
-                app->journal.commit(std::move(transaction));
+                csp_emit(app->csp, "program_done", 0);
+                return;
             }
+
+            // inputs are ordered from the top of the stack down
+            int input_count = app->program.input_count;
+            std::vector<CalcArray> inputs(app->value_stack.rbegin(), app->value_stack.rbegin() + input_count);
+            app->RunProgram(std::move(inputs));
         });
-        csp_bind_lambda(csp, "subtract", [app](int)
+        ///>
+        /// The inputs are still on the stack when the result comes back,
+        /// unless the stack was changed while the program ran, in which case
+        /// the result no longer applies and is discarded.
+        ///<C++
+        csp_bind_lambda(csp, "program_done", [app](int id)
         {
-            if (app->value_stack.size() >= 2)
+            TypedData* d = blackboard_get(app->blackboard, id);
+            auto td = dynamic_cast<Data<CalcProgramRun>*>(d);
+            if (!td)
             {
-                auto it = app->value_stack.rbegin();
-                float value2 = *it++;
-                float value1 = *it++;
+                delete d;
+                return;
+            }
+            std::vector<CalcArray> inputs = td->value().inputs;
+            CalcArray result = td->value().result;
+            delete d;
 
-                Journal::Transaction transaction
-                {
-                    "subtract",
-                    [app, value1, value2]() 
-                    {
-                        app->value_stack.pop_back();
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1 - value2);
-                    },
-                    [app, value1, value2]() 
-                    {
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1);
-                        app->value_stack.emplace_back(value2);
-                    }
-                };
-                transaction.action();
-                app->journal.commit(std::move(transaction));
+            int input_count = static_cast<int>(inputs.size());
+            bool current = app->value_stack.size() >= inputs.size();
+            for (int i = 0; current && i < input_count; ++i)
+                current = app->value_stack.rbegin()[i].data() == inputs[i].data();
+            if (!current)
+            {
+                LOG_INFO("the stack changed while the program ran; its result is discarded");
+                return;
             }
-        });
-        csp_bind_lambda(csp, "multiply", [app](int)
-        {
-                auto it = app->value_stack.rbegin();
-                float value2 = *it++;
-                float value1 = *it++;
 
-                Journal::Transaction transaction
+            Journal::Transaction transaction
+            {
+                "run_program",
+                [app, input_count, result]()
                 {
-                    "multiply",
-                    [app, value1, value2]() 
-                    {
-                        app->value_stack.pop_back();
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1 * value2);
-                    },
-                    [app, value1, value2]() 
-                    {
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1);
-                        app->value_stack.emplace_back(value2);
-                    }
-                };
-                transaction.action();
-                app->journal.commit(std::move(transaction));
+                    app->value_stack.resize(app->value_stack.size() - input_count);
+                    app->value_stack.push_back(result);
+                },
+                [app, inputs]()
+                {
+                    app->value_stack.pop_back();
+                    app->value_stack.insert(app->value_stack.end(), inputs.rbegin(), inputs.rend());
+                }
+            };
+            transaction.action();
+            app->journal.commit(std::move(transaction));
         });
-        csp_bind_lambda(csp, "divide", [app](int)
+        ///>
+        /// An import arrives as a set of columns, which are pushed together
+        /// as one transaction. No matter how much data was imported, the undo
+        /// is simply to shrink the stack; the arrays are reference counted and
+        /// are released when no longer referred to by the stack or the journal.
+        ///<C++
+        csp_bind_lambda(csp, "import_values", [app](int id)
         {
-            if (app->value_stack.size() >= 2)
+            TypedData* d = blackboard_get(app->blackboard, id);
+            auto td = dynamic_cast<Data<CalcColumns>*>(d);
+            if (td && td->value().columns.size())
             {
-                auto it = app->value_stack.rbegin();
-                float value2 = *it++;
-                float value1 = *it++;
-
+                CalcColumns columns = td->value();
+                size_t count = columns.columns.size();
                 Journal::Transaction transaction
                 {
-                    "divide",
-                    [app, value1, value2]() 
+                    "import_values",
+                    [app, columns]()
                     {
-                        app->value_stack.pop_back();
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1 / value2);
+                        app->value_stack.insert(app->value_stack.end(), columns.columns.begin(), columns.columns.end());
                     },
-                    [app, value1, value2]() 
+                    [app, count]()
                     {
-                        app->value_stack.pop_back();
-                        app->value_stack.emplace_back(value1);
-                        app->value_stack.emplace_back(value2);
+                        app->value_stack.resize(app->value_stack.size() - count);
                     }
                 };
                 transaction.action();
                 app->journal.commit(std::move(transaction));
             }
+            delete d;
         });
         ///>
         /// The join_now action is here, bound by name to the csp QUIT process.
         ///<C++
         csp_bind_lambda(csp, "join_now", [this](int) { join_now = true; });
+
+        ///>
+        /// With every lambda bound, the processes that can never fire are
+        /// dropped, and anything suspicious in the definitions is reported.
+        ///<C++
+        CSP_Analysis analysis;
+        csp_analyze(csp, analysis);
+        csp_analysis_log(analysis);
+    }
+
+    ///>
+    /// Stack entries are arrays, and the operators work element by element.
+    /// If one of the operands is a scalar, it is broadcast across the other.
+    /// The arithmetic itself is done by the vectorized kernels in calc_array.h.
+    ///<C++
+    void BindBinaryOp(std::shared_ptr<ApplicationContext> app, char const*const name, CalcOp op)
+    {
+        std::string op_name{name};
+        csp_bind_lambda(csp, name, [app, op_name, op](int)
+        {
+            ///>
+            /// This application is very simple, and doesn't report problems
+            /// such as not enough values on the stack, or arrays of different
+            /// lengths. A real application would.
+            ///<C++
+            if (app->value_stack.size() < 2)
+                return;
+
+            auto it = app->value_stack.rbegin();
+            CalcArray value2 = *it++;
+            CalcArray value1 = *it++;
+            CalcArray result;
+            if (!calc_apply(op, value1, value2, result))
+                return;
+
+            /// The history needs only record that the operation occurred.
+            /// The undo must remove the result, and push the original values.
+            /// This is where the transactional nature of the journal comes
+            /// into play. Neither the history nor the undo copy any arrays;
+            /// they share the operands and the result with the stack.
+            Journal::Transaction transaction
+            {
+                op_name,
+                [app, result]() 
+                {
+                    app->value_stack.pop_back();
+                    app->value_stack.pop_back();
+                    app->value_stack.push_back(result);
+                },
+                [app, value1, value2]() 
+                {
+                    app->value_stack.pop_back();
+                    app->value_stack.push_back(value1);
+                    app->value_stack.push_back(value2);
+                }
+            };
+            transaction.action();
+            app->journal.commit(std::move(transaction));
+
+            if (app->recording)
+                app->recorder.binary(op);
+        });
+    }
+
+    ///>
+    /// Reading and parsing a large file would stall the interface if it were
+    /// done in a lambda, so the import runs on its own thread. When it's done,
+    /// the columns are handed over through the blackboard, exactly as the
+    /// interface hands over a value it wants pushed.
+    ///<C++
+    void Import(const std::string& path)
+    {
+        if (importing.exchange(true))
+            return;
+
+        if (import_thread.joinable())
+            import_thread.join();
+
+        import_thread = std::thread([this, path]()
+        {
+            CalcColumns columns;
+            if (calc_import(path.c_str(), columns))
+            {
+                int id = blackboard_new_entry(blackboard, new Data<CalcColumns>(columns));
+                csp_emit(csp, "import_values", id);
+            }
+            importing = false;
+        });
+    }
+
+    ///>
+    /// The program runs on a copy of itself, so that recording another one
+    /// meanwhile doesn't disturb it. Its inputs are shared with the stack.
+    ///<C++
+    void RunProgram(std::vector<CalcArray> inputs)
+    {
+        if (program_thread.joinable())
+            program_thread.join();
+
+        running_program = true;
+        program_thread = std::thread([this, program = program, inputs = std::move(inputs)]()
+        {
+            CalcArray result;
+            int id = 0;
+            if (calc_program_run(program, inputs.data(), result))
+                id = blackboard_new_entry(blackboard, new Data<CalcProgramRun>(CalcProgramRun{ inputs, result }));
+            running_program = false;
+            csp_emit(csp, "program_done", id);
+        });
     }
 
     ~ApplicationContext()
@@ -279,6 +543,23 @@ public:
         ///<C++
         join_now = true;
 
+        if (import_thread.joinable())
+            import_thread.join();
+        if (program_thread.joinable())
+            program_thread.join();
+
+        stats_unregister("gusteau_csp_queue_depth");
+        stats_unregister("gusteau_blackboard_entries");
+        stats_unregister("gusteau_journal_transactions");
+
+        csp_unwatch(csp_watcher);
+        if (csp_recorder && !csp_record_stop(csp_recorder))
+            LOG_WARN("the event recording is incomplete");
+        if (char const*const path = getenv("GUSTEAU_CSP_CHECKPOINT"))
+            if (!csp_checkpoint_save(csp, path))
+                LOG_WARN("could not save a CSP checkpoint to %s", path);
+        csp_cancel_timers(csp);
+
         delete csp;
         delete blackboard;
     }
@@ -308,9 +589,25 @@ public:
     RenderContext render;
 
     int count = 0;
-    std::vector<float> value_stack;
+    std::vector<CalcArray> value_stack;
+
+    // scratch for push_value runs, reused so that a run doesn't allocate
+    std::vector<TypedData*> batch_data;
+    std::vector<CalcArray> batch_values;
+
+    bool recording = false;
+    bool program_valid = false;
+    CalcProgramRecorder recorder;
+    CalcProgram program;
+
+    std::thread import_thread;
+    std::atomic<bool> importing{false};
+    std::thread program_thread;
+    std::atomic<bool> running_program{false};
 
     CSP* csp = nullptr;
+    CSP_Watcher* csp_watcher = nullptr;
+    CSP_Recorder* csp_recorder = nullptr;
     Blackboard* blackboard = nullptr;
 
     Journal journal;
@@ -339,15 +636,37 @@ public:
         {
             csp_emit(app->csp, "quit", 0);
         }
+        ImGui::SameLine();
+        ImGui::Checkbox("Inspector", &inspector.open);
 
 
         static char buff[256];
         ImGui::InputText("###value", buff, sizeof(buff));
         if (ImGui::Button("Push"))
         {
-            float v = static_cast<float>(atof(buff));
-            int id = blackboard_new_entry(app->blackboard, new Data<float>(v));
-            csp_emit(app->csp, "push_value", id);
+            ///>
+            /// A single number is pushed as a scalar, a list of numbers
+            /// separated by commas or spaces is pushed as an array.
+            ///<C++
+            char* end = nullptr;
+            float v = strtof(buff, &end);
+            char const* curr = end + strspn(end, ", \t");
+
+            int id = 0;
+            if (end != buff && !*curr)
+                id = blackboard_new_entry(app->blackboard, new Data<float>(v));
+            else if (end != buff)
+            {
+                std::vector<float> values{v};
+                for (v = strtof(curr, &end); end != curr; v = strtof(curr, &end))
+                {
+                    values.push_back(v);
+                    curr = end + strspn(end, ", \t");
+                }
+                id = blackboard_new_entry(app->blackboard, new Data<CalcArray>(calc_array(std::move(values))));
+            }
+            if (id)
+                csp_emit(app->csp, "push_value", id);
         }
         ImGui::SameLine();
         if (ImGui::Button("Pop"))
@@ -375,15 +694,66 @@ public:
             app->journal.redo();
         }
 
+        if (!app->recording)
+        {
+            if (ImGui::Button("Record"))
+                csp_emit(app->csp, "record_program", 0);
+        }
+        else if (ImGui::Button("Stop Recording"))
+            csp_emit(app->csp, "stop_recording", 0);
+        ImGui::SameLine();
+        if (app->running_program)
+            ImGui::TextUnformatted("running...");
+        else if (ImGui::Button("Run"))
+            csp_emit(app->csp, "run_program", 0);
+        if (app->program_valid)
+        {
+            ImGui::SameLine();
+            ImGui::Text("program: %d inputs, %zu bytes", app->program.input_count, app->program.code.size());
+        }
+
+        static char path[1024];
+        ImGui::InputText("###path", path, sizeof(path));
+        ImGui::SameLine();
+        if (app->importing)
+            ImGui::TextUnformatted("importing...");
+        else if (ImGui::Button("Import"))
+            app->Import(path);
+
         ImGui::TextUnformatted("------ STACK ------");
         size_t sz = app->value_stack.size();
         for (auto i = 0; i < sz; ++i)
         {
-            char buff[256];
-            sprintf(buff, "%f", app->value_stack[i]);
-            ImGui::TextUnformatted(buff);
+            ///>
+            /// Arrays are shown with their length, and long arrays are
+            /// summarized by their first few values.
+            ///<C++
+            const CalcArray& a = app->value_stack[i];
+            if (a.size() == 1)
+                ImGui::Text("%f", a[0]);
+            else
+            {
+                ImGui::Text("[%zu]", a.size());
+                for (size_t j = 0; j < a.size() && j < 4; ++j)
+                {
+                    ImGui::SameLine();
+                    ImGui::Text("%f", a[j]);
+                }
+                if (a.size() > 4)
+                {
+                    ImGui::SameLine();
+                    ImGui::TextUnformatted("...");
+                }
+            }
         }
+
+        ///>
+        /// The inspector is drawn here, on the thread that updates the CSP.
+        ///<C++
+        csp_inspector_draw(inspector, app->csp);
     }
+
+    CSP_Inspector inspector;
 };
 ///>
 
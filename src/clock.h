@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+// The time seen by timers, the engines and the instrumentation. In real mode,
+// it's the steady clock, and timers run on a thread of their own, at their due
+// time. In simulation mode, time stands still until vclock_advance moves it,
+// and the timers due along the way run on the advancing thread, one at a time.
+// Timers due at the same time always run in the order they were created, so a
+// simulation that advances in the same steps plays out the same way every
+// time, however fast the machine.
+//
+// The mode must be chosen before any timer is created.
+
+enum class VirtualClockMode { Real, Simulation };
+
+struct VirtualClockTimer
+{
+    int64_t period_ns;      // 0 for a timer that runs once
+    std::function<void()> fn;
+};
+
+struct VirtualClock
+{
+    std::atomic<VirtualClockMode> mode{VirtualClockMode::Real};
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::atomic<int64_t> simulated_ns{0};
+
+    // timers, ordered by due time, and then by id
+    std::mutex timers_mutex;
+    std::condition_variable timers_changed;
+    std::map<std::pair<int64_t, uint64_t>, VirtualClockTimer> timers;
+    std::unordered_map<uint64_t, int64_t> due;      // by id
+    uint64_t next_id = 1;
+    uint64_t running_id = 0;                        // the timer being run, if any
+
+    std::thread thread;                             // runs the timers in real mode
+};
+
+// Leaked, so that the time may be read during static destruction; the timer
+// thread, if any, is left waiting when the process exits.
+VirtualClock& vclock_instance()
+{
+    static VirtualClock* clock = new VirtualClock();
+    return *clock;
+}
+
+void vclock_set_mode(VirtualClockMode mode)
+{
+    vclock_instance().mode.store(mode, std::memory_order_relaxed);
+}
+
+bool vclock_simulated()
+{
+    return vclock_instance().mode.load(std::memory_order_relaxed) == VirtualClockMode::Simulation;
+}
+
+int64_t vclock_now_ns()
+{
+    VirtualClock& c = vclock_instance();
+    if (c.mode.load(std::memory_order_relaxed) == VirtualClockMode::Simulation)
+        return c.simulated_ns.load(std::memory_order_acquire);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - c.start).count();
+}
+
+double vclock_seconds()
+{
+    return vclock_now_ns() * 1e-9;
+}
+
+int64_t vclock_ns(double seconds)
+{
+    return static_cast<int64_t>(seconds * 1e9 + 0.5);
+}
+
+// Takes the earliest timer if it's due by until. Called with the timers locked.
+bool vclock_take_due(VirtualClock& c, int64_t until, int64_t& when, uint64_t& id, VirtualClockTimer& timer)
+{
+    if (c.timers.empty() || c.timers.begin()->first.first > until)
+        return false;
+
+    auto it = c.timers.begin();
+    when = it->first.first;
+    id = it->first.second;
+    timer = std::move(it->second);
+    c.timers.erase(it);
+    c.running_id = id;
+    return true;
+}
+
+// Puts a periodic timer back after it has run, unless it was cancelled while it
+// ran. Called with the timers locked.
+void vclock_reschedule(VirtualClock& c, int64_t when, uint64_t id, VirtualClockTimer& timer)
+{
+    c.running_id = 0;
+    auto it = c.due.find(id);
+    if (it == c.due.end())
+        return;
+    if (!timer.period_ns)
+    {
+        c.due.erase(it);
+        return;
+    }
+    it->second = when + timer.period_ns;
+    c.timers.emplace(std::make_pair(it->second, id), std::move(timer));
+}
+
+void vclock_run_real(VirtualClock& c)
+{
+    std::unique_lock<std::mutex> lock(c.timers_mutex);
+    for (;;)
+    {
+        if (c.timers.empty())
+        {
+            c.timers_changed.wait(lock);
+            continue;
+        }
+
+        int64_t when;
+        uint64_t id;
+        VirtualClockTimer timer;
+        if (!vclock_take_due(c, vclock_now_ns(), when, id, timer))
+        {
+            c.timers_changed.wait_until(lock, c.start + std::chrono::nanoseconds(c.timers.begin()->first.first));
+            continue;
+        }
+
+        lock.unlock();
+        timer.fn();
+        lock.lock();
+        vclock_reschedule(c, when, id, timer);
+        c.timers_changed.notify_all();
+    }
+}
+
+// Runs fn after delay_ns, and then every period_ns if that's not zero. Returns
+// the timer's id, for vclock_cancel.
+uint64_t vclock_schedule(int64_t delay_ns, int64_t period_ns, std::function<void()> fn)
+{
+    if (!fn)
+        return 0;
+
+    VirtualClock& c = vclock_instance();
+    std::lock_guard<std::mutex> lock(c.timers_mutex);
+    uint64_t id = c.next_id++;
+    int64_t when = vclock_now_ns() + std::max<int64_t>(delay_ns, 0);
+    c.timers.emplace(std::make_pair(when, id), VirtualClockTimer{ std::max<int64_t>(period_ns, 0), std::move(fn) });
+    c.due.emplace(id, when);
+
+    if (c.mode.load(std::memory_order_relaxed) == VirtualClockMode::Real && !c.thread.joinable())
+        c.thread = std::thread([&c]() { vclock_run_real(c); });
+    c.timers_changed.notify_all();
+    return id;
+}
+
+uint64_t vclock_after(double seconds, std::function<void()> fn)
+{
+    return vclock_schedule(vclock_ns(seconds), 0, std::move(fn));
+}
+
+uint64_t vclock_every(double seconds, std::function<void()> fn)
+{
+    int64_t period = std::max<int64_t>(vclock_ns(seconds), 1);
+    return vclock_schedule(period, period, std::move(fn));
+}
+
+// The time a timer is next due, or -1 if it isn't scheduled. A timer that is
+// running is due at the time it was due, until it's rescheduled.
+int64_t vclock_due(uint64_t id)
+{
+    VirtualClock& c = vclock_instance();
+    std::lock_guard<std::mutex> lock(c.timers_mutex);
+    auto it = c.due.find(id);
+    return it != c.due.end() ? it->second : -1;
+}
+
+// Cancels a timer. If it's running on another thread, waits for it to finish,
+// so that whatever it refers to may be destroyed once this returns.
+void vclock_cancel(uint64_t id)
+{
+    if (!id)
+        return;
+
+    VirtualClock& c = vclock_instance();
+    std::unique_lock<std::mutex> lock(c.timers_mutex);
+    auto it = c.due.find(id);
+    if (it == c.due.end())
+        return;
+    c.timers.erase(std::make_pair(it->second, id));
+    c.due.erase(it);
+
+    if (c.mode.load(std::memory_order_relaxed) == VirtualClockMode::Real && c.thread.get_id() != std::this_thread::get_id())
+        c.timers_changed.wait(lock, [&c, id]() { return c.running_id != id; });
+}
+
+// Simulation mode only: moves time forward by ns, running the timers that fall
+// due along the way, each at its due time. Returns the number of timers run.
+size_t vclock_advance(int64_t ns)
+{
+    VirtualClock& c = vclock_instance();
+    if (c.mode.load(std::memory_order_relaxed) != VirtualClockMode::Simulation)
+        return 0;
+
+    int64_t until = c.simulated_ns.load(std::memory_order_relaxed) + std::max<int64_t>(ns, 0);
+    size_t count = 0;
+    std::unique_lock<std::mutex> lock(c.timers_mutex);
+    int64_t when;
+    uint64_t id;
+    VirtualClockTimer timer;
+    while (vclock_take_due(c, until, when, id, timer))
+    {
+        c.simulated_ns.store(when, std::memory_order_release);
+        lock.unlock();
+        timer.fn();
+        ++count;
+        lock.lock();
+        vclock_reschedule(c, when, id, timer);
+    }
+    c.simulated_ns.store(until, std::memory_order_release);
+    return count;
+}
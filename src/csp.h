@@ -1,30 +1,106 @@
-
+#pragma once
 
 #include "LabText.h"
 #include "ConcurrentQueue.h"
+#include "alloc_profiler.h"
+#include "clock.h"
+#include "csp_executor.h"
+#include "csp_guard.h"
+#include "csp_queue.h"
+#include "log.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+// Event names are carried inline in the event, so that emitting an event
+// doesn't allocate. Longer names can't be emitted.
+#ifndef CSP_EVENT_NAME_MAX
+#define CSP_EVENT_NAME_MAX 64
+#endif
+
+// The number of distinct event names that are counted individually; events
+// with names beyond these are only counted in the totals.
+#ifndef CSP_EVENT_STATS_SLOTS
+#define CSP_EVENT_STATS_SLOTS 256
+#endif
+
+struct CSP_Lambda;
+
 struct CSP_Process
 {
     std::string name;
     std::string event;
+    CSP_Guard guard;                    // on the event's payload, if any
     std::string behavior;
     std::string out;
+    int ordinal = 0;                    // among the definitions of name; see csp_number_definitions
+
+    std::atomic<uint64_t> fired{0};     // events this process has accepted
+
+    // resolved by csp_link whenever the processes or lambdas change
+    std::vector<int> next;              // the processes named by behavior
+    bool recurs = false;                // behavior names this process
+    CSP_Lambda* lambda = nullptr;       // bound to out, if any
+
+    // the guard's results for events of the run being dispatched, from
+    // guard_begin on; see csp_guard_holds
+    uint64_t guard_run = 0;
+    size_t guard_begin = 0;
+    std::vector<uint8_t> guard_pass;
 };
 
 using lab::Text::StrView;
 
-StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>>& processes, bool& error_raised)
+// Event names are hierarchical, their segments separated by dots, as in
+// input.key.down. A process may accept a pattern rather than a name: a * segment
+// matches any one segment, as in input.*.down, and a * at the end matches one
+// or more, so that net.* accepts net.msg and net.msg.ack.
+bool csp_valid_event_pattern(StrView token)
+{
+    size_t segment = 0;     // length of the segment so far
+    bool star = false;
+    for (size_t i = 0; i < token.sz; ++i)
+    {
+        char c = token.curr[i];
+        if (c == '.')
+        {
+            if (!segment)
+                return false;
+            segment = 0;
+            star = false;
+            continue;
+        }
+        if (star || (c == '*' && segment))
+            return false;   // * must be the whole segment
+        star = c == '*';
+        ++segment;
+    }
+    return segment > 0;
+}
+
+// Anonymous nested processes are named after their parent, and numbered from
+// zero within each top level process, so that parsing the same definition
+// always produces the same names.
+StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>>& processes,
+                          std::map<std::string, int, std::less<>>& anonymous, bool& error_raised)
 {
     // starting from just after the opening parenthesis
     curr = SkipCommentsAndWhitespace(curr);
     StrView token;
-    curr = GetTokenAlphaNumeric(curr, token);
-    if (IsEmpty(token))
+    curr = GetTokenAlphaNumericExt(curr, "_.*", token);
+    if (IsEmpty(token) || !csp_valid_event_pattern(token))
     {
         error_raised = true;
         return curr;
@@ -33,7 +109,22 @@ StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>
     CSP_Process* p = (*processes.rbegin()).get();
     p->event.assign(token.curr, token.sz);
 
+    // an optional guard: event [guard] -> behavior
     curr = SkipCommentsAndWhitespace(curr);
+    token = Expect(curr, StrView{"[", 1});
+    if (token != curr)
+    {
+        StrView guard;
+        curr = GetToken(token, ']', guard);
+        token = Expect(curr, StrView{"]", 1});
+        if (token == curr || !csp_guard_compile(guard.curr, guard.sz, p->guard))
+        {
+            error_raised = true;
+            return curr;
+        }
+        curr = SkipCommentsAndWhitespace(token);
+    }
+
     token = Expect(curr, StrView{"->", 2});
     if (token == curr)
     {
@@ -47,15 +138,14 @@ StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>
     if (token != curr)
     {
         // create an anonymous nested process
-        static int unique = 0;
         CSP_Process* p2 = new CSP_Process();
         char buff[256];
-        sprintf(buff, "__%s_%d", p->name.c_str(), unique++);
+        snprintf(buff, sizeof(buff), "__%s_%d", p->name.c_str(), anonymous[p->name]++);
         p2->name.assign(buff);
         p->behavior = p2->name;
         processes.emplace_back(std::unique_ptr<CSP_Process>(p2));
 
-        curr = parse_csp_process(token, processes, error_raised);
+        curr = parse_csp_process(token, processes, anonymous, error_raised);
         if (error_raised)
             return curr;
     }
@@ -96,30 +186,276 @@ StrView parse_csp_process(StrView curr, std::vector<std::unique_ptr<CSP_Process>
     return token;
 }
 
+// The shared state of a call made with csp_call. It is referenced by the call's
+// futures and by the event in flight, and freed with the last of them.
+struct CSP_CallState
+{
+    std::atomic<int> refs{1};
+    std::mutex mutex;
+    bool done = false;
+    bool answered = false;      // false if no handler replied
+    int value = 0;
+    std::function<void(bool, int)> continuation;
+    CSP_Executor* executor = nullptr;
+};
+
+void csp_call_release(CSP_CallState* call)
+{
+    if (call && call->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete call;
+}
+
+// Completes a call, once; later completions are ignored. The continuation, if
+// one has been attached, is posted to the caller's executor.
+void csp_call_complete(CSP_CallState* call, bool answered, int value)
+{
+    std::function<void(bool, int)> continuation;
+    {
+        std::lock_guard<std::mutex> lock(call->mutex);
+        if (call->done)
+            return;
+        call->done = true;
+        call->answered = answered;
+        call->value = value;
+        continuation.swap(call->continuation);
+    }
+    if (continuation)
+        csp_executor_post(call->executor, [continuation = std::move(continuation), answered, value]() { continuation(answered, value); });
+}
+
+// The result of csp_call. The continuation given to then is called with whether
+// a handler replied, and its value, on the executor given to csp_call; it is
+// never called on the thread that completes the call.
+struct CSP_Future
+{
+    CSP_Future() = default;
+    explicit CSP_Future(CSP_CallState* s) : state(s) {}
+    CSP_Future(const CSP_Future& f) : state(f.state) { if (state) state->refs.fetch_add(1, std::memory_order_relaxed); }
+    CSP_Future(CSP_Future&& f) noexcept : state(f.state) { f.state = nullptr; }
+    CSP_Future& operator=(CSP_Future f) { std::swap(state, f.state); return *this; }
+    ~CSP_Future() { csp_call_release(state); }
+
+    bool valid() const { return state != nullptr; }
+
+    bool ready() const
+    {
+        if (!state)
+            return false;
+        std::lock_guard<std::mutex> lock(state->mutex);
+        return state->done;
+    }
+
+    // Only meaningful once ready.
+    bool answered() const { return state && ready() && state->answered; }
+    int value() const { return state && ready() ? state->value : 0; }
+
+    void then(std::function<void(bool, int)> fn)
+    {
+        if (!state || !fn)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (!state->done)
+            {
+                state->continuation = std::move(fn);
+                return;
+            }
+        }
+        bool answered = state->answered;
+        int value = state->value;
+        csp_executor_post(state->executor, [fn = std::move(fn), answered, value]() { fn(answered, value); });
+    }
+
+    CSP_CallState* state = nullptr;
+};
+
 struct CSP_Event
+{
+    char name[CSP_EVENT_NAME_MAX];
+    int id;
+    int slot;               // index into the CSP's event stats, or -1
+    int depth;              // 0 if emitted from outside a handler
+    CSP_CallState* call;    // set by csp_call, holding a reference
+};
+
+// Counts for one event name. A slot is claimed by the first emit of a name, by
+// setting its hash, and is never released, so the counts can be read at any
+// time without a lock.
+struct CSP_EventStats
+{
+    std::atomic<uint32_t> hash{0};
+    std::atomic<bool> named{false};
+    char name[CSP_EVENT_NAME_MAX];
+    std::atomic<uint64_t> emitted{0};
+    std::atomic<uint64_t> dispatched{0};
+    std::atomic<uint64_t> unmatched{0};  // dispatched, but accepted by no process
+};
+
+// Sees every event emitted to a CSP from outside its handlers, on the emitting
+// thread, before the event is queued; see csp_record.h. The events handlers emit
+// are not seen, as they follow from the ones that are.
+struct CSP_EmitTap
+{
+    virtual ~CSP_EmitTap() = default;
+    virtual void emitted(const CSP_Event& event) = 0;
+};
+
+// Sees every event once it has been dispatched, on the updating thread, with
+// the process data locked; see csp_sink.h.
+struct CSP_DispatchTap
+{
+    virtual ~CSP_DispatchTap() = default;
+    virtual void dispatched(const CSP_Event& event, bool matched) = 0;
+};
+
+// A lambda either acts on an event, replies to it, or acts on a batch of
+// events; see csp_bind_call and csp_bind_batch_lambda.
+struct CSP_Lambda
+{
+    std::function<void(int)> fn;
+    std::function<int(int)> reply;
+    std::function<void(const int*, size_t)> batch_fn;
+    std::vector<int> batch;                 // payloads waiting for batch_fn
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> timed_calls{0};   // calls made while timing was enabled
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+};
+
+struct CSP_Timer
 {
     std::string name;
     int id;
+    int64_t period_ns;      // 0 for a timer that runs once
+};
+
+// The most queued events dequeued at once by csp_update.
+static constexpr size_t csp_run_max = 64;
+
+// A trie of the processes' event patterns, by segment, built by csp_link, so
+// that finding the processes that accept an event takes a step per segment of
+// its name, however many patterns there are.
+struct CSP_EventTrieNode
+{
+    std::map<std::string, int, std::less<>> children;  // by literal segment
+    int wildcard = -1;                  // the child for a * segment
+    std::vector<int> processes;         // whose patterns end here
+    std::vector<int> prefixed;          // whose patterns end here, followed by .*
 };
+
 struct CSP
 {
+    explicit CSP(const CSP_Config& config = CSP_Config())
+    : q(csp_queue_create<CSP_Event>(config.queue, config.initial_capacity))
+    , queue_kind(config.queue)
+    , max_cascade_depth(config.max_cascade_depth)
+    {
+        local.reserve(64);
+        batched.reserve(8);
+        run.reserve(csp_run_max);
+        run_ids.reserve(csp_run_max);
+    }
+
     std::vector<std::unique_ptr<CSP_Process>> processes;
     std::vector<int> process_active;
-    std::map<std::string, std::function<void(int)>, std::less<>> lambdas;
-    moodycamel::ConcurrentQueue<CSP_Event> q;
+    std::map<std::string, CSP_Lambda, std::less<>> lambdas;
+    std::unique_ptr<CSP_Queue<CSP_Event>> q;
+    const CSP_QueueKind queue_kind;
     std::mutex process_data_mutex;
+
+    CSP_EventStats event_stats[CSP_EVENT_STATS_SLOTS];
+    std::atomic<uint64_t> unmatched{0};
+    std::atomic<bool> time_lambdas{false};
+
+    // runs the continuations of calls made without an executor of their own;
+    // drained at the end of each csp_update
+    CSP_Executor executor;
+
+    // Events emitted by handlers during an update. Only the updating thread
+    // touches these, so they need no synchronization.
+    std::vector<CSP_Event> local;
+    int dispatch_depth = 0;
+    int max_cascade_depth;
+    uint64_t local_emitted = 0;
+    uint64_t cascade_dropped = 0;
+
+    // set by csp_set_emit_tap; emitters count themselves in emit_tap_users
+    // while they use it, so that it can be removed safely
+    std::atomic<CSP_EmitTap*> emit_tap{nullptr};
+    std::atomic<int> emit_tap_users{0};
+
+    // changed only with the process data locked
+    std::vector<CSP_DispatchTap*> dispatch_taps;
+
+    // batch lambdas holding payloads, all for the event in batch_slot
+    std::vector<CSP_Lambda*> batched;
+    int batch_slot = -1;
+    int batch_depth = 0;
+
+    // The processes accepting each event, memoized per event slot. A slot's
+    // list is rebuilt when its generation is behind the CSP's, which csp_link
+    // advances. Processes that become active on a transition are collected in
+    // pending, and made active after the event has been dispatched.
+    uint64_t generation = 1;
+    std::vector<int> dispatch[CSP_EVENT_STATS_SLOTS];
+    uint64_t dispatch_generation[CSP_EVENT_STATS_SLOTS] = {};
+    std::vector<int> pending;
+    std::vector<CSP_EventTrieNode> trie;    // the root first
+    std::vector<int> unslotted;             // the dispatch list of an event without a slot
+
+    // Queued events are dequeued a run at a time, so that a guard can be
+    // evaluated over the consecutive events of a run that it's offered, at
+    // once. run_index is that of the event being dispatched, or SIZE_MAX if
+    // it was emitted by a handler.
+    std::vector<CSP_Event> run;
+    size_t run_index = SIZE_MAX;
+    uint64_t run_serial = 0;
+    std::vector<int> run_ids;
+
+    // the timers made by csp_every and csp_after, by id
+    std::mutex timers_mutex;
+    std::map<uint64_t, CSP_Timer> timers;
+
+    // a definition staged by csp_reload, applied by the next csp_update
+    std::mutex reload_mutex;
+    std::vector<std::unique_ptr<CSP_Process>> reload_processes;
+    std::atomic<bool> reload_pending{false};
+    bool prune = false;     // set by csp_analyze when it prunes, so reloads are pruned too
 };
 
-// merge into an existing csp, or return a new one if supplied with nullptr
-CSP* csp_parse(CSP* csp, char const*const src, size_t len)
+// create an empty csp, to parse into
+CSP* csp_create(const CSP_Config& config)
 {
-    if (!csp)
-        csp = new CSP();
+    ALLOC_ZONE(CSP);
+    return new CSP(config);
+}
+
+// A process may be defined more than once, each definition being an
+// alternative. Each is numbered by its position among the definitions of its
+// name, 0 for the first, as parsed; a process is identified by its name and
+// ordinal, which stay the same when other processes are pruned.
+void csp_number_definitions(std::vector<std::unique_ptr<CSP_Process>>& processes)
+{
+    std::map<std::string, int, std::less<>> seen;
+    for (auto& p : processes)
+        p->ordinal = seen[p->name]++;
+}
+
+// Parses src, appending its processes. Returns false if src has an error, in
+// which case the processes before the error have been appended.
+bool csp_parse_processes(std::vector<std::unique_ptr<CSP_Process>>& processes, char const*const src, size_t len)
+{
+    ALLOC_ZONE(CSP);
 
     using namespace lab::Text;
     StrView curr{src, len};
     curr = SkipCommentsAndWhitespace(curr);
     bool error_raised = false;
+
+    // anonymous processes are numbered by the name of the process they're
+    // nested in, across all of src, so that every definition of a name gets
+    // its own, and a reparse gives the same names
+    std::map<std::string, int, std::less<>> anonymous;
     while (!IsEmpty(curr) && !error_raised)
     {
         StrView token;
@@ -132,7 +468,7 @@ CSP* csp_parse(CSP* csp, char const*const src, size_t len)
 
         CSP_Process* p = new CSP_Process();
         p->name.assign(token.curr, token.sz);
-        csp->processes.emplace_back(std::unique_ptr<CSP_Process>(p));
+        processes.emplace_back(std::unique_ptr<CSP_Process>(p));
 
         curr = SkipCommentsAndWhitespace(curr);
         token = Expect(curr, StrView{"=", 1});
@@ -150,78 +486,847 @@ CSP* csp_parse(CSP* csp, char const*const src, size_t len)
         }
 
         curr = SkipCommentsAndWhitespace(token);
-        curr = parse_csp_process(curr, csp->processes, error_raised);
+        curr = parse_csp_process(curr, processes, anonymous, error_raised);
         curr = SkipCommentsAndWhitespace(curr);
     }
+    csp_number_definitions(processes);
+    return !error_raised;
+}
 
-    size_t sz = csp->processes.size();
-    csp->process_active.resize(sz);
-    for (auto i = 0; i < sz; ++i)
+// Named processes start active; anonymous ones wait to be transitioned to.
+int csp_initial_state(const CSP_Process& p)
+{
+    return p.name[0] == '_' ? 0 : 1;
+}
+
+// Adds process i's event pattern to the trie.
+void csp_trie_insert(std::vector<CSP_EventTrieNode>& trie, const std::string& pattern, int i)
+{
+    int node = 0;
+    size_t begin = 0;
+    for (;;)
     {
-        if (csp->processes[i]->name[0] == '_')
-            csp->process_active[i] = 0;
+        size_t end = pattern.find('.', begin);
+        if (end == std::string::npos)
+            end = pattern.size();
+        bool last = end == pattern.size();
+        StrView segment{pattern.c_str() + begin, end - begin};
+        bool star = segment.sz == 1 && segment.curr[0] == '*';
+        if (star && last)
+        {
+            trie[node].prefixed.push_back(i);
+            return;
+        }
+
+        int child;
+        if (star)
+            child = trie[node].wildcard;
         else
-            csp->process_active[i] = 1;
+        {
+            auto it = trie[node].children.find(std::string_view(segment.curr, segment.sz));
+            child = it != trie[node].children.end() ? it->second : -1;
+        }
+        if (child < 0)
+        {
+            child = static_cast<int>(trie.size());
+            if (star)
+                trie[node].wildcard = child;
+            else
+                trie[node].children.emplace(std::string(segment.curr, segment.sz), child);
+            trie.emplace_back();
+        }
+        node = child;
+        if (last)
+        {
+            trie[node].processes.push_back(i);
+            return;
+        }
+        begin = end + 1;
     }
+}
+
+// Collects the processes whose patterns match name, the segments of an event's
+// name yet to be matched at node.
+void csp_trie_match(const std::vector<CSP_EventTrieNode>& trie, int node, char const*const name, std::vector<int>& out)
+{
+    const CSP_EventTrieNode& n = trie[node];
+    out.insert(out.end(), n.prefixed.begin(), n.prefixed.end());
+
+    char const*const end = strchr(name, '.');
+    size_t len = end ? static_cast<size_t>(end - name) : strlen(name);
+    auto it = n.children.find(std::string_view(name, len));
+    for (int child : { it != n.children.end() ? it->second : -1, n.wildcard })
+    {
+        if (child < 0)
+            continue;
+        if (end)
+            csp_trie_match(trie, child, end + 1, out);
+        else
+            out.insert(out.end(), trie[child].processes.begin(), trie[child].processes.end());
+    }
+}
+
+// The processes accepting name, in the order they were defined. A process has
+// one pattern, and a pattern matches a name one way at most, so none repeat.
+void csp_match_event(CSP* csp, char const*const name, std::vector<int>& out)
+{
+    out.clear();
+    if (csp->trie.empty())
+        return;
+    csp_trie_match(csp->trie, 0, name, out);
+    std::sort(out.begin(), out.end());
+}
+
+// Resolves each process's transitions and lambda to indices and pointers, and
+// its event pattern into the trie, so that dispatch doesn't compare names.
+// Called with the process data locked, whenever processes are added, removed
+// or bound.
+void csp_link(CSP* csp)
+{
+    ALLOC_ZONE(CSP);
+
+    std::unordered_map<std::string, std::vector<int>> named;
+    for (size_t i = 0; i < csp->processes.size(); ++i)
+        named[csp->processes[i]->name].push_back(static_cast<int>(i));
+
+    for (auto& p : csp->processes)
+    {
+        auto it = named.find(p->behavior);
+        if (it != named.end())
+            p->next = it->second;
+        else
+            p->next.clear();
+        p->recurs = p->name == p->behavior;
+
+        auto fn_it = csp->lambdas.find(p->out);
+        p->lambda = fn_it != csp->lambdas.end() && (fn_it->second.fn || fn_it->second.reply || fn_it->second.batch_fn) ? &fn_it->second : nullptr;
+        if (p->guard)
+            p->guard_pass.reserve(csp_run_max);
+        p->guard_run = 0;
+    }
+
+    csp->trie.clear();
+    csp->trie.emplace_back();
+    for (size_t i = 0; i < csp->processes.size(); ++i)
+        csp_trie_insert(csp->trie, csp->processes[i]->event, static_cast<int>(i));
+
+    csp->pending.reserve(csp->processes.size());
+    csp->unslotted.reserve(csp->processes.size());
+    ++csp->generation;
+}
+
+// Marks the processes that can still fire: those that aren't idle, and those
+// that a process that can fire transitions to. csp must be linked, and its
+// process data locked.
+std::vector<char> csp_reachable(const CSP* csp)
+{
+    size_t n = csp->processes.size();
+    std::vector<char> reached(n, 0);
+    std::vector<int> frontier;
+    for (size_t i = 0; i < n; ++i)
+        if (csp->process_active[i] != 0)
+        {
+            reached[i] = 1;
+            frontier.push_back(static_cast<int>(i));
+        }
+    while (!frontier.empty())
+    {
+        int i = frontier.back();
+        frontier.pop_back();
+        for (int j : csp->processes[i]->next)
+            if (!reached[j])
+            {
+                reached[j] = 1;
+                frontier.push_back(j);
+            }
+    }
+    return reached;
+}
+
+// Removes the processes that reached doesn't mark, and relinks csp. Returns
+// how many were removed.
+size_t csp_remove_unreachable(CSP* csp, const std::vector<char>& reached)
+{
+    size_t n = csp->processes.size();
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (reached[i])
+        {
+            csp->processes[kept] = std::move(csp->processes[i]);
+            csp->process_active[kept] = csp->process_active[i];
+            ++kept;
+        }
+    if (kept == n)
+        return 0;
+    csp->processes.resize(kept);
+    csp->process_active.resize(kept);
+    csp_link(csp);
+    return n - kept;
+}
+
+// merge into an existing csp, or return a new one if supplied with nullptr.
+// The processes already in csp keep their states.
+CSP* csp_parse(CSP* csp, char const*const src, size_t len)
+{
+    ALLOC_ZONE(CSP);
+    if (!csp)
+        csp = new CSP();
+
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    csp_parse_processes(processes, src, len);
+
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    for (auto& p : processes)
+    {
+        csp->process_active.push_back(csp_initial_state(*p));
+        csp->processes.emplace_back(std::move(p));
+    }
+    csp_link(csp);
     return csp;
 }
 
+// Replaces the definition of csp with src, without disturbing the processes
+// src leaves unchanged. Parsing happens on the calling thread; the new
+// definition is swapped in by the next csp_update. Returns false, and stages
+// nothing, if src has an error.
+bool csp_reload(CSP* csp, char const*const src, size_t len)
+{
+    if (!csp || !src)
+        return false;
+
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    if (!csp_parse_processes(processes, src, len))
+        return false;
+
+    std::lock_guard<std::mutex> lock(csp->reload_mutex);
+    csp->reload_processes = std::move(processes);
+    csp->reload_pending.store(true, std::memory_order_release);
+    return true;
+}
+
+// Applies a staged reload; called by csp_update with the process data locked.
+// Processes are matched by name and ordinal. A process whose definition is unchanged is
+// kept as it is, along with its counters; one whose definition changed is
+// replaced. Either way it keeps its state. New processes take their initial
+// state, and processes missing from the new definition are dropped. If csp
+// has been pruned by csp_analyze, the result is pruned as well.
+void csp_apply_reload(CSP* csp)
+{
+    std::vector<std::unique_ptr<CSP_Process>> incoming;
+    {
+        std::lock_guard<std::mutex> lock(csp->reload_mutex);
+        incoming.swap(csp->reload_processes);
+        csp->reload_pending.store(false, std::memory_order_relaxed);
+    }
+
+    std::map<std::pair<std::string, int>, size_t> current;
+    for (size_t i = 0; i < csp->processes.size(); ++i)
+        current.emplace(std::make_pair(csp->processes[i]->name, csp->processes[i]->ordinal), i);
+
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    std::vector<int> active;
+    processes.reserve(incoming.size());
+    active.reserve(incoming.size());
+    size_t kept = 0, changed = 0, added = 0;
+    for (auto& p : incoming)
+    {
+        auto it = current.find(std::make_pair(p->name, p->ordinal));
+        if (it == current.end())
+        {
+            active.push_back(csp_initial_state(*p));
+            processes.emplace_back(std::move(p));
+            ++added;
+            continue;
+        }
+
+        std::unique_ptr<CSP_Process>& old = csp->processes[it->second];
+        active.push_back(csp->process_active[it->second]);
+        if (old->event == p->event && old->guard.src == p->guard.src && old->behavior == p->behavior && old->out == p->out)
+        {
+            processes.emplace_back(std::move(old));
+            ++kept;
+        }
+        else
+        {
+            processes.emplace_back(std::move(p));
+            ++changed;
+        }
+        current.erase(it);
+    }
+
+    csp->processes.swap(processes);
+    csp->process_active.swap(active);
+    csp_link(csp);
+
+    // a csp that was pruned is pruned again, as the new definition may leave
+    // processes that can never fire
+    size_t pruned = csp->prune ? csp_remove_unreachable(csp, csp_reachable(csp)) : 0;
+    LOG_INFO("csp reload: %zu unchanged, %zu changed, %zu added, %zu removed, %zu pruned",
+             kept, changed, added, current.size(), pruned);
+}
+
 void csp_bind_lambda(CSP* csp, char const*const name, std::function<void(int)> fn)
 {
     if (!csp || !name || !fn)
         return;
 
+    ALLOC_ZONE(CSP);
+
     // guard against adding processes, or changing them
     std::unique_lock<std::mutex> lock(csp->process_data_mutex);
-    csp->lambdas[name] = fn;
+    CSP_Lambda& l = csp->lambdas[name];
+    l.fn = fn;
+    l.reply = nullptr;
+    l.batch_fn = nullptr;
+    csp_link(csp);
 }
 
-void csp_emit(CSP* csp, char const*const name, int id)
+// Binds a lambda that replies to csp_call. The value it returns completes the
+// call whose event reached it; if several processes accept the event, the first
+// reply wins. Events emitted rather than called reach it too, and the value is
+// discarded.
+void csp_bind_call(CSP* csp, char const*const name, std::function<int(int)> reply)
 {
-    if (csp && name)
-        csp->q.enqueue({std::string{name}, id});
+    if (!csp || !name || !reply)
+        return;
+
+    ALLOC_ZONE(CSP);
+
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    CSP_Lambda& l = csp->lambdas[name];
+    l.fn = nullptr;
+    l.reply = reply;
+    l.batch_fn = nullptr;
+    csp_link(csp);
 }
 
-void csp_update(CSP* csp)
+// Binds a lambda that is given the payloads of a run of events at once, in the
+// order they were dispatched, rather than one call per event. A run ends when
+// an event with another name is dispatched, or the update ends. The processes
+// still fire, and transition, event by event; only the lambda is deferred, so
+// events it emits follow the event that ended the run.
+void csp_bind_batch_lambda(CSP* csp, char const*const name, std::function<void(const int*, size_t)> fn)
 {
-    if (!csp)
+    if (!csp || !name || !fn)
         return;
 
-    // guard against adding processes, or changing them
+    ALLOC_ZONE(CSP);
+
     std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    CSP_Lambda& l = csp->lambdas[name];
+    l.fn = nullptr;
+    l.reply = nullptr;
+    l.batch_fn = fn;
+    l.batch.reserve(256);
+    csp_link(csp);
+}
+
+// Lambdas are timed only while enabled, as reading the clock costs more than
+// the counting does.
+void csp_time_lambdas(CSP* csp, bool enable)
+{
+    if (csp)
+        csp->time_lambdas.store(enable, std::memory_order_relaxed);
+}
+
+// Finds, or claims, the stats slot of an event name, by open addressing on its
+// FNV-1a hash. Returns -1 if the table is full.
+int csp_event_slot(CSP* csp, char const*const name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ static_cast<uint8_t>(name[i])) * 16777619u;
+    if (!h)
+        h = 1;  // zero marks a free slot
+
+    for (int probe = 0; probe < CSP_EVENT_STATS_SLOTS; ++probe)
+    {
+        int i = (h + probe) % CSP_EVENT_STATS_SLOTS;
+        CSP_EventStats& s = csp->event_stats[i];
+        uint32_t slot_hash = s.hash.load(std::memory_order_acquire);
+        if (!slot_hash)
+        {
+            if (s.hash.compare_exchange_strong(slot_hash, h, std::memory_order_acq_rel))
+            {
+                memcpy(s.name, name, len + 1);
+                s.named.store(true, std::memory_order_release);
+                return i;
+            }
+            // another thread claimed it, slot_hash now holds its hash
+        }
+        if (slot_hash != h)
+            continue;
+
+        // the claiming thread may still be writing the name
+        while (!s.named.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        if (!strcmp(s.name, name))
+            return i;
+    }
+    return -1;
+}
+
+// Totals over every CSP in the process.
+StatsCounter& csp_stats_emitted()
+{
+    static StatsCounter& c = stats_counter("gusteau_csp_events_emitted_total", "Events emitted to a CSP");
+    return c;
+}
+
+StatsCounter& csp_stats_dispatched()
+{
+    static StatsCounter& c = stats_counter("gusteau_csp_events_dispatched_total", "Events taken from a CSP queue by an update");
+    return c;
+}
+
+// The CSP whose update is running on this thread, if any; set while its
+// handlers are called, so that the events they emit can be recognized.
+CSP*& csp_dispatching()
+{
+    thread_local CSP* csp = nullptr;
+    return csp;
+}
+
+// Installs a tap, or removes it given nullptr. Returns once no emitter is using
+// the previous tap, which may then be deleted.
+void csp_set_emit_tap(CSP* csp, CSP_EmitTap* tap)
+{
+    if (!csp)
+        return;
+    csp->emit_tap.store(tap);
+    while (csp->emit_tap_users.load())
+        std::this_thread::yield();
+}
+
+// Queues an event. Events emitted by a handler, while its CSP is dispatching,
+// go to the CSP's local queue rather than the shared one; see csp_update.
+// Returns false if the event was dropped.
+bool csp_post(CSP* csp, char const*const name, size_t len, int id, CSP_CallState* call)
+{
     CSP_Event event;
-    while (csp->q.try_dequeue(event))
+    memcpy(event.name, name, len + 1);
+    event.id = id;
+    event.slot = csp_event_slot(csp, name, len);
+    event.call = call;
+
+    if (csp_dispatching() == csp)
+    {
+        event.depth = csp->dispatch_depth + 1;
+        if (event.depth > csp->max_cascade_depth)
+        {
+            if (!csp->cascade_dropped++)
+                LOG_WARN("csp: events cascaded more than %d deep; dropping %s", csp->max_cascade_depth, name);
+            return false;
+        }
+        if (event.slot >= 0)
+            csp->event_stats[event.slot].emitted.fetch_add(1, std::memory_order_relaxed);
+        csp->local.push_back(event);
+        ++csp->local_emitted;
+        return true;
+    }
+
+    event.depth = 0;
+    if (csp->emit_tap.load(std::memory_order_relaxed))
+    {
+        csp->emit_tap_users.fetch_add(1);
+        if (CSP_EmitTap* tap = csp->emit_tap.load())
+            tap->emitted(event);
+        csp->emit_tap_users.fetch_sub(1);
+    }
+    if (event.slot >= 0)
+        csp->event_stats[event.slot].emitted.fetch_add(1, std::memory_order_relaxed);
+    csp->q->enqueue(event);
+    csp_stats_emitted().add();
+    return true;
+}
+
+// Emits events already made, as from another process, with one enqueue; the
+// events' names must fit, and their slots and calls are filled in here. Events
+// emitted from a handler are posted one at a time, as usual.
+void csp_emit_bulk(CSP* csp, CSP_Event* events, size_t count)
+{
+    if (!csp || !count)
+        return;
+
+    ALLOC_ZONE(CSP);
+    if (csp_dispatching() == csp)
+    {
+        for (size_t i = 0; i < count; ++i)
+            csp_post(csp, events[i].name, strlen(events[i].name), events[i].id, nullptr);
+        return;
+    }
+
+    bool tapped = csp->emit_tap.load(std::memory_order_relaxed) != nullptr;
+    if (tapped)
+        csp->emit_tap_users.fetch_add(1);
+    CSP_EmitTap* tap = tapped ? csp->emit_tap.load() : nullptr;
+    for (size_t i = 0; i < count; ++i)
+    {
+        CSP_Event& event = events[i];
+        event.slot = csp_event_slot(csp, event.name, strlen(event.name));
+        event.depth = 0;
+        event.call = nullptr;
+        if (tap)
+            tap->emitted(event);
+        if (event.slot >= 0)
+            csp->event_stats[event.slot].emitted.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (tapped)
+        csp->emit_tap_users.fetch_sub(1);
+    csp->q->enqueue_bulk(events, count);
+    csp_stats_emitted().add(count);
+}
+
+void csp_emit(CSP* csp, char const*const name, int id)
+{
+    if (!csp || !name)
+        return;
+
+    size_t len = strlen(name);
+    if (len >= CSP_EVENT_NAME_MAX)
+        return;
+
+    ALLOC_ZONE(CSP);
+    csp_post(csp, name, len, id, nullptr);
+}
+
+void csp_forget_timer(CSP* csp, uint64_t timer)
+{
+    std::lock_guard<std::mutex> lock(csp->timers_mutex);
+    csp->timers.erase(timer);
+}
+
+// Emits name to csp after delay_ns of the virtual clock, and then every
+// period_ns if that's not zero. The timer is noted in csp, for csp_checkpoint.
+uint64_t csp_schedule(CSP* csp, const std::string& name, int id, int64_t delay_ns, int64_t period_ns)
+{
+    // a one shot timer forgets itself once it has run; if it runs before it
+    // has been noted, the note is left for csp_checkpoint to discard
+    auto self = std::make_shared<std::atomic<uint64_t>>(0);
+    uint64_t timer = vclock_schedule(delay_ns, period_ns, [csp, name, id, period_ns, self]()
+    {
+        csp_emit(csp, name.c_str(), id);
+        if (!period_ns)
+            if (uint64_t t = self->load())
+                csp_forget_timer(csp, t);
+    });
+    std::lock_guard<std::mutex> lock(csp->timers_mutex);
+    csp->timers.emplace(timer, CSP_Timer{ name, id, period_ns });
+    self->store(timer);
+    return timer;
+}
+
+// Emits name to csp every period seconds of the virtual clock, or once after
+// a delay. Returns the timer, which must be cancelled, with vclock_cancel or
+// csp_cancel_timers, before csp is deleted.
+uint64_t csp_every(CSP* csp, char const*const name, double period, int id = 0)
+{
+    if (!csp || !name)
+        return 0;
+    int64_t period_ns = std::max<int64_t>(vclock_ns(period), 1);
+    return csp_schedule(csp, name, id, period_ns, period_ns);
+}
+
+uint64_t csp_after(CSP* csp, char const*const name, double delay, int id = 0)
+{
+    if (!csp || !name)
+        return 0;
+    return csp_schedule(csp, name, id, vclock_ns(delay), 0);
+}
+
+// Cancels every timer made for csp by csp_every and csp_after.
+void csp_cancel_timers(CSP* csp)
+{
+    if (!csp)
+        return;
+
+    std::vector<uint64_t> timers;
+    {
+        std::lock_guard<std::mutex> lock(csp->timers_mutex);
+        for (auto& t : csp->timers)
+            timers.push_back(t.first);
+        csp->timers.clear();
+    }
+    // unlocked, as cancelling waits for a running timer, which may forget itself
+    for (uint64_t t : timers)
+        vclock_cancel(t);
+}
+
+// Emits an event whose handler's reply completes the returned future. The
+// future's continuation runs on executor, which the caller drains on its own
+// thread; given nullptr, it runs on the thread calling csp_update, once the
+// update has dispatched. A call no handler replies to completes unanswered.
+// The returned future is invalid if the event couldn't be emitted.
+CSP_Future csp_call(CSP* csp, char const*const name, int id, CSP_Executor* executor = nullptr)
+{
+    if (!csp || !name)
+        return CSP_Future();
+
+    size_t len = strlen(name);
+    if (len >= CSP_EVENT_NAME_MAX)
+        return CSP_Future();
+
+    ALLOC_ZONE(CSP);
+
+    CSP_CallState* call = new CSP_CallState();
+    call->executor = executor ? executor : &csp->executor;
+    call->refs.store(2, std::memory_order_relaxed);     // the future's, and the event's
+    if (!csp_post(csp, name, len, id, call))
     {
-        size_t sz = csp->processes.size();
-        for (int i = 0; i < sz; ++i)
+        csp_call_complete(call, false, 0);
+        csp_call_release(call);
+    }
+    return CSP_Future(call);
+}
+
+void csp_invoke(CSP_Lambda& l, const CSP_Event& event)
+{
+    if (l.reply)
+    {
+        int value = l.reply(event.id);
+        if (event.call)
+            csp_call_complete(event.call, true, value);
+    }
+    else
+        l.fn(event.id);
+}
+
+// Calls the batch lambdas with the payloads they hold.
+void csp_flush_batches(CSP* csp)
+{
+    if (csp->batched.empty())
+        return;
+
+    csp->dispatch_depth = csp->batch_depth;
+    for (CSP_Lambda* l : csp->batched)
+    {
+        ALLOC_ZONE(Lambda);
+        size_t n = l->batch.size();
+        if (csp->time_lambdas.load(std::memory_order_relaxed))
         {
-            if (csp->process_active[i] != 1)
-                continue;
+            auto start = std::chrono::steady_clock::now();
+            l->batch_fn(l->batch.data(), n);
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            l->total_ns.fetch_add(ns, std::memory_order_relaxed);
+            l->timed_calls.fetch_add(n, std::memory_order_relaxed);
+            if (ns > l->max_ns.load(std::memory_order_relaxed))
+                l->max_ns.store(ns, std::memory_order_relaxed);
+        }
+        else
+            l->batch_fn(l->batch.data(), n);
+        l->calls.fetch_add(n, std::memory_order_relaxed);
+        l->batch.clear();
+    }
+    csp->batched.clear();
+    csp->batch_slot = -1;
+}
+
+// The processes accepting the event in slot, rebuilt if the processes have
+// been linked since it was last built.
+const std::vector<int>& csp_dispatch_list(CSP* csp, int slot)
+{
+    std::vector<int>& list = csp->dispatch[slot];
+    if (csp->dispatch_generation[slot] != csp->generation)
+    {
+        csp_match_event(csp, csp->event_stats[slot].name, list);
+        csp->dispatch_generation[slot] = csp->generation;
+    }
+    return list;
+}
+
+// Whether p's guard holds for the event being dispatched. For an event of the
+// current run, the guard is evaluated at once for it and the events after it
+// with the same name, and the results kept for when those are dispatched.
+bool csp_guard_holds(CSP* csp, CSP_Process* p, const CSP_Event& event)
+{
+    if (!p->guard)
+        return true;
+    size_t k = csp->run_index;
+    if (k == SIZE_MAX)
+        return csp_guard_eval(p->guard, event.id);
+
+    if (p->guard_run == csp->run_serial && k >= p->guard_begin && k - p->guard_begin < p->guard_pass.size())
+        return p->guard_pass[k - p->guard_begin] != 0;
+
+    size_t end = k + 1;
+    while (event.slot >= 0 && end < csp->run.size() && csp->run[end].slot == event.slot)
+        ++end;
+    csp->run_ids.clear();
+    for (size_t i = k; i < end; ++i)
+        csp->run_ids.push_back(csp->run[i].id);
+    p->guard_pass.resize(end - k);
+    csp_guard_eval_batch(p->guard, csp->run_ids.data(), end - k, p->guard_pass.data());
+    p->guard_run = csp->run_serial;
+    p->guard_begin = k;
+    return p->guard_pass[0] != 0;
+}
+
+// Offers one event to the active processes; called by csp_update with the
+// process data locked. A process whose guard doesn't hold ignores the event.
+void csp_dispatch(CSP* csp, const CSP_Event& event)
+{
+    if (csp->batch_slot != event.slot || event.slot < 0)
+        csp_flush_batches(csp);
+
+    csp->dispatch_depth = event.depth;
+    bool matched = false;
+
+    // events without a slot are matched afresh
+    const std::vector<int>* candidates = &csp->unslotted;
+    if (event.slot >= 0)
+        candidates = &csp_dispatch_list(csp, event.slot);
+    else
+        csp_match_event(csp, event.name, csp->unslotted);
+    for (int i : *candidates)
+    {
+        if (csp->process_active[i] != 1)
+            continue;
 
-            CSP_Process* p = csp->processes[i].get();
+        CSP_Process* p = csp->processes[i].get();
+        if (!csp_guard_holds(csp, p, event))
+            continue;
 
-            if (event.name != p->event)
-                continue;
+        matched = true;
+        p->fired.fetch_add(1, std::memory_order_relaxed);
 
-            auto fn_it = csp->lambdas.find(p->out);
-            if (fn_it != csp->lambdas.end())
+        if (p->lambda && p->lambda->batch_fn)
+        {
+            CSP_Lambda& l = *p->lambda;
+            if (l.batch.empty())
+                csp->batched.push_back(&l);
+            l.batch.push_back(event.id);
+            csp->batch_slot = event.slot;
+            csp->batch_depth = event.depth;
+        }
+        else if (p->lambda)
+        {
+            ALLOC_ZONE(Lambda);
+            CSP_Lambda& l = *p->lambda;
+            if (csp->time_lambdas.load(std::memory_order_relaxed))
             {
-                std::function<void(int)>& fn = fn_it->second;
-                fn(event.id);
+                auto start = std::chrono::steady_clock::now();
+                csp_invoke(l, event);
+                uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                l.total_ns.fetch_add(ns, std::memory_order_relaxed);
+                l.timed_calls.fetch_add(1, std::memory_order_relaxed);
+                if (ns > l.max_ns.load(std::memory_order_relaxed))
+                    l.max_ns.store(ns, std::memory_order_relaxed);
             }
+            else
+                csp_invoke(l, event);
+            l.calls.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // common case: recur.
+        if (p->recurs)
+            continue;
+
+        // transition to the new behavior if there is one.
+        csp->process_active[i] = false;
+        for (int j : p->next)
+        {
+            csp->process_active[j] = 2; // set to pending
+            csp->pending.push_back(j);
+        }
+    }
+    for (int i : csp->pending)
+        if (csp->process_active[i] == 2)
+            csp->process_active[i] = 1;     // pending becomes active, to prevent (tick -> (tick -> TOCK)) from firing immediately the second time
+    csp->pending.clear();
+
+    if (event.slot >= 0)
+    {
+        CSP_EventStats& es = csp->event_stats[event.slot];
+        es.dispatched.fetch_add(1, std::memory_order_relaxed);
+        if (!matched)
+            es.unmatched.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!matched)
+        csp->unmatched.fetch_add(1, std::memory_order_relaxed);
+
+    for (CSP_DispatchTap* tap : csp->dispatch_taps)
+        tap->dispatched(event, matched);
+
+    if (event.call)
+    {
+        csp_call_complete(event.call, false, 0);
+        csp_call_release(event.call);
+    }
+}
+
+// Dispatches the events emitted by handlers. Returns how many there were.
+uint64_t csp_dispatch_local(CSP* csp)
+{
+    // the local queue may grow while it's dispatched, so events are copied out
+    CSP_Event event;
+    size_t i = 0;
+    for (; i < csp->local.size(); ++i)
+    {
+        event = csp->local[i];
+        csp_dispatch(csp, event);
+    }
+    csp->local.clear();
+    return i;
+}
+
+// Dispatches the queued events in order. The events a handler emits are
+// dispatched straight after the event that it handled, and before the next
+// queued one, in the order they were emitted; so are the events that those
+// handlers emit, up to the CSP's cascade depth.
+void csp_update(CSP* csp)
+{
+    if (!csp)
+        return;
+
+    ALLOC_ZONE(CSP);
+
+    // guard against adding processes, or changing them
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    if (csp->reload_pending.load(std::memory_order_acquire))
+        csp_apply_reload(csp);
+
+    CSP*& dispatching = csp_dispatching();
+    CSP* outer = dispatching;
+    dispatching = csp;
 
-            // common case: recur.
-            if (p->name == p->behavior)
-                continue;
+    CSP_Event event;
+    uint64_t dispatched = 0;
+    for (;;)
+    {
+        csp->run.clear();
+        while (csp->run.size() < csp_run_max && csp->q->try_dequeue(event))
+            csp->run.push_back(event);
+        if (csp->run.empty())
+            break;
 
-            // transition to the new behavior if there is one.
-            csp->process_active[i] = false;
-            for (int j = 0; j < sz; ++j)
-                if (csp->processes[j]->name == p->behavior)
-                    csp->process_active[j] = 2; // set to pending
+        ++csp->run_serial;
+        for (size_t i = 0; i < csp->run.size(); ++i)
+        {
+            csp->run_index = i;
+            csp_dispatch(csp, csp->run[i]);
+            csp->run_index = SIZE_MAX;
+            ++dispatched;
+            dispatched += csp_dispatch_local(csp);
         }
-        for (int i = 0; i < sz; ++i)
-            if (csp->process_active[i] == 2)
-                csp->process_active[i] = 1;     // pending becomes active, to prevent (tick -> (tick -> TOCK)) from firing immediately the second time
     }
+
+    // deliver the last run to the batch lambdas, and whatever they emit
+    while (!csp->batched.empty())
+    {
+        csp_flush_batches(csp);
+        dispatched += csp_dispatch_local(csp);
+    }
+    dispatching = outer;
+
+    if (csp->local_emitted)
+    {
+        csp_stats_emitted().add(csp->local_emitted);
+        csp->local_emitted = 0;
+    }
+    if (dispatched)
+        csp_stats_dispatched().add(dispatched);
+
+    // continuations may emit, call, or bind, so they run unlocked
+    lock.unlock();
+    csp_executor_drain(&csp->executor);
 }
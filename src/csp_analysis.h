@@ -0,0 +1,104 @@
+#pragma once
+
+#include "csp.h"
+#include "log.h"
+#include <set>
+#include <string>
+#include <vector>
+
+// A static analysis of a CSP's processes. A process is reachable if it is not
+// idle, or a reachable process can transition to it; the rest can never fire,
+// and are removed when pruning. Anonymous processes left behind by merges are
+// the usual dead weight. Once pruned, a CSP is pruned again after each reload.
+// The alphabet is the set of event patterns the reachable processes accept,
+// and the outputs those they produce. An output with no lambda bound is
+// reported, and is not called by dispatch.
+//
+// A process defined more than once is a set of alternatives, but a definition
+// identical to another of the same name adds nothing, and is reported.
+
+struct CSP_Analysis
+{
+    size_t processes = 0;                       // before pruning
+    size_t reachable = 0;
+    std::vector<std::string> unreachable;       // removed, if pruning
+    std::vector<std::string> alphabet;
+    std::vector<std::string> outputs;
+    std::vector<std::string> unbound_outputs;
+    std::vector<std::string> undefined;         // behaviors naming no process, other than STOP
+    std::vector<std::string> duplicates;        // names with identical definitions
+};
+
+// Analyzes csp, and removes its unreachable processes if prune is set. Should be
+// called once the lambdas are bound, or every output will be reported unbound.
+void csp_analyze(CSP* csp, CSP_Analysis& analysis, bool prune = true)
+{
+    analysis = CSP_Analysis();
+    if (!csp)
+        return;
+
+    ALLOC_ZONE(CSP);
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+    csp_link(csp);
+
+    size_t n = csp->processes.size();
+    analysis.processes = n;
+    std::vector<char> reached = csp_reachable(csp);
+
+    std::set<std::string> definitions, duplicates, alphabet, outputs, unbound, undefined;
+    for (size_t i = 0; i < n; ++i)
+    {
+        CSP_Process* p = csp->processes[i].get();
+        std::string definition = p->name + " = (" + p->event + " [" + p->guard.src + "] -> " + p->behavior + " \"" + p->out + "\")";
+        if (!definitions.insert(definition).second)
+            duplicates.insert(p->name);
+        if (!reached[i])
+        {
+            analysis.unreachable.push_back(p->name);
+            continue;
+        }
+
+        ++analysis.reachable;
+        alphabet.insert(p->event);
+        if (p->next.empty() && p->behavior != "STOP")
+            undefined.insert(p->behavior);
+        if (p->out.size())
+        {
+            outputs.insert(p->out);
+            if (!p->lambda)
+                unbound.insert(p->out);
+        }
+    }
+    analysis.alphabet.assign(alphabet.begin(), alphabet.end());
+    analysis.outputs.assign(outputs.begin(), outputs.end());
+    analysis.unbound_outputs.assign(unbound.begin(), unbound.end());
+    analysis.undefined.assign(undefined.begin(), undefined.end());
+    analysis.duplicates.assign(duplicates.begin(), duplicates.end());
+
+    if (!prune)
+        return;
+    csp->prune = true;
+    csp_remove_unreachable(csp, reached);
+}
+
+void csp_analysis_log(const CSP_Analysis& analysis)
+{
+    auto join = [](const std::vector<std::string>& names)
+    {
+        std::string s;
+        for (auto& name : names)
+            s += (s.empty() ? "" : " ") + name;
+        return s;
+    };
+
+    LOG_INFO("csp analysis: %zu of %zu processes reachable, %zu events, %zu outputs",
+             analysis.reachable, analysis.processes, analysis.alphabet.size(), analysis.outputs.size());
+    if (analysis.unreachable.size())
+        LOG_INFO("csp analysis: unreachable: %s", join(analysis.unreachable));
+    if (analysis.unbound_outputs.size())
+        LOG_WARN("csp analysis: outputs with no lambda: %s", join(analysis.unbound_outputs));
+    if (analysis.undefined.size())
+        LOG_WARN("csp analysis: behaviors naming no process: %s", join(analysis.undefined));
+    if (analysis.duplicates.size())
+        LOG_WARN("csp analysis: processes with identical definitions: %s", join(analysis.duplicates));
+}
@@ -0,0 +1,403 @@
+#pragma once
+
+#include "csp.h"
+#include "stats.h"
+#include "TypedData.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// An event bus owns several CSPs, each updated by a thread of its own, so that
+// subsystems, such as the UI, networking and simulation, dispatch their events
+// independently, and on separate cores. Events are published to the bus by
+// topic, which is an event name, and delivered to every CSP with a process
+// accepting it; a CSP subscribes to exactly the events its processes accept,
+// wildcards included. The routes are compiled from the members' definitions
+// when the bus starts, into a trie, and the route of each topic is memoized.
+//
+// A payload published with an event is shared by reference by every CSP it
+// reaches. The event's id is the payload's handle, and handlers read the
+// payload with csp_bus_payload, for as long as the update that dispatched it
+// lasts. Once every CSP has done so, the payload is deleted.
+//
+// A bus holds at most 64 CSPs.
+
+#ifndef CSP_BUS_ROUTE_SLOTS
+#define CSP_BUS_ROUTE_SLOTS 256
+#endif
+
+static constexpr size_t csp_bus_max_members = 64;
+
+struct CSP_BusConfig
+{
+    size_t payload_slots = 4096;    // payloads in flight at once
+};
+
+struct CSP_BusMember
+{
+    std::string name;
+    CSP* csp = nullptr;
+    std::thread thread;
+
+    // the thread waits for events here when its CSP is idle
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::atomic<bool> sleeping{false};
+
+    // payloads delivered to the CSP, to be released once an update has
+    // dispatched them
+    std::mutex held_mutex;
+    std::vector<int> held;
+
+    std::atomic<uint64_t> delivered{0};
+};
+
+// The members a topic is delivered to. A slot is claimed by the first publish
+// of a topic, as the slots of CSP_EventStats are.
+struct CSP_BusRoute
+{
+    std::atomic<uint32_t> hash{0};
+    std::atomic<bool> routed{false};
+    char name[CSP_EVENT_NAME_MAX];
+    uint64_t members = 0;
+};
+
+struct CSP_BusPayload
+{
+    std::atomic<int> refs{0};
+    TypedData* data = nullptr;
+};
+
+struct CSP_Bus
+{
+    std::vector<std::unique_ptr<CSP_BusMember>> members;
+    std::atomic<bool> running{false};
+
+    std::vector<CSP_EventTrieNode> trie;    // of every member's patterns, by member
+    CSP_BusRoute routes[CSP_BUS_ROUTE_SLOTS];
+
+    std::unique_ptr<CSP_BusPayload[]> payloads;
+    size_t payload_slots = 0;
+    std::mutex free_mutex;
+    std::vector<int> free_ids;
+
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> unrouted{0};      // published to a topic no member accepts
+    std::atomic<uint64_t> dropped{0};       // not delivered, for want of a payload slot
+};
+
+CSP_Bus* csp_bus_create(const CSP_BusConfig& config = CSP_BusConfig())
+{
+    CSP_Bus* bus = new CSP_Bus();
+    bus->payload_slots = config.payload_slots;
+    bus->payloads.reset(new CSP_BusPayload[config.payload_slots]);
+    bus->free_ids.reserve(config.payload_slots);
+    for (size_t i = config.payload_slots; i > 0; --i)
+        bus->free_ids.push_back(static_cast<int>(i));
+    return bus;
+}
+
+// Adds csp to the bus, which takes ownership of it. Members can only be added
+// before the bus starts. Returns false if it has started, or is full.
+bool csp_bus_add(CSP_Bus* bus, char const*const name, CSP* csp)
+{
+    if (!bus || !csp || bus->running.load() || bus->members.size() == csp_bus_max_members)
+        return false;
+
+    CSP_BusMember* m = new CSP_BusMember();
+    m->name = name ? name : "csp";
+    m->csp = csp;
+    bus->members.emplace_back(m);
+    return true;
+}
+
+// Drops a reference to a payload, deleting it with the last.
+void csp_bus_release(CSP_Bus* bus, int id)
+{
+    if (id < 1 || size_t(id) > bus->payload_slots)
+        return;
+
+    CSP_BusPayload& p = bus->payloads[id - 1];
+    if (p.refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    delete p.data;
+    p.data = nullptr;
+    std::lock_guard<std::mutex> lock(bus->free_mutex);
+    bus->free_ids.push_back(id);
+}
+
+// The payload an event carries as its id, valid while the update that
+// dispatched the event lasts. Handlers must not change it; other CSPs may be
+// reading it at the same time.
+const TypedData* csp_bus_payload(CSP_Bus* bus, int id)
+{
+    if (!bus || id < 1 || size_t(id) > bus->payload_slots)
+        return nullptr;
+    return bus->payloads[id - 1].data;
+}
+
+// Runs an update, and releases the payloads that were delivered before it
+// began; the update dispatched them. Returns whether there was anything to do.
+bool csp_bus_update(CSP_Bus* bus, CSP_BusMember* m, std::vector<int>& releasing)
+{
+    {
+        std::lock_guard<std::mutex> lock(m->held_mutex);
+        releasing.swap(m->held);
+    }
+    bool busy = m->csp->q->size_approx() || !releasing.empty();
+    csp_update(m->csp);
+    for (int id : releasing)
+        csp_bus_release(bus, id);
+    releasing.clear();
+    return busy;
+}
+
+void csp_bus_run(CSP_Bus* bus, CSP_BusMember* m)
+{
+    std::vector<int> releasing;
+    while (bus->running.load(std::memory_order_acquire))
+    {
+        if (csp_bus_update(bus, m, releasing))
+            continue;
+
+        // publishers look for the sleeping flag after queueing, and the queue
+        // is looked at again after raising it, so one of them sees the other;
+        // the timeout covers events emitted to the CSP directly
+        std::unique_lock<std::mutex> lock(m->wake_mutex);
+        m->sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!m->csp->q->size_approx() && bus->running.load())
+            m->wake.wait_for(lock, std::chrono::milliseconds(10));
+        m->sleeping.store(false);
+    }
+}
+
+std::string csp_bus_label(const CSP_BusMember* m)
+{
+    return "{csp=\"" + m->name + "\"}";
+}
+
+// Compiles the routes from the members' definitions, and starts their threads.
+bool csp_bus_start(CSP_Bus* bus)
+{
+    if (!bus || bus->running.load())
+        return false;
+
+    bus->trie.clear();
+    bus->trie.emplace_back();
+    for (size_t i = 0; i < bus->members.size(); ++i)
+    {
+        CSP* csp = bus->members[i]->csp;
+        std::lock_guard<std::mutex> lock(csp->process_data_mutex);
+        for (auto& p : csp->processes)
+            csp_trie_insert(bus->trie, p->event, static_cast<int>(i));
+    }
+    for (auto& r : bus->routes)
+    {
+        r.hash.store(0, std::memory_order_relaxed);
+        r.routed.store(false, std::memory_order_relaxed);
+    }
+
+    bus->running = true;
+    for (auto& m : bus->members)
+    {
+        CSP_BusMember* member = m.get();
+        member->thread = std::thread([bus, member]() { csp_bus_run(bus, member); });
+        stats_gauge("gusteau_csp_bus_queue_depth" + csp_bus_label(member), "Events waiting for a CSP on the bus",
+                    [member]() { return static_cast<double>(member->csp->q->size_approx()); });
+    }
+    return true;
+}
+
+// Stops the members' threads, and dispatches what they were given. Nothing
+// may be publishing meanwhile.
+void csp_bus_stop(CSP_Bus* bus)
+{
+    if (!bus || !bus->running.exchange(false))
+        return;
+
+    for (auto& m : bus->members)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m->wake_mutex);
+            m->wake.notify_one();
+        }
+        if (m->thread.joinable())
+            m->thread.join();
+        stats_unregister("gusteau_csp_bus_queue_depth" + csp_bus_label(m.get()));
+    }
+
+    std::vector<int> releasing;
+    for (auto& m : bus->members)
+        csp_bus_update(bus, m.get(), releasing);
+}
+
+// Stops the bus, and deletes it and its CSPs.
+void csp_bus_destroy(CSP_Bus* bus)
+{
+    if (!bus)
+        return;
+    csp_bus_stop(bus);
+    for (auto& m : bus->members)
+        delete m->csp;
+    delete bus;
+}
+
+// The members accepting topic, as a mask of their indices.
+uint64_t csp_bus_match(CSP_Bus* bus, char const*const topic)
+{
+    thread_local std::vector<int> matched;
+    csp_trie_match(bus->trie, 0, topic, matched);
+    uint64_t members = 0;
+    for (int i : matched)
+        members |= uint64_t(1) << i;
+    matched.clear();
+    return members;
+}
+
+// Finds the members a topic is routed to, routing it if it's new.
+uint64_t csp_bus_route(CSP_Bus* bus, char const*const topic, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ static_cast<uint8_t>(topic[i])) * 16777619u;
+    if (!h)
+        h = 1;  // zero marks a free slot
+
+    for (int probe = 0; probe < CSP_BUS_ROUTE_SLOTS; ++probe)
+    {
+        CSP_BusRoute& r = bus->routes[(h + probe) % CSP_BUS_ROUTE_SLOTS];
+        uint32_t slot_hash = r.hash.load(std::memory_order_acquire);
+        if (!slot_hash)
+        {
+            if (r.hash.compare_exchange_strong(slot_hash, h, std::memory_order_acq_rel))
+            {
+                memcpy(r.name, topic, len + 1);
+                r.members = csp_bus_match(bus, topic);
+                r.routed.store(true, std::memory_order_release);
+                return r.members;
+            }
+        }
+        if (slot_hash != h)
+            continue;
+
+        // the claiming thread may still be routing it
+        while (!r.routed.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        if (!strcmp(r.name, topic))
+            return r.members;
+    }
+    return csp_bus_match(bus, topic);
+}
+
+void csp_bus_wake(CSP_BusMember* m)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m->sleeping.load())
+    {
+        std::lock_guard<std::mutex> lock(m->wake_mutex);
+        m->wake.notify_one();
+    }
+}
+
+// Delivers an event to each member routed, holding a reference to the payload
+// for each, if there is one.
+void csp_bus_deliver(CSP_Bus* bus, char const*const topic, size_t len, uint64_t members, int id, bool payload)
+{
+    for (size_t i = 0; members; ++i, members >>= 1)
+    {
+        if (!(members & 1))
+            continue;
+
+        CSP_BusMember* m = bus->members[i].get();
+        // queued before it's held, so that it's dispatched before it's released
+        if (!csp_post(m->csp, topic, len, id, nullptr))
+        {
+            if (payload)
+                csp_bus_release(bus, id);
+            continue;
+        }
+        if (payload)
+        {
+            std::lock_guard<std::mutex> lock(m->held_mutex);
+            m->held.push_back(id);
+        }
+        m->delivered.fetch_add(1, std::memory_order_relaxed);
+        csp_bus_wake(m);
+    }
+}
+
+// Publishes an event to the CSPs accepting topic. Returns false if there are
+// none, or the bus isn't running.
+bool csp_bus_publish(CSP_Bus* bus, char const*const topic, int id)
+{
+    if (!bus || !topic || !bus->running.load(std::memory_order_relaxed))
+        return false;
+
+    size_t len = strlen(topic);
+    if (len >= CSP_EVENT_NAME_MAX)
+        return false;
+    bus->published.fetch_add(1, std::memory_order_relaxed);
+    uint64_t members = csp_bus_route(bus, topic, len);
+    if (!members)
+    {
+        bus->unrouted.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    csp_bus_deliver(bus, topic, len, members, id, false);
+    return true;
+}
+
+// Publishes an event carrying data, which the bus takes ownership of, to the
+// CSPs accepting topic. Returns false if there are none, the bus isn't
+// running, or too many payloads are in flight; data is deleted if so.
+bool csp_bus_publish_payload(CSP_Bus* bus, char const*const topic, TypedData* data)
+{
+    size_t len = topic ? strlen(topic) : 0;
+    if (!bus || !topic || !bus->running.load(std::memory_order_relaxed) || len >= CSP_EVENT_NAME_MAX)
+    {
+        delete data;
+        return false;
+    }
+
+    bus->published.fetch_add(1, std::memory_order_relaxed);
+    uint64_t members = csp_bus_route(bus, topic, len);
+    if (!members)
+    {
+        bus->unrouted.fetch_add(1, std::memory_order_relaxed);
+        delete data;
+        return false;
+    }
+
+    int id = 0;
+    {
+        std::lock_guard<std::mutex> lock(bus->free_mutex);
+        if (bus->free_ids.size())
+        {
+            id = bus->free_ids.back();
+            bus->free_ids.pop_back();
+        }
+    }
+    if (!id)
+    {
+        bus->dropped.fetch_add(1, std::memory_order_relaxed);
+        delete data;
+        return false;
+    }
+
+    int refs = 0;
+    for (uint64_t m = members; m; m &= m - 1)
+        ++refs;
+    CSP_BusPayload& p = bus->payloads[id - 1];
+    p.data = data;
+    p.refs.store(refs, std::memory_order_release);
+    csp_bus_deliver(bus, topic, len, members, id, true);
+    return true;
+}
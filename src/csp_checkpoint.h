@@ -0,0 +1,349 @@
+#pragma once
+
+#include "clock.h"
+#include "csp.h"
+#include "log.h"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A checkpoint holds the runtime state of a CSP: the state of each process, the
+// events queued and not yet dispatched, and the timers made by csp_every and
+// csp_after, with the time left until each is due. Restoring a checkpoint puts
+// a CSP parsed from the same definition back where the checkpointed one was,
+// without replaying its history, so a session resumes where it left off, and
+// csp_clone copies a running CSP into a sandbox. Both take time in proportion
+// to the state, not to the history.
+//
+// Processes are matched by name, and by which definition of the name they are,
+// so a definition that has changed since the checkpoint keeps the states of the
+// processes both have. Lambdas, counters,
+// and the calls waiting on queued events, are not part of the state; a queued
+// call is restored as a plain event.
+//
+// A checkpoint is taken between updates, and not from a handler. Events
+// emitted while it's being taken may be dispatched out of order. Taking and
+// restoring a checkpoint both put events back on the queue, from a thread
+// that isn't one of its producers, so they need an MPMC queue; a CSP with an
+// SPSC or MPSC queue can't be checkpointed, restored, or cloned.
+//
+// Layout, in native byte order:
+//     header
+//     processes   uint32 name length, the name, int32 ordinal, int32 state
+//     events      uint8 name length, the name, int32 id
+//     timers      uint8 name length, the name, int32 id, int64 ns until due, int64 period
+
+static constexpr char csp_checkpoint_magic[8] = { 'G', 'C', 'S', 'P', 'C', 'K', 'P', 0 };
+static constexpr uint32_t csp_checkpoint_version = 2;   // 1 had no ordinals
+
+struct CSP_CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t process_count;
+    uint32_t event_count;
+    uint32_t timer_count;
+};
+
+void csp_checkpoint_put(std::vector<uint8_t>& out, const void* p, size_t sz)
+{
+    const uint8_t* b = static_cast<const uint8_t*>(p);
+    out.insert(out.end(), b, b + sz);
+}
+
+template <typename T>
+void csp_checkpoint_put(std::vector<uint8_t>& out, T value)
+{
+    csp_checkpoint_put(out, &value, sizeof(value));
+}
+
+struct CSP_CheckpointReader
+{
+    const uint8_t* curr;
+    const uint8_t* end;
+    bool ok = true;
+
+    template <typename T>
+    T get()
+    {
+        T value{};
+        if (size_t(end - curr) < sizeof(T))
+            ok = false;
+        else
+        {
+            memcpy(&value, curr, sizeof(T));
+            curr += sizeof(T);
+        }
+        return value;
+    }
+
+    std::string get_string(size_t len)
+    {
+        if (size_t(end - curr) < len)
+        {
+            ok = false;
+            return {};
+        }
+        std::string s(reinterpret_cast<const char*>(curr), len);
+        curr += len;
+        return s;
+    }
+};
+
+// Appends the state of csp to out. Returns false if csp is null, or doesn't
+// have an MPMC queue.
+bool csp_checkpoint(CSP* csp, std::vector<uint8_t>& out)
+{
+    if (!csp)
+        return false;
+    assert(csp->queue_kind == CSP_QueueKind::MPMC);
+    if (csp->queue_kind != CSP_QueueKind::MPMC)
+        return false;
+
+    ALLOC_ZONE(CSP);
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+
+    // the queue can only be read by taking the events out, so they're put back
+    std::vector<CSP_Event> events;
+    CSP_Event event;
+    while (csp->q->try_dequeue(event))
+        events.push_back(event);
+    csp->q->enqueue_bulk(events.data(), events.size());
+
+    // timers that have run, or been cancelled, are discarded, as are those
+    // whose names are too long to be emitted
+    struct Timer { const CSP_Timer* timer; int64_t remaining_ns; };
+    std::vector<Timer> timers;
+    std::lock_guard<std::mutex> timers_lock(csp->timers_mutex);
+    int64_t now = vclock_now_ns();
+    for (auto it = csp->timers.begin(); it != csp->timers.end();)
+    {
+        int64_t due = vclock_due(it->first);
+        if (due < 0)
+        {
+            it = csp->timers.erase(it);
+            continue;
+        }
+        if (it->second.name.size() < CSP_EVENT_NAME_MAX)
+            timers.push_back({ &it->second, due > now ? due - now : 0 });
+        ++it;
+    }
+
+    CSP_CheckpointHeader header = {};
+    memcpy(header.magic, csp_checkpoint_magic, sizeof(header.magic));
+    header.version = csp_checkpoint_version;
+    header.process_count = static_cast<uint32_t>(csp->processes.size());
+    header.event_count = static_cast<uint32_t>(events.size());
+    header.timer_count = static_cast<uint32_t>(timers.size());
+    csp_checkpoint_put(out, header);
+
+    for (size_t i = 0; i < csp->processes.size(); ++i)
+    {
+        const std::string& name = csp->processes[i]->name;
+        csp_checkpoint_put(out, static_cast<uint32_t>(name.size()));
+        csp_checkpoint_put(out, name.data(), name.size());
+        csp_checkpoint_put(out, static_cast<int32_t>(csp->processes[i]->ordinal));
+        csp_checkpoint_put(out, static_cast<int32_t>(csp->process_active[i]));
+    }
+    for (auto& e : events)
+    {
+        uint8_t len = static_cast<uint8_t>(strlen(e.name));
+        csp_checkpoint_put(out, len);
+        csp_checkpoint_put(out, e.name, len);
+        csp_checkpoint_put(out, static_cast<int32_t>(e.id));
+    }
+    for (auto& t : timers)
+    {
+        uint8_t len = static_cast<uint8_t>(t.timer->name.size());
+        csp_checkpoint_put(out, len);
+        csp_checkpoint_put(out, t.timer->name.data(), len);
+        csp_checkpoint_put(out, static_cast<int32_t>(t.timer->id));
+        csp_checkpoint_put(out, t.remaining_ns);
+        csp_checkpoint_put(out, t.timer->period_ns);
+    }
+    return true;
+}
+
+// Puts csp in the state held by a checkpoint. The events queued in csp are
+// discarded, and its timers cancelled, in favor of the checkpoint's. Returns
+// false, leaving csp as it was, if the checkpoint is damaged, or csp doesn't
+// have an MPMC queue.
+bool csp_restore(CSP* csp, const uint8_t* data, size_t size)
+{
+    if (!csp || !data)
+        return false;
+    assert(csp->queue_kind == CSP_QueueKind::MPMC);
+    if (csp->queue_kind != CSP_QueueKind::MPMC)
+        return false;
+
+    ALLOC_ZONE(CSP);
+
+    // read all of it before changing anything
+    CSP_CheckpointReader r{ data, data + size };
+    CSP_CheckpointHeader header = r.get<CSP_CheckpointHeader>();
+    if (!r.ok || memcmp(header.magic, csp_checkpoint_magic, sizeof(header.magic)) ||
+        header.version < 1 || header.version > csp_checkpoint_version)
+        return false;
+
+    // a version 1 checkpoint's states all go to the first definition of a name
+    struct State { std::string name; int ordinal; int state; };
+    std::vector<State> states;
+    for (uint32_t i = 0; i < header.process_count && r.ok; ++i)
+    {
+        std::string name = r.get_string(r.get<uint32_t>());
+        int ordinal = header.version >= 2 ? r.get<int32_t>() : 0;
+        int state = r.get<int32_t>();
+        states.push_back({ std::move(name), ordinal, state });
+    }
+
+    std::vector<CSP_Event> events;
+    for (uint32_t i = 0; i < header.event_count && r.ok; ++i)
+    {
+        uint8_t len = r.get<uint8_t>();
+        std::string name = r.get_string(len);
+        int id = r.get<int32_t>();
+        r.ok = r.ok && len < CSP_EVENT_NAME_MAX;
+        if (!r.ok)
+            break;
+
+        CSP_Event e;
+        memcpy(e.name, name.c_str(), len + 1);
+        e.id = id;
+        e.slot = csp_event_slot(csp, e.name, len);
+        e.depth = 0;
+        e.call = nullptr;
+        events.push_back(e);
+    }
+
+    std::vector<std::pair<CSP_Timer, int64_t>> timers;
+    for (uint32_t i = 0; i < header.timer_count && r.ok; ++i)
+    {
+        uint8_t len = r.get<uint8_t>();
+        CSP_Timer t;
+        t.name = r.get_string(len);
+        t.id = r.get<int32_t>();
+        int64_t remaining_ns = r.get<int64_t>();
+        t.period_ns = r.get<int64_t>();
+        timers.emplace_back(std::move(t), remaining_ns);
+    }
+    if (!r.ok || r.curr != r.end)
+        return false;
+
+    csp_cancel_timers(csp);
+
+    size_t restored = 0;
+    {
+        std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+
+        std::map<std::pair<std::string, int>, size_t> current;
+        for (size_t i = 0; i < csp->processes.size(); ++i)
+            current.emplace(std::make_pair(csp->processes[i]->name, csp->processes[i]->ordinal), i);
+        for (auto& s : states)
+        {
+            auto it = current.find(std::make_pair(s.name, s.ordinal));
+            if (it == current.end())
+                continue;
+            csp->process_active[it->second] = s.state;
+            ++restored;
+        }
+
+        CSP_Event event;
+        while (csp->q->try_dequeue(event))
+            if (event.call)
+            {
+                csp_call_complete(event.call, false, 0);
+                csp_call_release(event.call);
+            }
+        csp->q->enqueue_bulk(events.data(), events.size());
+    }
+
+    for (auto& t : timers)
+        csp_schedule(csp, t.first.name, t.first.id, t.second, t.first.period_ns);
+
+    if (restored != states.size())
+        LOG_INFO("csp: %zu of %zu checkpointed processes restored", restored, states.size());
+    return true;
+}
+
+// Writes a checkpoint of csp beside path, and renames it over path, so that a
+// reader never sees half a checkpoint.
+bool csp_checkpoint_save(CSP* csp, char const*const path)
+{
+    std::vector<uint8_t> state;
+    if (!path || !csp_checkpoint(csp, state))
+        return false;
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(state.data(), 1, state.size(), f) == state.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool csp_checkpoint_load(CSP* csp, char const*const path)
+{
+    FILE* f = path ? fopen(path, "rb") : nullptr;
+    if (!f)
+        return false;
+
+    std::vector<uint8_t> state;
+    uint8_t buff[4096];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), f)) > 0)
+        state.insert(state.end(), buff, buff + n);
+    fclose(f);
+    return csp_restore(csp, state.data(), state.size());
+}
+
+// A new CSP with csp's definition and state, including its queued events and
+// timers, but none of its lambdas; the caller binds its own. The clone's timers
+// must be cancelled, with csp_cancel_timers, before it's deleted.
+CSP* csp_clone(CSP* csp)
+{
+    std::vector<uint8_t> state;
+    if (!csp_checkpoint(csp, state))
+        return nullptr;
+
+    ALLOC_ZONE(CSP);
+    CSP* clone = new CSP();
+    clone->max_cascade_depth = csp->max_cascade_depth;
+    {
+        std::lock_guard<std::mutex> lock(csp->process_data_mutex);
+        for (auto& p : csp->processes)
+        {
+            CSP_Process* c = new CSP_Process();
+            c->name = p->name;
+            c->ordinal = p->ordinal;
+            c->event = p->event;
+            c->guard = p->guard;
+            c->behavior = p->behavior;
+            c->out = p->out;
+            clone->processes.emplace_back(c);
+            clone->process_active.push_back(csp_initial_state(*c));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(clone->process_data_mutex);
+        csp_link(clone);
+    }
+
+    if (!csp_restore(clone, state.data(), state.size()))
+    {
+        delete clone;
+        return nullptr;
+    }
+    return clone;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "InlineFunction.h"
+#include <mutex>
+#include <vector>
+
+// A queue of tasks, run by whichever thread drains it. Any thread may post;
+// the owner drains it from its own loop, so the tasks run on the owner's thread
+// without it having to poll for them individually. Tasks posted while draining
+// run on the next drain. Tasks are held in place, as InlineFunctions, so that
+// posting one doesn't allocate once the queue has grown.
+
+using CSP_Task = InlineFunction<void()>;
+
+struct CSP_Executor
+{
+    std::mutex tasks_mutex;
+    std::vector<CSP_Task> tasks;
+    std::vector<CSP_Task> running;      // kept, so draining doesn't allocate
+};
+
+void csp_executor_post(CSP_Executor* executor, CSP_Task task)
+{
+    if (!executor || !task)
+        return;
+    std::lock_guard<std::mutex> lock(executor->tasks_mutex);
+    executor->tasks.emplace_back(std::move(task));
+}
+
+// Runs the tasks posted so far. Returns how many were run. Must be called by
+// one thread at a time.
+size_t csp_executor_drain(CSP_Executor* executor)
+{
+    if (!executor)
+        return 0;
+    {
+        std::lock_guard<std::mutex> lock(executor->tasks_mutex);
+        if (executor->tasks.empty())
+            return 0;
+        executor->running.swap(executor->tasks);
+    }
+    for (auto& task : executor->running)
+        task();
+    size_t n = executor->running.size();
+    executor->running.clear();
+    return n;
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A guard is a condition on an event's payload, written between brackets after
+// the event a process accepts, as in
+//
+//     P = (tick [id == 3] -> P "third")
+//
+// The process accepts the event only if the guard holds, so dispatch skips the
+// process, and its lambda, otherwise. A guard is an integer expression of id:
+//
+//     or       and { || and }
+//     and      compare { && compare }
+//     compare  sum [ (== | != | < | <= | > | >=) sum ]
+//     sum      term { (+ | -) term }
+//     term     unary { (* | / | %) unary }
+//     unary    (! | -) unary | primary
+//     primary  id | integer | ( or )
+//
+// and holds if it's not zero. Division by zero gives zero. Guards are compiled
+// to a postfix bytecode, evaluated either for one payload, or for a run of
+// payloads at once, an operation at a time.
+enum class CSP_GuardOpcode : uint8_t
+{
+    Id,
+    Constant,   // followed by a one byte constant index
+    Negate, Not,
+    Multiply, Divide, Modulo, Add, Subtract,
+    Less, LessEqual, Greater, GreaterEqual, Equal, NotEqual,
+    And, Or
+};
+
+static constexpr int csp_guard_max_depth = 32;
+static constexpr int csp_guard_max_nesting = 64;
+
+struct CSP_Guard
+{
+    std::string src;                // as written, for display and comparison
+    std::vector<uint8_t> code;      // empty if there is no guard
+    std::vector<int64_t> constants;
+    int max_depth = 0;
+
+    explicit operator bool() const { return !code.empty(); }
+};
+
+struct CSP_GuardCompiler
+{
+    const char* curr;
+    const char* end;
+    CSP_Guard& guard;
+    int depth = 0;
+    int nesting = 0;    // of unary operators and parentheses, each passing through unary
+    bool ok = true;
+
+    void skip()
+    {
+        while (curr < end && (*curr == ' ' || *curr == '\t' || *curr == '\n' || *curr == '\r'))
+            ++curr;
+    }
+
+    bool accept(const char* s)
+    {
+        skip();
+        size_t n = strlen(s);
+        if (size_t(end - curr) < n || memcmp(curr, s, n))
+            return false;
+        // so that < doesn't take the start of <=, nor ! the start of !=
+        if (n == 1 && curr + 1 < end && curr[1] == '=' && strchr("<>!", *s))
+            return false;
+        curr += n;
+        return true;
+    }
+
+    void push(CSP_GuardOpcode op)
+    {
+        guard.code.push_back(static_cast<uint8_t>(op));
+        if (op == CSP_GuardOpcode::Id || op == CSP_GuardOpcode::Constant)
+        {
+            if (++depth > guard.max_depth)
+                guard.max_depth = depth;
+        }
+        else if (op != CSP_GuardOpcode::Negate && op != CSP_GuardOpcode::Not)
+            --depth;
+    }
+
+    void primary()
+    {
+        skip();
+        if (accept("("))
+        {
+            expression();
+            ok = ok && accept(")");
+        }
+        else if (curr + 2 <= end && !memcmp(curr, "id", 2) &&
+                 (curr + 2 == end || !(isalnum(static_cast<unsigned char>(curr[2])) || curr[2] == '_')))
+        {
+            curr += 2;
+            push(CSP_GuardOpcode::Id);
+        }
+        else if (curr < end && *curr >= '0' && *curr <= '9')
+        {
+            int64_t value = 0;
+            while (curr < end && *curr >= '0' && *curr <= '9' && value < (INT64_MAX - 9) / 10)
+                value = value * 10 + (*curr++ - '0');
+            ok = ok && !(curr < end && *curr >= '0' && *curr <= '9') && guard.constants.size() < 256;
+            if (!ok)
+                return;
+            push(CSP_GuardOpcode::Constant);
+            guard.code.push_back(static_cast<uint8_t>(guard.constants.size()));
+            guard.constants.push_back(value);
+        }
+        else
+            ok = false;
+    }
+
+    void unary()
+    {
+        if (++nesting > csp_guard_max_nesting)
+            ok = false;
+        else if (accept("!"))
+        {
+            unary();
+            push(CSP_GuardOpcode::Not);
+        }
+        else if (accept("-"))
+        {
+            unary();
+            push(CSP_GuardOpcode::Negate);
+        }
+        else
+            primary();
+        --nesting;
+    }
+
+    // one level of left associative binary operators, tried in order
+    template <typename Operand>
+    void binary(Operand operand, std::initializer_list<std::pair<const char*, CSP_GuardOpcode>> ops, bool chain = true)
+    {
+        operand();
+        for (bool more = ok; more && ok; more = more && chain)
+        {
+            more = false;
+            for (auto& op : ops)
+                if (accept(op.first))
+                {
+                    operand();
+                    push(op.second);
+                    more = true;
+                    break;
+                }
+        }
+    }
+
+    void term()
+    {
+        binary([this]() { unary(); }, { {"*", CSP_GuardOpcode::Multiply}, {"/", CSP_GuardOpcode::Divide},
+                                        {"%", CSP_GuardOpcode::Modulo} });
+    }
+
+    void sum()
+    {
+        binary([this]() { term(); }, { {"+", CSP_GuardOpcode::Add}, {"-", CSP_GuardOpcode::Subtract} });
+    }
+
+    void compare()
+    {
+        binary([this]() { sum(); }, { {"==", CSP_GuardOpcode::Equal}, {"!=", CSP_GuardOpcode::NotEqual},
+                                      {"<=", CSP_GuardOpcode::LessEqual}, {">=", CSP_GuardOpcode::GreaterEqual},
+                                      {"<", CSP_GuardOpcode::Less}, {">", CSP_GuardOpcode::Greater} }, false);
+    }
+
+    void conjunction()
+    {
+        binary([this]() { compare(); }, { {"&&", CSP_GuardOpcode::And} });
+    }
+
+    void expression()
+    {
+        binary([this]() { conjunction(); }, { {"||", CSP_GuardOpcode::Or} });
+    }
+};
+
+// Compiles the text of a guard, without its brackets. Returns false if it's not
+// a guard, nests deeper than csp_guard_max_nesting, or needs more than 256
+// constants, or csp_guard_max_depth stack entries, in which case guard is left
+// empty.
+bool csp_guard_compile(char const*const src, size_t len, CSP_Guard& guard)
+{
+    guard = CSP_Guard{};
+    CSP_GuardCompiler c{ src, src + len, guard };
+    c.expression();
+    c.skip();
+    if (!c.ok || c.curr != c.end || guard.max_depth > csp_guard_max_depth)
+    {
+        guard = CSP_Guard{};
+        return false;
+    }
+    guard.src.assign(src, len);
+    return true;
+}
+
+int64_t csp_guard_apply(CSP_GuardOpcode op, int64_t a, int64_t b)
+{
+    // wrapping, rather than overflowing
+    auto u = [](int64_t v) { return static_cast<uint64_t>(v); };
+    switch (op)
+    {
+    case CSP_GuardOpcode::Multiply:     return static_cast<int64_t>(u(a) * u(b));
+    case CSP_GuardOpcode::Divide:       return b == 0 || (b == -1 && a == INT64_MIN) ? 0 : a / b;
+    case CSP_GuardOpcode::Modulo:       return b == 0 || b == -1 ? 0 : a % b;
+    case CSP_GuardOpcode::Add:          return static_cast<int64_t>(u(a) + u(b));
+    case CSP_GuardOpcode::Subtract:     return static_cast<int64_t>(u(a) - u(b));
+    case CSP_GuardOpcode::Less:         return a < b;
+    case CSP_GuardOpcode::LessEqual:    return a <= b;
+    case CSP_GuardOpcode::Greater:      return a > b;
+    case CSP_GuardOpcode::GreaterEqual: return a >= b;
+    case CSP_GuardOpcode::Equal:        return a == b;
+    case CSP_GuardOpcode::NotEqual:     return a != b;
+    case CSP_GuardOpcode::And:          return a && b;
+    case CSP_GuardOpcode::Or:           return a || b;
+    default:                            return 0;
+    }
+}
+
+// Evaluates the guard for one payload. An empty guard always holds.
+bool csp_guard_eval(const CSP_Guard& guard, int id)
+{
+    int64_t stack[csp_guard_max_depth];
+    int sp = 0;
+    const uint8_t* pc = guard.code.data();
+    const uint8_t* pc_end = pc + guard.code.size();
+    if (pc == pc_end)
+        return true;
+
+    while (pc < pc_end)
+    {
+        CSP_GuardOpcode op = static_cast<CSP_GuardOpcode>(*pc++);
+        switch (op)
+        {
+        case CSP_GuardOpcode::Id:       stack[sp++] = id; break;
+        case CSP_GuardOpcode::Constant: stack[sp++] = guard.constants[*pc++]; break;
+        case CSP_GuardOpcode::Negate:   stack[sp - 1] = static_cast<int64_t>(0 - static_cast<uint64_t>(stack[sp - 1])); break;
+        case CSP_GuardOpcode::Not:      stack[sp - 1] = !stack[sp - 1]; break;
+        default:
+            --sp;
+            stack[sp - 1] = csp_guard_apply(op, stack[sp - 1], stack[sp]);
+            break;
+        }
+    }
+    return stack[0] != 0;
+}
+
+// Evaluates the guard for count payloads, writing 1 to pass where it holds and
+// 0 where it doesn't. Each operation is applied to a chunk of payloads before
+// the next is decoded, so the cost of decoding is shared across the chunk.
+void csp_guard_eval_batch(const CSP_Guard& guard, const int* ids, size_t count, uint8_t* pass)
+{
+    if (guard.code.empty())
+    {
+        memset(pass, 1, count);
+        return;
+    }
+
+    constexpr size_t chunk = 64;
+    int64_t stack[csp_guard_max_depth][chunk];
+    for (size_t begin = 0; begin < count; begin += chunk)
+    {
+        size_t n = count - begin < chunk ? count - begin : chunk;
+        int sp = 0;
+        const uint8_t* pc = guard.code.data();
+        const uint8_t* pc_end = pc + guard.code.size();
+        while (pc < pc_end)
+        {
+            CSP_GuardOpcode op = static_cast<CSP_GuardOpcode>(*pc++);
+            switch (op)
+            {
+            case CSP_GuardOpcode::Id:
+            {
+                int64_t* r = stack[sp++];
+                for (size_t i = 0; i < n; ++i)
+                    r[i] = ids[begin + i];
+                break;
+            }
+            case CSP_GuardOpcode::Constant:
+            {
+                int64_t* r = stack[sp++];
+                int64_t value = guard.constants[*pc++];
+                for (size_t i = 0; i < n; ++i)
+                    r[i] = value;
+                break;
+            }
+            case CSP_GuardOpcode::Negate:
+            {
+                int64_t* r = stack[sp - 1];
+                for (size_t i = 0; i < n; ++i)
+                    r[i] = static_cast<int64_t>(0 - static_cast<uint64_t>(r[i]));
+                break;
+            }
+            case CSP_GuardOpcode::Not:
+            {
+                int64_t* r = stack[sp - 1];
+                for (size_t i = 0; i < n; ++i)
+                    r[i] = !r[i];
+                break;
+            }
+            default:
+            {
+                --sp;
+                int64_t* a = stack[sp - 1];
+                const int64_t* b = stack[sp];
+                for (size_t i = 0; i < n; ++i)
+                    a[i] = csp_guard_apply(op, a[i], b[i]);
+                break;
+            }
+            }
+        }
+        for (size_t i = 0; i < n; ++i)
+            pass[begin + i] = stack[0][i] != 0;
+    }
+}
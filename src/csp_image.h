@@ -0,0 +1,339 @@
+#pragma once
+
+#include "csp.h"
+#include "log.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// A compiled CSP image holds the processes parsed from a CSP source, so that a
+// later run can load them without parsing. The image is keyed by a hash of the
+// source it was parsed from; an image whose key doesn't match is ignored.
+//
+// Layout, in native byte order:
+//     header
+//     symbols     symbol_count  x CSP_ImageSymbol, offsets into the strings
+//     processes   process_count x CSP_ImageProcess, indices into the symbols
+//     strings     every distinct name, event, guard and output, nul terminated
+//
+// Loading maps the file, checks it, and replaces each symbol's offset with a
+// pointer into the mapping. Guards are stored as written, and compiled again.
+
+static constexpr char csp_image_magic[8] = { 'G', 'C', 'S', 'P', 'I', 'M', 'G', 0 };
+static constexpr uint32_t csp_image_version = 2;
+
+struct CSP_ImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_hash;
+    uint32_t symbol_count;
+    uint32_t process_count;
+    uint64_t symbols_offset;
+    uint64_t processes_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+
+struct CSP_ImageSymbol
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct CSP_ImageProcess
+{
+    uint32_t name;
+    uint32_t event;
+    uint32_t guard;         // the empty string if there is none
+    uint32_t behavior;
+    uint32_t out;
+    int32_t active;
+};
+
+// FNV-1a, 64 bit
+uint64_t csp_source_hash(char const*const src, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ static_cast<uint8_t>(src[i])) * 1099511628211ull;
+    return h;
+}
+
+// Writes the processes from first onwards. The file is written beside its final
+// name, and renamed over it, so that a concurrent reader never sees half an image.
+bool csp_image_write(CSP* csp, size_t first, char const*const path, uint64_t source_hash)
+{
+    if (!csp || !path)
+        return false;
+
+    std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+
+    std::vector<CSP_ImageSymbol> symbols;
+    std::vector<CSP_ImageProcess> processes;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> interned;
+    auto intern = [&](const std::string& s) -> uint32_t
+    {
+        auto it = interned.find(s);
+        if (it != interned.end())
+            return it->second;
+        uint32_t index = static_cast<uint32_t>(symbols.size());
+        symbols.push_back({ static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(s.size()) });
+        strings.append(s);
+        strings.push_back('\0');
+        interned.emplace(s, index);
+        return index;
+    };
+
+    for (size_t i = first; i < csp->processes.size(); ++i)
+    {
+        CSP_Process* p = csp->processes[i].get();
+        CSP_ImageProcess ip;
+        ip.name = intern(p->name);
+        ip.event = intern(p->event);
+        ip.guard = intern(p->guard.src);
+        ip.behavior = intern(p->behavior);
+        ip.out = intern(p->out);
+        ip.active = csp->process_active[i];
+        processes.push_back(ip);
+    }
+
+    CSP_ImageHeader header = {};
+    memcpy(header.magic, csp_image_magic, sizeof(header.magic));
+    header.version = csp_image_version;
+    header.header_size = sizeof(CSP_ImageHeader);
+    header.source_hash = source_hash;
+    header.symbol_count = static_cast<uint32_t>(symbols.size());
+    header.process_count = static_cast<uint32_t>(processes.size());
+    header.symbols_offset = sizeof(CSP_ImageHeader);
+    header.processes_offset = header.symbols_offset + symbols.size() * sizeof(CSP_ImageSymbol);
+    header.strings_offset = header.processes_offset + processes.size() * sizeof(CSP_ImageProcess);
+    header.strings_size = strings.size();
+    lock.unlock();
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && (symbols.empty() || fwrite(symbols.data(), sizeof(CSP_ImageSymbol), symbols.size(), f) == symbols.size());
+    ok = ok && (processes.empty() || fwrite(processes.data(), sizeof(CSP_ImageProcess), processes.size(), f) == processes.size());
+    ok = ok && (strings.empty() || fwrite(strings.data(), 1, strings.size(), f) == strings.size());
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (!ok || rename(tmp.c_str(), path) != 0)
+    {
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A read only mapping of a whole file.
+struct CSP_ImageMapping
+{
+    const char* data = nullptr;
+    size_t size = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+bool csp_image_map(char const*const path, CSP_ImageMapping& m)
+{
+#if defined(_WIN32)
+    m.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m.file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m.file, &size) || !size.QuadPart)
+    {
+        CloseHandle(m.file);
+        return false;
+    }
+    m.mapping = CreateFileMappingA(m.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m.mapping)
+    {
+        CloseHandle(m.file);
+        return false;
+    }
+    m.data = static_cast<const char*>(MapViewOfFile(m.mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m.data)
+    {
+        CloseHandle(m.mapping);
+        CloseHandle(m.file);
+        return false;
+    }
+    m.size = static_cast<size_t>(size.QuadPart);
+    return true;
+#elif defined(__unix__) || defined(__APPLE__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    m.data = static_cast<const char*>(p);
+    m.size = static_cast<size_t>(st.st_size);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void csp_image_unmap(CSP_ImageMapping& m)
+{
+    if (!m.data)
+        return;
+#if defined(_WIN32)
+    UnmapViewOfFile(m.data);
+    CloseHandle(m.mapping);
+    CloseHandle(m.file);
+#elif defined(__unix__) || defined(__APPLE__)
+    munmap(const_cast<char*>(m.data), m.size);
+#endif
+    m.data = nullptr;
+    m.size = 0;
+}
+
+// Appends the image's processes to csp. Returns false, leaving csp unchanged,
+// if the image is missing, was made from a different source, or is malformed.
+bool csp_image_load(CSP* csp, char const*const path, uint64_t source_hash)
+{
+    if (!csp || !path)
+        return false;
+
+    CSP_ImageMapping m;
+    if (!csp_image_map(path, m))
+        return false;
+
+    bool ok = false;
+    do
+    {
+        if (m.size < sizeof(CSP_ImageHeader))
+            break;
+
+        CSP_ImageHeader header;
+        memcpy(&header, m.data, sizeof(header));
+        if (memcmp(header.magic, csp_image_magic, sizeof(header.magic)) ||
+            header.version != csp_image_version ||
+            header.header_size != sizeof(CSP_ImageHeader) ||
+            header.source_hash != source_hash)
+            break;
+
+        // every table must lie within the file
+        uint64_t symbols_end = header.symbols_offset + uint64_t(header.symbol_count) * sizeof(CSP_ImageSymbol);
+        uint64_t processes_end = header.processes_offset + uint64_t(header.process_count) * sizeof(CSP_ImageProcess);
+        uint64_t strings_end = header.strings_offset + header.strings_size;
+        if (symbols_end > m.size || processes_end > m.size || strings_end > m.size ||
+            header.symbols_offset % alignof(CSP_ImageSymbol) || header.processes_offset % alignof(CSP_ImageProcess))
+            break;
+
+        // fix up the symbols' offsets into pointers into the mapping
+        const CSP_ImageSymbol* image_symbols = reinterpret_cast<const CSP_ImageSymbol*>(m.data + header.symbols_offset);
+        const char* strings = m.data + header.strings_offset;
+        std::vector<StrView> symbols(header.symbol_count);
+        bool symbols_ok = true;
+        for (uint32_t i = 0; i < header.symbol_count && symbols_ok; ++i)
+        {
+            const CSP_ImageSymbol& s = image_symbols[i];
+            symbols_ok = uint64_t(s.offset) + s.length < header.strings_size;
+            symbols[i] = StrView{ strings + s.offset, s.length };
+        }
+        if (!symbols_ok)
+            break;
+
+        const CSP_ImageProcess* image_processes = reinterpret_cast<const CSP_ImageProcess*>(m.data + header.processes_offset);
+        std::vector<std::unique_ptr<CSP_Process>> processes;
+        std::vector<int> active;
+        processes.reserve(header.process_count);
+        active.reserve(header.process_count);
+        bool processes_ok = true;
+        for (uint32_t i = 0; i < header.process_count && processes_ok; ++i)
+        {
+            const CSP_ImageProcess& ip = image_processes[i];
+            processes_ok = ip.name < header.symbol_count && ip.event < header.symbol_count &&
+                           ip.guard < header.symbol_count && ip.behavior < header.symbol_count &&
+                           ip.out < header.symbol_count;
+            if (!processes_ok)
+                break;
+
+            const StrView& guard = symbols[ip.guard];
+            CSP_Guard compiled;
+            processes_ok = !guard.sz || csp_guard_compile(guard.curr, guard.sz, compiled);
+            if (!processes_ok)
+                break;
+
+            CSP_Process* p = new CSP_Process();
+            p->name.assign(symbols[ip.name].curr, symbols[ip.name].sz);
+            p->event.assign(symbols[ip.event].curr, symbols[ip.event].sz);
+            p->guard = std::move(compiled);
+            p->behavior.assign(symbols[ip.behavior].curr, symbols[ip.behavior].sz);
+            p->out.assign(symbols[ip.out].curr, symbols[ip.out].sz);
+            processes.emplace_back(p);
+            active.push_back(ip.active);
+        }
+        if (!processes_ok)
+            break;
+        csp_number_definitions(processes);
+
+        ALLOC_ZONE(CSP);
+        std::unique_lock<std::mutex> lock(csp->process_data_mutex);
+        for (size_t i = 0; i < processes.size(); ++i)
+        {
+            csp->processes.emplace_back(std::move(processes[i]));
+            csp->process_active.push_back(active[i]);
+        }
+        csp_link(csp);
+        ok = true;
+    } while (false);
+
+    csp_image_unmap(m);
+    return ok;
+}
+
+// Loads the processes of src from the image at path if it was made from the
+// same source, and otherwise parses src and writes the image for next time.
+// As with csp_parse, merges into csp, or returns a new one given nullptr.
+CSP* csp_parse_cached(CSP* csp, char const*const src, size_t len, char const*const path)
+{
+    if (!csp)
+        csp = csp_create(CSP_Config());
+
+    uint64_t hash = csp_source_hash(src, len);
+    if (path && csp_image_load(csp, path, hash))
+        return csp;
+
+    size_t first = csp->processes.size();
+    csp_parse(csp, src, len);
+    if (path && !csp_image_write(csp, first, path, hash))
+        LOG_WARN("could not write the CSP image %s", path);
+    return csp;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "csp.h"
+#include "csp_sink.h"
+#include <imgui/imgui.h>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// An ImGui panel that shows the state of a CSP: which processes are active, the
+// events emitted and waiting by name, and the calls and times of the lambdas.
+//
+// The counts shown are read from the CSP's atomic counters. The panel must be
+// drawn on the thread that updates the CSP, as it walks the process table,
+// which only that thread changes at run time; reloads, for instance, are
+// applied by csp_update. Lambdas and sinks can be bound and added from any
+// thread, so their rows are copied under the CSP's lock, and drawn after it's
+// released. Lambdas are timed only while the panel is open.
+
+struct CSP_Inspector
+{
+    bool open = false;
+
+    // rates are recomputed every rate_period seconds from the change in counts
+    double rate_period = 0.5;
+    std::chrono::steady_clock::time_point sample_time;
+    std::vector<uint64_t> event_counts;
+    std::vector<double> event_rates;
+    std::vector<uint64_t> process_counts;
+    std::vector<double> process_rates;
+};
+
+void csp_inspector_sample(CSP_Inspector& inspector, CSP* csp)
+{
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - inspector.sample_time).count();
+    size_t process_count = csp->processes.size();
+    bool first = inspector.event_counts.empty();
+    if (!first && elapsed < inspector.rate_period && inspector.process_counts.size() == process_count)
+        return;
+
+    inspector.event_counts.resize(CSP_EVENT_STATS_SLOTS);
+    inspector.event_rates.resize(CSP_EVENT_STATS_SLOTS);
+    for (int i = 0; i < CSP_EVENT_STATS_SLOTS; ++i)
+    {
+        uint64_t n = csp->event_stats[i].emitted.load(std::memory_order_relaxed);
+        inspector.event_rates[i] = first ? 0 : (n - inspector.event_counts[i]) / elapsed;
+        inspector.event_counts[i] = n;
+    }
+
+    // a reload may have replaced the processes, so start their rates over
+    if (inspector.process_counts.size() != process_count)
+    {
+        inspector.process_counts.clear();
+        first = true;
+    }
+    inspector.process_counts.resize(process_count);
+    inspector.process_rates.resize(process_count);
+    for (size_t i = 0; i < process_count; ++i)
+    {
+        uint64_t n = csp->processes[i]->fired.load(std::memory_order_relaxed);
+        inspector.process_rates[i] = first ? 0 : (n - inspector.process_counts[i]) / elapsed;
+        inspector.process_counts[i] = n;
+    }
+    inspector.sample_time = now;
+}
+
+void csp_inspector_draw(CSP_Inspector& inspector, CSP* csp)
+{
+    if (!csp)
+        return;
+
+    csp_time_lambdas(csp, inspector.open);
+    if (!inspector.open)
+        return;
+
+    csp_inspector_sample(inspector, csp);
+
+    ImGui::SetNextWindowSize(ImVec2(520, 480), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("CSP Inspector", &inspector.open))
+    {
+        ImGui::End();
+        return;
+    }
+
+    ImGui::Text("queued: %zu  unmatched: %llu  cascade dropped: %llu", csp->q->size_approx(),
+                static_cast<unsigned long long>(csp->unmatched.load(std::memory_order_relaxed)),
+                static_cast<unsigned long long>(csp->cascade_dropped));
+
+    if (ImGui::CollapsingHeader("Processes", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        static char const*const states[] = { "idle", "active", "pending" };
+        ImGui::Columns(5, "###csp_processes");
+        ImGui::TextUnformatted("process"); ImGui::NextColumn();
+        ImGui::TextUnformatted("transition"); ImGui::NextColumn();
+        ImGui::TextUnformatted("state"); ImGui::NextColumn();
+        ImGui::TextUnformatted("fired"); ImGui::NextColumn();
+        ImGui::TextUnformatted("fired/s"); ImGui::NextColumn();
+        ImGui::Separator();
+        for (size_t i = 0; i < csp->processes.size() && i < inspector.process_counts.size(); ++i)
+        {
+            CSP_Process* p = csp->processes[i].get();
+            int state = csp->process_active[i];
+            ImGui::TextUnformatted(p->name.c_str()); ImGui::NextColumn();
+            if (p->guard)
+                ImGui::Text("%s [%s] -> %s", p->event.c_str(), p->guard.src.c_str(), p->behavior.c_str());
+            else
+                ImGui::Text("%s -> %s", p->event.c_str(), p->behavior.c_str());
+            ImGui::NextColumn();
+            if (state == 1)
+                ImGui::TextColored(ImVec4(0.4f, 1.f, 0.4f, 1.f), "%s", states[state]);
+            else
+                ImGui::TextUnformatted(state >= 0 && state <= 2 ? states[state] : "?");
+            ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(p->fired.load(std::memory_order_relaxed))); ImGui::NextColumn();
+            ImGui::Text("%.1f", inspector.process_rates[i]); ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+
+    if (ImGui::CollapsingHeader("Events", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Columns(5, "###csp_events");
+        ImGui::TextUnformatted("event"); ImGui::NextColumn();
+        ImGui::TextUnformatted("emitted"); ImGui::NextColumn();
+        ImGui::TextUnformatted("queued"); ImGui::NextColumn();
+        ImGui::TextUnformatted("emitted/s"); ImGui::NextColumn();
+        ImGui::TextUnformatted("unmatched"); ImGui::NextColumn();
+        ImGui::Separator();
+        for (int i = 0; i < CSP_EVENT_STATS_SLOTS; ++i)
+        {
+            CSP_EventStats& es = csp->event_stats[i];
+            if (!es.named.load(std::memory_order_acquire))
+                continue;
+
+            // read dispatched first, so that queued is never negative
+            uint64_t dispatched = es.dispatched.load(std::memory_order_relaxed);
+            uint64_t emitted = es.emitted.load(std::memory_order_relaxed);
+            uint64_t unmatched = es.unmatched.load(std::memory_order_relaxed);
+            ImGui::TextUnformatted(es.name); ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(emitted)); ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(emitted >= dispatched ? emitted - dispatched : 0)); ImGui::NextColumn();
+            ImGui::Text("%.1f", inspector.event_rates[i]); ImGui::NextColumn();
+            if (unmatched)
+                ImGui::TextColored(ImVec4(1.f, 0.6f, 0.2f, 1.f), "%llu", static_cast<unsigned long long>(unmatched));
+            else
+                ImGui::TextUnformatted("0");
+            ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+
+    struct SinkRow
+    {
+        std::string name;
+        uint64_t lag;
+        double lag_seconds;
+        uint64_t dropped;
+        uint64_t spilled;
+    };
+    struct LambdaRow
+    {
+        std::string name;
+        uint64_t calls;
+        double mean_us;
+        double max_us;
+    };
+    std::vector<SinkRow> sinks;
+    std::vector<LambdaRow> lambdas;
+    {
+        std::lock_guard<std::mutex> lock(csp->process_data_mutex);
+        for (CSP_DispatchTap* tap : csp->dispatch_taps)
+            if (auto c = dynamic_cast<CSP_SinkChannel*>(tap))
+                sinks.push_back({ c->config.name, csp_sink_lag(c), csp_sink_lag_seconds(c),
+                                  c->dropped.load(std::memory_order_relaxed),
+                                  c->spilled.load(std::memory_order_relaxed) });
+        for (auto& i : csp->lambdas)
+        {
+            const CSP_Lambda& l = i.second;
+            uint64_t timed_calls = l.timed_calls.load(std::memory_order_relaxed);
+            uint64_t total_ns = l.total_ns.load(std::memory_order_relaxed);
+            lambdas.push_back({ i.first, l.calls.load(std::memory_order_relaxed),
+                                timed_calls ? total_ns * 1e-3 / timed_calls : 0.0,
+                                l.max_ns.load(std::memory_order_relaxed) * 1e-3 });
+        }
+    }
+
+    if (sinks.size() && ImGui::CollapsingHeader("Sinks", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Columns(5, "###csp_sinks");
+        ImGui::TextUnformatted("sink"); ImGui::NextColumn();
+        ImGui::TextUnformatted("lag"); ImGui::NextColumn();
+        ImGui::TextUnformatted("lag s"); ImGui::NextColumn();
+        ImGui::TextUnformatted("dropped"); ImGui::NextColumn();
+        ImGui::TextUnformatted("spilled"); ImGui::NextColumn();
+        ImGui::Separator();
+        for (auto& r : sinks)
+        {
+            ImGui::TextUnformatted(r.name.c_str()); ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(r.lag)); ImGui::NextColumn();
+            ImGui::Text("%.3f", r.lag_seconds); ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(r.dropped)); ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(r.spilled)); ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+
+    if (ImGui::CollapsingHeader("Lambdas", ImGuiTreeNodeFlags_DefaultOpen))
+    {
+        ImGui::Columns(4, "###csp_lambdas");
+        ImGui::TextUnformatted("lambda"); ImGui::NextColumn();
+        ImGui::TextUnformatted("calls"); ImGui::NextColumn();
+        ImGui::TextUnformatted("mean us"); ImGui::NextColumn();
+        ImGui::TextUnformatted("max us"); ImGui::NextColumn();
+        ImGui::Separator();
+        for (auto& r : lambdas)
+        {
+            ImGui::TextUnformatted(r.name.c_str()); ImGui::NextColumn();
+            ImGui::Text("%llu", static_cast<unsigned long long>(r.calls)); ImGui::NextColumn();
+            ImGui::Text("%.2f", r.mean_us); ImGui::NextColumn();
+            ImGui::Text("%.2f", r.max_us); ImGui::NextColumn();
+        }
+        ImGui::Columns(1);
+    }
+
+    ImGui::End();
+}
@@ -1,36 +1,731 @@
 
-
 #define LABTEXT_ODR
 #include "csp.h"
+#include "calc_program.h"
+#include "csp_checkpoint.h"
+#include "csp_record.h"
+#include "csp_shm.h"
+#include "csp_sink.h"
+#include "blackboard.h"
+#include "journal.h"
+#include "log.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
+#include <thread>
 
 char* csp_src = R"csp(
     CLOCK = (tick -> CLOCK "ticked")
     CLOCK2 = (tick -> (tock -> CLOCK2 "clock2_tocked") "ticked")
 )csp";
 
-int main() try
+// Every allocation is counted, so that the steady state of the hot path can be
+// verified to be allocation free.
+std::atomic<size_t> allocation_count{0};
+
+void* operator new(size_t sz)
+{
+    ++allocation_count;
+    if (void* p = malloc(sz ? sz : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+// emit -> update -> lambda -> commit, with a payload passed via the blackboard
+bool test_hot_path_allocations()
+{
+    char const*const src = R"csp(
+        PUSH = (push -> PUSH "push")
+        POP = (pop -> POP "pop")
+        PUSHES = (pushes -> PUSHES "pushes")
+    )csp";
+    CSP* csp = csp_parse(nullptr, src, strlen(src));
+    Blackboard blackboard;
+    Journal journal;
+    std::vector<float> stack;
+    std::vector<TypedData*> batch_data;
+    std::vector<float> batch_values;
+
+    const int warm_up = 1000;
+    const int iterations = 100000;
+    journal.reserve(4 * (warm_up + iterations));
+    blackboard_reserve(&blackboard, 16);
+    stack.reserve(16);
+    batch_data.reserve(16);
+    batch_values.reserve(16);
+
+    csp_bind_lambda(csp, "push", [&](int id)
+    {
+        TypedData* d = blackboard_get(&blackboard, id);
+        if (auto td = dynamic_cast<Data<float>*>(d))
+        {
+            float value = td->value();
+            Journal::Transaction transaction
+            {
+                "push",
+                [&stack, value]() { stack.push_back(value); },
+                [&stack]() { stack.pop_back(); }
+            };
+            transaction.action();
+            journal.commit(std::move(transaction));
+        }
+        delete d;
+    });
+    csp_bind_lambda(csp, "pop", [&](int)
+    {
+        if (stack.empty())
+            return;
+        float value = stack.back();
+        Journal::Transaction transaction
+        {
+            "pop",
+            [&stack]() { stack.pop_back(); },
+            [&stack, value]() { stack.push_back(value); }
+        };
+        transaction.action();
+        journal.commit(std::move(transaction));
+    });
+
+    // pushes is taken a run at a time, the way push_value is in chapter 3
+    csp_bind_batch_lambda(csp, "pushes", [&](const int* ids, size_t count)
+    {
+        batch_data.resize(count);
+        blackboard_get_many(&blackboard, ids, count, batch_data.data());
+        for (TypedData* d : batch_data)
+        {
+            if (auto td = dynamic_cast<Data<float>*>(d))
+                batch_values.push_back(td->value());
+            delete d;
+        }
+        batch_data.clear();
+        size_t pushed = batch_values.size();
+        if (!pushed)
+            return;
+
+        Journal::Transaction transaction;
+        transaction.name = "pushes";
+        if (pushed == 1)
+            transaction.action = [&stack, value = batch_values[0]]() { stack.push_back(value); };
+        else
+            transaction.action = [&stack, run = batch_values]() { stack.insert(stack.end(), run.begin(), run.end()); };
+        transaction.undo = [&stack, pushed]() { stack.resize(stack.size() - pushed); };
+        batch_values.clear();
+        transaction.action();
+        journal.commit(std::move(transaction));
+    });
+
+    auto round = [&](int i)
+    {
+        int id = blackboard_new_entry(&blackboard, new Data<float>(static_cast<float>(i)));
+        csp_emit(csp, "push", id);
+        csp_emit(csp, "pop", 0);
+        id = blackboard_new_entry(&blackboard, new Data<float>(static_cast<float>(i)));
+        csp_emit(csp, "pushes", id);
+        csp_emit(csp, "pop", 0);
+        csp_update(csp);
+    };
+
+    for (int i = 0; i < warm_up; ++i)
+        round(i);
+
+    size_t before = allocation_count;
+    for (int i = 0; i < iterations; ++i)
+        round(i);
+    size_t allocations = allocation_count - before;
+
+    // every push, pop, and run of pushes committed its transaction
+    bool committed = journal.size() == size_t(4 * (warm_up + iterations));
+    delete csp;
+    std::cout << "hot path: " << allocations << " allocations in " << iterations << " rounds\n";
+    if (!committed)
+        std::cerr << "hot path: " << journal.size() << " transactions committed\n";
+    return allocations == 0 && committed;
+}
+
+// A program whose constants are all scalars must broadcast their result over
+// the length of its inputs, rather than reading past the constants.
+bool test_calc_program_scalars()
+{
+    CalcProgramRecorder recorder;
+    recorder.push(calc_array(2.f));
+    recorder.push(calc_array(3.f));
+    recorder.binary(CalcOp::Add);
+    recorder.binary(CalcOp::Multiply);
+    CalcProgram program;
+    if (!calc_program_compile(recorder, program))
+    {
+        std::cerr << "calc program: could not compile\n";
+        return false;
+    }
+
+    const size_t n = 100000;
+    std::vector<float> values(n);
+    for (size_t i = 0; i < n; ++i)
+        values[i] = static_cast<float>(i % 1000);
+    CalcArray input = calc_array(std::move(values));
+    CalcArray result;
+    bool ok = calc_program_run(program, &input, result) && result.size() == n;
+    for (size_t i = 0; ok && i < n; ++i)
+        ok = result[i] == input[i] * 5.f;
+    std::cout << "calc program: scalar constants over " << n << " elements " << (ok ? "ok" : "failed") << "\n";
+    return ok;
+}
+
+// A call is answered by the lambda bound with csp_bind_call, completes
+// unanswered if nothing replies, or if it's dropped for cascading too deep, and
+// runs its continuation on the executor it was given.
+bool test_calls()
+{
+    char const*const src = R"csp(
+        DOUBLE = (double -> DOUBLE "double")
+        NESTED = (nested -> NESTED "nested")
+    )csp";
+    CSP_Config config;
+    config.max_cascade_depth = 1;
+    CSP* csp = csp_parse(csp_create(config), src, strlen(src));
+    csp_bind_call(csp, "double", [](int id) { return id * 2; });
+
+    bool passed = true;
+    auto check = [&passed](bool ok, char const*const what)
+    {
+        std::cout << "calls: " << what << (ok ? " ok" : " failed") << "\n";
+        passed = passed && ok;
+    };
+
+    // answered, with the continuation run by csp_update on its own executor
+    int continued = 0;
+    CSP_Future answered = csp_call(csp, "double", 21);
+    answered.then([&continued](bool a, int value) { continued += a && value == 42; });
+    bool early = answered.ready();
+    csp_update(csp);
+    check(!early && answered.ready() && answered.answered() && answered.value() == 42 && continued == 1, "answered");
+
+    // no process accepts the event
+    CSP_Future unanswered = csp_call(csp, "nobody", 1);
+    csp_update(csp);
+    check(unanswered.ready() && !unanswered.answered(), "unanswered");
+
+    // a call made from a handler two deep is past max_cascade_depth
+    CSP_Future dropped, nested;
+    csp_bind_lambda(csp, "nested", [&](int depth)
+    {
+        if (depth == 0)
+            nested = csp_call(csp, "nested", 1);
+        else
+            dropped = csp_call(csp, "double", 1);
+    });
+    csp_emit(csp, "nested", 0);
+    csp_update(csp);
+    check(nested.ready() && dropped.ready() && !dropped.answered(), "dropped by the cascade limit");
+
+    // the continuation runs when the caller drains its executor, on its thread
+    CSP_Executor executor;
+    std::thread::id ran_on;
+    CSP_Future posted = csp_call(csp, "double", 5, &executor);
+    posted.then([&ran_on](bool, int) { ran_on = std::this_thread::get_id(); });
+    std::thread([csp]() { csp_update(csp); }).join();
+    bool waited = ran_on == std::thread::id();
+    size_t ran = csp_executor_drain(&executor);
+    check(waited && ran == 1 && ran_on == std::this_thread::get_id() && posted.value() == 10, "continuation on a custom executor");
+
+    delete csp;
+    return passed;
+}
+
+// A sink is given every event in the order it was dispatched, whether it kept
+// up, spilled, or dropped events, and its lag counts what it has yet to see.
+bool test_sink()
+{
+    struct GatedSink : public CSP_Sink
+    {
+        void consume(const CSP_SinkEvent* events, size_t count) override
+        {
+            while (!open.load(std::memory_order_acquire))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            for (size_t i = 0; i < count; ++i)
+                ids.push_back(events[i].event.id);
+            if (during)
+                during(count);
+        }
+        std::atomic<bool> open{false};
+        std::vector<int> ids;
+        std::function<void(size_t)> during;     // stands in for csp_update, mid drain
+    };
+
+    bool passed = true;
+    auto check = [&passed](bool ok, char const*const what)
+    {
+        std::cout << "sink: " << what << (ok ? " ok" : " failed") << "\n";
+        passed = passed && ok;
+    };
+    auto in_order = [](const std::vector<int>& ids, size_t count)
+    {
+        if (ids.size() != count)
+            return false;
+        for (size_t i = 1; i < ids.size(); ++i)
+            if (ids[i] <= ids[i - 1])
+                return false;
+        return true;
+    };
+
+    CSP_SinkConfig config;
+    config.capacity = 8;
+    config.batch = 4;
+    config.policy = CSP_SinkPolicy::Spill;
+
+    // events dispatched while the sink consumes the last of the ring fill it
+    // and spill; the ring must still be taken before the spill
+    {
+        GatedSink sink;
+        sink.open = true;
+        CSP_SinkChannel c(&sink, config);
+        int next = 0;
+        auto dispatch = [&c, &next](int count)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                CSP_Event event{};
+                event.id = next++;
+                c.dispatched(event, true);
+            }
+        };
+        sink.during = [&](size_t count)
+        {
+            if (count < config.batch && next < 100)
+                dispatch(20);
+        };
+        dispatch(2);
+        std::vector<CSP_SinkEvent> spilled;
+        while (csp_sink_drain(&c, spilled))
+            ;
+        check(c.spilled.load() > 0 && in_order(sink.ids, next) && !csp_sink_lag(&c), "spill taken after the ring");
+    }
+
+    char const*const src = R"csp(
+        TICK = (tick -> TICK)
+    )csp";
+    CSP* csp = csp_parse(nullptr, src, strlen(src));
+    auto emit = [csp](int count)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            csp_emit(csp, "tick", i);
+            if (i % 10 == 9)
+                csp_update(csp);
+        }
+        csp_update(csp);
+    };
+    auto caught_up = [](CSP_SinkChannel* c)
+    {
+        for (int i = 0; i < 5000 && csp_sink_lag(c); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return !csp_sink_lag(c);
+    };
+
+    // a stalled sink, spilling, lags by everything dispatched, then catches up
+    GatedSink spilling;
+    config.name = "odr_spill";
+    CSP_SinkChannel* c = csp_add_sink(csp, &spilling, config);
+    emit(1000);
+    uint64_t lag = csp_sink_lag(c);
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    double lag_seconds = csp_sink_lag_seconds(c);
+    check(lag == 1000 && lag_seconds > 0 && c->spilled.load() > 0, "lag of a stalled sink");
+    spilling.open = true;
+    bool current = caught_up(c);
+    check(current && csp_sink_lag_seconds(c) == 0 && in_order(spilling.ids, 1000), "caught up, in order");
+    csp_remove_sink(c);
+
+    // a stalled sink that drops what its ring can't hold
+    GatedSink dropping;
+    config.name = "odr_drop";
+    config.policy = CSP_SinkPolicy::Drop;
+    c = csp_add_sink(csp, &dropping, config);
+    emit(100);
+    uint64_t dropped = c->dropped.load();
+    lag = csp_sink_lag(c);
+    check(dropped > 0 && lag + dropped == 100, "lag of a sink dropping events");
+    dropping.open = true;
+    current = caught_up(c);
+    check(current && in_order(dropping.ids, 100 - dropped), "kept events in order");
+    csp_remove_sink(c);
+
+    delete csp;
+    return passed;
+}
+
+// Each definition of a repeated name keeps its own state through a checkpoint,
+// whether it's restored into a new CSP or cloned.
+bool test_checkpoint_repeated_definitions()
+{
+    char const*const src = R"csp(
+        DOOR = (open -> (close -> DOOR "closed") "opened")
+        DOOR = (lock -> (unlock -> DOOR "unlocked") "locked")
+    )csp";
+
+    bool passed = true;
+    auto check = [&passed](bool ok, char const*const what)
+    {
+        std::cout << "checkpoint: " << what << (ok ? " ok" : " failed") << "\n";
+        passed = passed && ok;
+    };
+
+    // the second definition is waiting for unlock; the first, for open
+    CSP* csp = csp_parse(nullptr, src, strlen(src));
+    csp_emit(csp, "lock", 0);
+    csp_update(csp);
+    std::vector<uint8_t> state;
+    bool taken = csp_checkpoint(csp, state);
+
+    auto resumes = [](CSP* c)
+    {
+        std::string seen;
+        csp_bind_lambda(c, "opened", [&seen](int) { seen += "opened "; });
+        csp_bind_lambda(c, "unlocked", [&seen](int) { seen += "unlocked "; });
+        csp_emit(c, "open", 0);
+        csp_update(c);
+        csp_emit(c, "unlock", 0);
+        csp_update(c);
+        return seen == "opened unlocked ";
+    };
+
+    CSP* restored = csp_parse(nullptr, src, strlen(src));
+    bool ok = taken && csp_restore(restored, state.data(), state.size());
+    check(ok && resumes(restored), "restored each definition");
+
+    CSP* clone = csp_clone(csp);
+    check(clone && resumes(clone), "cloned each definition");
+
+    delete clone;
+    delete restored;
+    delete csp;
+    return passed;
+}
+
+// A guard lets its process accept an event or skips it, the same whether it's
+// evaluated for one payload or for a run of them, and a malformed guard is a
+// parse error.
+bool test_guards()
 {
-    CSP* csp = csp_parse(csp_src, strlen(csp_src));
+    bool passed = true;
+    auto check = [&passed](bool ok, char const*const what)
+    {
+        std::cout << "guards: " << what << (ok ? " ok" : " failed") << "\n";
+        passed = passed && ok;
+    };
+
+    char const*const src = R"csp(
+        THIRD = (tick [id == 3] -> THIRD "third")
+        OTHER = (tick [id != 3] -> OTHER "other")
+        MIXED = (mixed [id % 3 == 0 && id > 10 || -id > 50] -> MIXED "mixed")
+    )csp";
+    CSP* csp = csp_parse(nullptr, src, strlen(src));
+    std::vector<int> third, other, mixed;
+    csp_bind_lambda(csp, "third", [&third](int id) { third.push_back(id); });
+    csp_bind_lambda(csp, "other", [&other](int id) { other.push_back(id); });
+    csp_bind_lambda(csp, "mixed", [&mixed](int id) { mixed.push_back(id); });
+
+    csp_emit(csp, "tick", 3);
+    csp_emit(csp, "tick", 4);
+    csp_update(csp);
+    check(third == std::vector<int>{3} && other == std::vector<int>{4}, "pass and skip");
+
+    // a run of events is guarded in one batch; each must agree with the guard
+    // evaluated for its payload alone
+    std::vector<int> ids;
+    for (int i = 0; i < 200; ++i)
+        ids.push_back((i * 7919) % 199 - 99 + (i % 5 == 0 ? 1000 : 0));
+    for (int id : ids)
+        csp_emit(csp, "mixed", id);
+    csp_update(csp);
+    char const*const mixed_guard = "id % 3 == 0 && id > 10 || -id > 50";
+    CSP_Guard guard;
+    std::vector<int> expected;
+    if (csp_guard_compile(mixed_guard, strlen(mixed_guard), guard))
+        for (int id : ids)
+            if (csp_guard_eval(guard, id))
+                expected.push_back(id);
+    check(expected.size() > 0 && expected.size() < ids.size() && mixed == expected, "batch agrees with single over a run");
+
+    // and so must csp_guard_eval_batch over every operator
+    char const*const exprs[] = {
+        "!(id / 2 - 4)",
+        "(id + 1) * 2 >= 7 || id == -5",
+        "id <= 0 && !(id % 4) || id / 0 == 0 && id < -90",
+        "-(-id) - id * 3 % 7 < 5",
+    };
+    bool agree = true;
+    std::vector<uint8_t> pass(ids.size());
+    for (char const*const expr : exprs)
+    {
+        bool compiled = csp_guard_compile(expr, strlen(expr), guard);
+        csp_guard_eval_batch(guard, ids.data(), ids.size(), pass.data());
+        agree = agree && compiled;
+        for (size_t i = 0; i < ids.size(); ++i)
+            agree = agree && (pass[i] != 0) == csp_guard_eval(guard, ids[i]);
+    }
+    check(agree, "batch agrees with single for every operator");
+
+    // = and <> aren't operators
+    std::vector<std::unique_ptr<CSP_Process>> processes;
+    char const*const assign = "P = (tick [id = 3] -> P)";
+    char const*const not_equal = "P = (tick [id <> 3] -> P)";
+    char const*const equal = "P = (tick [id == 3] -> P)";
+    bool assign_ok = csp_parse_processes(processes, assign, strlen(assign));
+    processes.clear();
+    bool not_equal_ok = csp_parse_processes(processes, not_equal, strlen(not_equal));
+    processes.clear();
+    bool equal_ok = csp_parse_processes(processes, equal, strlen(equal));
+    check(!assign_ok && !not_equal_ok && equal_ok, "= and <> are parse errors");
+
+    delete csp;
+    return passed;
+}
+
+#if defined(__linux__)
+// Producers on several threads, each connected to the segment as another
+// process would be, lease payloads and emit events; the handler reads each
+// payload in place and releases it, and every slot comes back to the pool.
+bool test_shm()
+{
+    char const*const src = R"csp(
+        VALUES = (shm_value -> VALUES "shm_value")
+    )csp";
+    CSP* csp = csp_parse(nullptr, src, strlen(src));
+
+    bool passed = true;
+    auto check = [&passed](bool ok, char const*const what)
+    {
+        std::cout << "shm: " << what << (ok ? " ok" : " failed") << "\n";
+        passed = passed && ok;
+    };
+
+    std::string name = "gusteau_odr_" + std::to_string(getpid());
+    CSP_ShmConfig config;
+    config.capacity = 256;
+    config.payload_slots = 32;
+    config.payload_size = 64;
+    CSP_ShmBridge* bridge = csp_shm_bridge_open(csp, name.c_str(), config);
+    check(bridge != nullptr, "open");
+    if (!bridge)
+    {
+        delete csp;
+        return false;
+    }
+
+    const int threads = 4;
+    const int per_thread = 500;
+    struct Value { int thread; int seq; };
+    std::vector<int> next(threads, 0);
+    int received = 0;
+    bool in_order = true;
+    csp_bind_lambda(csp, "shm_value", [&](int handle)
+    {
+        const Value* v = static_cast<const Value*>(csp_shm_payload(bridge, handle));
+        if (v && v->thread >= 0 && v->thread < threads && v->seq == next[v->thread])
+            ++next[v->thread];
+        else
+            in_order = false;
+        ++received;
+        csp_shm_release(bridge, handle);
+    });
+
+    std::atomic<int> connected{0};
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; ++t)
+        producers.emplace_back([&, t]()
+        {
+            CSP_ShmProducer* producer = csp_shm_connect(name.c_str());
+            if (!producer)
+                return;
+            ++connected;
+            for (int i = 0; i < per_thread; ++i)
+            {
+                // the pool and the ring are small, so wait for the handler
+                int handle;
+                void* p;
+                while (!(p = csp_shm_lease(producer, sizeof(Value), handle)))
+                    std::this_thread::yield();
+                *static_cast<Value*>(p) = Value{ t, i };
+                while (!csp_shm_emit(producer, "shm_value", handle))
+                    std::this_thread::yield();
+            }
+            csp_shm_disconnect(producer);
+        });
+
+    const int total = threads * per_thread;
+    auto start = std::chrono::steady_clock::now();
+    while (received < total && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+    {
+        csp_update(csp);
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    for (auto& t : producers)
+        t.join();
+    check(connected == threads, "connect");
+    check(received == total && in_order, "payloads read in order from each producer");
+
+    // every slot was released, so the whole pool can be leased again
+    CSP_ShmProducer* producer = csp_shm_connect(name.c_str());
+    int leased = 0;
+    int handle;
+    while (producer && leased <= int(config.payload_slots) && csp_shm_lease(producer, sizeof(Value), handle))
+        ++leased;
+    check(leased == int(config.payload_slots), "slots returned to the pool");
+    csp_shm_disconnect(producer);
+
+    csp_shm_bridge_close(bridge);
+    producer = csp_shm_connect(name.c_str());
+    check(!producer, "segment removed on close");
+    csp_shm_disconnect(producer);
+
+    delete csp;
+    return passed;
+}
+#endif
+
+// Events per second through each queue implementation, with the producers and
+// the consumer on their own threads.
+void benchmark_queue(CSP_QueueKind kind, char const*const name, int producers)
+{
+    const int events_per_producer = 2000000;
+    std::unique_ptr<CSP_Queue<CSP_Event>> q(csp_queue_create<CSP_Event>(kind, 4096));
+    std::atomic<int> ready{0};
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p)
+        threads.emplace_back([&q, &ready, p]()
+        {
+            CSP_Event event;
+            strcpy(event.name, "tick");
+            ++ready;
+            for (int i = 0; i < events_per_producer; ++i)
+            {
+                event.id = i;
+                q->enqueue(event);
+            }
+        });
+
+    const size_t total = size_t(events_per_producer) * producers;
+    size_t received = 0;
+    CSP_Event event;
+    while (received < total)
+    {
+        if (q->try_dequeue(event))
+            ++received;
+        else
+            std::this_thread::yield();
+    }
+
+    for (auto& t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%s, %d producer%s: %6.1f M events/s\n", name, producers, producers > 1 ? "s" : " ", total / seconds * 1e-6);
+}
+
+void benchmark_queues()
+{
+    benchmark_queue(CSP_QueueKind::MPMC, "MPMC (moodycamel)", 1);
+    benchmark_queue(CSP_QueueKind::MPSC, "MPSC (linked batch)", 1);
+    benchmark_queue(CSP_QueueKind::SPSC, "SPSC (ring)", 1);
+    for (int producers : {2, 4})
+    {
+        benchmark_queue(CSP_QueueKind::MPMC, "MPMC (moodycamel)", producers);
+        benchmark_queue(CSP_QueueKind::MPSC, "MPSC (linked batch)", producers);
+    }
+}
+
+// Replays a recorded event log into a CSP parsed from a file, without any
+// lambdas bound, and reports the rate.
+//     csp_odr replay <events> <csp source> [speed]
+int replay(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " replay <events> <csp source> [speed, 0 for as fast as possible]\n";
+        return 1;
+    }
+
+    CSP_Recording recording;
+    if (!csp_record_read(argv[2], recording))
+        std::cerr << "the event log " << argv[2] << " is damaged; replaying what could be read\n";
+
+    FILE* f = fopen(argv[3], "rb");
+    if (!f)
+    {
+        std::cerr << "could not read " << argv[3] << "\n";
+        return 1;
+    }
+    std::string src;
+    char buff[4096];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), f)) > 0)
+        src.append(buff, n);
+    fclose(f);
+
+    CSP* csp = csp_parse(nullptr, src.data(), src.size());
+    CSP_ReplayStats stats;
+    csp_replay(csp, recording, argc > 4 ? atof(argv[4]) : 1.0, &stats);
+    printf("replayed %zu events, recorded over %.3fs, in %.3fs: %.1f k events/s\n", stats.events,
+           stats.recorded_seconds, stats.seconds, stats.seconds > 0 ? stats.events / stats.seconds * 1e-3 : 0.0);
+    delete csp;
+    return 0;
+}
+
+int main(int argc, char** argv) try
+{
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+    {
+        benchmark_queues();
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "replay"))
+        return replay(argc, argv);
+
+    CSP* csp = csp_parse(nullptr, csp_src, strlen(csp_src));
     std::cout << "Parsed " << csp->processes.size() << " processes\n";
     for (auto& i : csp->processes)
     {
-        std::cout << i->name << " = (" << i->event << " -> " << i->behavior;
+        std::cout << i->name << " = (" << i->event;
+        if (i->guard)
+            std::cout << " [" << i->guard.src << "]";
+        std::cout << " -> " << i->behavior;
         if (i->out.length())
             std::cout << " \"" << i->out << "\"";
         std::cout << ")\n";
     }
-    csp_bind_lambda(csp, "ticked", [](){printf("tick\n");});
-    csp_bind_lambda(csp, "clock2_tocked", [](){printf("tock\n");});
-    csp_emit(csp, "tick");
-    csp_emit(csp, "foo");
-    csp_emit(csp, "tock");
-    csp_emit(csp, "tick");
-    csp_emit(csp, "tock");
+    csp_bind_lambda(csp, "ticked", [](int){ LOG_INFO("tick"); });
+    csp_bind_lambda(csp, "clock2_tocked", [](int){ LOG_INFO("tock"); });
+    csp_emit(csp, "tick", 0);
+    csp_emit(csp, "foo", 0);
+    csp_emit(csp, "tock", 0);
+    csp_emit(csp, "tick", 0);
+    csp_emit(csp, "tock", 0);
     csp_update(csp);
-    return 0;
+    delete csp;
+    log_flush();
+
+    bool passed = test_hot_path_allocations();
+    if (!passed)
+        std::cerr << "The hot path allocated after warm up\n";
+    passed = test_calc_program_scalars() && passed;
+    passed = test_calls() && passed;
+    passed = test_checkpoint_repeated_definitions() && passed;
+    passed = test_guards() && passed;
+    passed = test_sink() && passed;
+#if defined(__linux__)
+    passed = test_shm() && passed;
+#endif
+    return passed ? 0 : 1;
 }
 catch(std::exception& exc)
 {
     std::cerr << "Exception caught: " << exc.what();
+    return 1;
 }
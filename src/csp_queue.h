@@ -0,0 +1,565 @@
+#pragma once
+
+#include "ConcurrentQueue.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+// The event queue's memory comes from a block pool. The pool can be given an
+// arena up front, optionally backed by huge pages, and touched in advance so
+// that growing the queue during a burst neither calls the system allocator nor
+// takes a page fault. Without an arena, or once it's exhausted, the pool falls
+// back to malloc and counts how often it had to.
+
+struct CSP_QueuePoolConfig
+{
+    size_t arena_bytes = 0;
+    bool huge_pages = false;
+    bool prefault = true;
+};
+
+struct CSP_QueuePoolStats
+{
+    size_t arena_bytes = 0;
+    size_t arena_used = 0;
+    size_t system_allocations = 0;
+    bool huge_pages = false;
+};
+
+struct CSP_QueuePool
+{
+    // The queue requests only a handful of distinct sizes, mostly blocks, so
+    // each size, rounded up to a multiple of 64 bytes, gets its own free list.
+    static constexpr int max_size_classes = 32;
+    static constexpr size_t granularity = 64;
+    static constexpr size_t header_size = alignof(std::max_align_t) > 16 ? alignof(std::max_align_t) : 16;
+
+    struct Node { Node* next; };
+    struct SizeClass
+    {
+        size_t bytes;
+        Node* free;
+    };
+
+    std::mutex mutex;
+    char* arena = nullptr;
+    size_t arena_bytes = 0;
+    size_t arena_used = 0;
+    bool huge_pages = false;
+    size_t system_allocations = 0;
+    SizeClass size_classes[max_size_classes] = {};
+    int size_class_count = 0;
+};
+
+CSP_QueuePool& csp_queue_pool()
+{
+    // deliberately leaked, queues may be destroyed during static destruction
+    static CSP_QueuePool* pool = new CSP_QueuePool();
+    return *pool;
+}
+
+char* csp_queue_pool_map(size_t& bytes, bool want_huge_pages, bool prefault, bool& huge_pages)
+{
+    huge_pages = false;
+#if defined(_WIN32)
+    if (want_huge_pages)
+    {
+        SIZE_T large = GetLargePageMinimum();
+        if (large)
+        {
+            size_t rounded = (bytes + large - 1) & ~(large - 1);
+            // large pages are committed, and so resident, when they are allocated
+            void* p = VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if (p)
+            {
+                bytes = rounded;
+                huge_pages = true;
+                return static_cast<char*>(p);
+            }
+        }
+    }
+    void* p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(__unix__) || defined(__APPLE__)
+    const size_t huge_page = size_t(2) << 20;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    if (prefault)
+        flags |= MAP_POPULATE;
+#endif
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (want_huge_pages)
+    {
+        // explicit huge pages only exist if the system has reserved some
+        size_t rounded = (bytes + huge_page - 1) & ~(huge_page - 1);
+        p = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED)
+        {
+            bytes = rounded;
+            huge_pages = true;
+        }
+    }
+#endif
+    if (p == MAP_FAILED)
+    {
+        if (want_huge_pages)
+            bytes = (bytes + huge_page - 1) & ~(huge_page - 1);
+        p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+#ifdef MADV_HUGEPAGE
+        // otherwise ask for transparent huge pages
+        if (p != MAP_FAILED && want_huge_pages)
+            huge_pages = madvise(p, bytes, MADV_HUGEPAGE) == 0;
+#endif
+    }
+    if (p == MAP_FAILED)
+        p = nullptr;
+#else
+    void* p = malloc(bytes);
+#endif
+
+    if (p && prefault)
+    {
+        // touch every page, so that no page faults occur later
+        volatile char* c = static_cast<char*>(p);
+        for (size_t i = 0; i < bytes; i += 4096)
+            c[i] = 0;
+    }
+    return static_cast<char*>(p);
+}
+
+// Provides the pool with an arena. Must be called before any CSP is created in
+// order to have effect on all queues; returns false if the pool already has an
+// arena, or the memory could not be obtained.
+bool csp_queue_pool_init(const CSP_QueuePoolConfig& config)
+{
+    CSP_QueuePool& pool = csp_queue_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (pool.arena || !config.arena_bytes)
+        return false;
+
+    size_t bytes = config.arena_bytes;
+    char* arena = csp_queue_pool_map(bytes, config.huge_pages, config.prefault, pool.huge_pages);
+    if (!arena)
+        return false;
+
+    pool.arena = arena;
+    pool.arena_bytes = bytes;
+    pool.arena_used = 0;
+    return true;
+}
+
+CSP_QueuePoolStats csp_queue_pool_stats()
+{
+    CSP_QueuePool& pool = csp_queue_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    CSP_QueuePoolStats stats;
+    stats.arena_bytes = pool.arena_bytes;
+    stats.arena_used = pool.arena_used;
+    stats.system_allocations = pool.system_allocations;
+    stats.huge_pages = pool.huge_pages;
+    return stats;
+}
+
+// Each allocation is preceded by a header recording its size class, or -1 if it
+// came from the system allocator.
+void* csp_queue_pool_allocate(size_t size)
+{
+    CSP_QueuePool& pool = csp_queue_pool();
+    size_t total = size + CSP_QueuePool::header_size;
+    size_t class_bytes = (total + CSP_QueuePool::granularity - 1) & ~(CSP_QueuePool::granularity - 1);
+
+    char* p = nullptr;
+    int size_class = 0;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        while (size_class < pool.size_class_count && pool.size_classes[size_class].bytes != class_bytes)
+            ++size_class;
+        if (size_class == pool.size_class_count && size_class < CSP_QueuePool::max_size_classes)
+            pool.size_classes[pool.size_class_count++] = { class_bytes, nullptr };
+
+        if (size_class < pool.size_class_count)
+        {
+            CSP_QueuePool::SizeClass& sc = pool.size_classes[size_class];
+            if (sc.free)
+            {
+                p = reinterpret_cast<char*>(sc.free);
+                sc.free = sc.free->next;
+            }
+            else if (pool.arena && pool.arena_used + class_bytes <= pool.arena_bytes)
+            {
+                p = pool.arena + pool.arena_used;
+                pool.arena_used += class_bytes;
+            }
+        }
+        if (!p)
+            ++pool.system_allocations;
+    }
+
+    if (!p)
+    {
+        p = static_cast<char*>(malloc(total));
+        if (!p)
+            return nullptr;
+        size_class = -1;
+    }
+    memcpy(p, &size_class, sizeof(int));
+    return p + CSP_QueuePool::header_size;
+}
+
+void csp_queue_pool_free(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    char* p = static_cast<char*>(ptr) - CSP_QueuePool::header_size;
+    int size_class;
+    memcpy(&size_class, p, sizeof(int));
+    if (size_class < 0)
+    {
+        free(p);
+        return;
+    }
+
+    CSP_QueuePool& pool = csp_queue_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    CSP_QueuePool::Node* n = reinterpret_cast<CSP_QueuePool::Node*>(p);
+    n->next = pool.size_classes[size_class].free;
+    pool.size_classes[size_class].free = n;
+}
+
+// The number of events per block of the queue can be tuned at compile time;
+// it must be a power of two.
+#ifndef CSP_QUEUE_BLOCK_SIZE
+#define CSP_QUEUE_BLOCK_SIZE 32
+#endif
+
+struct CSP_QueueTraits : public moodycamel::ConcurrentQueueDefaultTraits
+{
+    static const size_t BLOCK_SIZE = CSP_QUEUE_BLOCK_SIZE;
+
+    static inline void* malloc(size_t size) { return csp_queue_pool_allocate(size); }
+    static inline void free(void* ptr) { csp_queue_pool_free(ptr); }
+};
+
+// A CSP can be created with one of several queue implementations, to suit the
+// threads that will be emitting events. Every queue has a single consumer,
+// csp_update, but the general purpose MPMC queue doesn't rely on that.
+//
+//  MPMC - any number of producers; the moodycamel ConcurrentQueue
+//  MPSC - any number of producers; a linked list that the consumer takes a
+//         whole batch at a time
+//  SPSC - exactly one producer thread; a fixed size ring. A producer finding
+//         the ring full waits for the consumer to make room.
+enum class CSP_QueueKind { MPMC, MPSC, SPSC };
+
+template <typename T>
+class CSP_Queue
+{
+public:
+    virtual ~CSP_Queue() = default;
+    virtual void enqueue(const T& value) = 0;
+    virtual bool try_dequeue(T& value) = 0;
+    virtual size_t size_approx() const = 0;
+
+    virtual void enqueue_bulk(const T* values, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            enqueue(values[i]);
+    }
+};
+
+template <typename T>
+class CSP_MPMCQueue : public CSP_Queue<T>
+{
+public:
+    explicit CSP_MPMCQueue(size_t capacity) : q(capacity) {}
+    virtual void enqueue(const T& value) override { q.enqueue(value); }
+    virtual bool try_dequeue(T& value) override { return q.try_dequeue(value); }
+    virtual size_t size_approx() const override { return q.size_approx(); }
+    virtual void enqueue_bulk(const T* values, size_t count) override { q.enqueue_bulk(values, count); }
+
+    moodycamel::ConcurrentQueue<T, CSP_QueueTraits> q;
+};
+
+template <typename T>
+class CSP_SPSCQueue : public CSP_Queue<T>
+{
+public:
+    explicit CSP_SPSCQueue(size_t capacity)
+    {
+        size_t sz = 2;
+        while (sz < capacity)
+            sz *= 2;
+        _mask = sz - 1;
+        _slots = static_cast<T*>(csp_queue_pool_allocate(sizeof(T) * sz));
+        for (size_t i = 0; i < sz; ++i)
+            new (&_slots[i]) T();
+    }
+
+    virtual ~CSP_SPSCQueue()
+    {
+        for (size_t i = 0; i <= _mask; ++i)
+            _slots[i].~T();
+        csp_queue_pool_free(_slots);
+    }
+
+    virtual void enqueue(const T& value) override
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        while (tail - _head_cache > _mask)
+        {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail - _head_cache > _mask)
+                std::this_thread::yield();
+        }
+        _slots[tail & _mask] = value;
+        _tail.store(tail + 1, std::memory_order_release);
+    }
+
+    // Returns false, rather than waiting for room, if the ring is full.
+    bool try_enqueue(const T& value)
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head_cache > _mask)
+        {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail - _head_cache > _mask)
+                return false;
+        }
+        _slots[tail & _mask] = value;
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    virtual bool try_dequeue(T& value) override
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail_cache)
+        {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head == _tail_cache)
+                return false;
+        }
+        value = _slots[head & _mask];
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    virtual size_t size_approx() const override
+    {
+        return _tail.load(std::memory_order_relaxed) - _head.load(std::memory_order_relaxed);
+    }
+
+private:
+    T* _slots = nullptr;
+    size_t _mask = 0;
+
+    // the producer and consumer indices are kept on separate cache lines, each
+    // with a cached copy of the other side's index
+    alignas(64) std::atomic<size_t> _tail{0};
+    size_t _head_cache = 0;
+    alignas(64) std::atomic<size_t> _head{0};
+    size_t _tail_cache = 0;
+};
+
+template <typename T>
+class CSP_MPSCQueue : public CSP_Queue<T>
+{
+    struct Node
+    {
+        Node* next;
+        T value;
+    };
+
+public:
+    explicit CSP_MPSCQueue(size_t) {}
+
+    virtual ~CSP_MPSCQueue()
+    {
+        T discard;
+        while (try_dequeue(discard)) {}
+        release_free_nodes();
+    }
+
+    // A producer pushes onto the head of a list with a single compare and swap.
+    virtual void enqueue(const T& value) override
+    {
+        Node* n = allocate_node();
+        n->value = value;
+        Node* head = _head.load(std::memory_order_relaxed);
+        do
+        {
+            n->next = head;
+        } while (!_head.compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+        _enqueued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The consumer detaches everything that has been pushed with one exchange,
+    // and reverses it into arrival order. No further atomics are needed until
+    // that batch has been consumed.
+    virtual bool try_dequeue(T& value) override
+    {
+        if (!_batch)
+        {
+            Node* list = _head.exchange(nullptr, std::memory_order_acquire);
+            if (!list)
+            {
+                release_free_nodes();
+                return false;
+            }
+            while (list)
+            {
+                Node* next = list->next;
+                list->next = _batch;
+                _batch = list;
+                list = next;
+            }
+        }
+
+        Node* n = _batch;
+        _batch = n->next;
+        value = n->value;
+        _dequeued.store(_dequeued.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        n->next = _free;
+        _free = n;
+        if (++_free_count >= 256)
+            release_free_nodes();
+        return true;
+    }
+
+    virtual size_t size_approx() const override
+    {
+        // dequeued first, so that another thread never sees more dequeued
+        size_t dequeued = _dequeued.load(std::memory_order_relaxed);
+        size_t enqueued = _enqueued.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+private:
+    // Nodes are recycled through a free list shared by all queues of the same
+    // event type. A producer takes a batch of nodes from it at a time into a
+    // thread local cache, and gives back what's left of the cache when the
+    // thread exits. The list is only touched once a batch, so a mutex guards it.
+    static constexpr size_t node_batch = 64;
+
+    struct FreeNodes
+    {
+        std::mutex mutex;
+        Node* head = nullptr;
+    };
+
+    static FreeNodes& free_nodes()
+    {
+        static FreeNodes nodes;
+        return nodes;
+    }
+
+    // pushes the list of nodes starting at first onto the shared free list
+    static void push_free_nodes(Node* first)
+    {
+        if (!first)
+            return;
+
+        Node* last = first;
+        while (last->next)
+            last = last->next;
+
+        FreeNodes& nodes = free_nodes();
+        std::lock_guard<std::mutex> lock(nodes.mutex);
+        last->next = nodes.head;
+        nodes.head = first;
+    }
+
+    struct NodeCache
+    {
+        Node* nodes = nullptr;
+        ~NodeCache() { push_free_nodes(nodes); }
+    };
+
+    static Node* allocate_node()
+    {
+        free_nodes();   // so that it outlives the cache
+        thread_local NodeCache cache;
+        if (!cache.nodes)
+        {
+            FreeNodes& nodes = free_nodes();
+            std::lock_guard<std::mutex> lock(nodes.mutex);
+            if (nodes.head)
+            {
+                Node* last = nodes.head;
+                for (size_t i = 1; i < node_batch && last->next; ++i)
+                    last = last->next;
+                cache.nodes = nodes.head;
+                nodes.head = last->next;
+                last->next = nullptr;
+            }
+        }
+        if (!cache.nodes)
+        {
+            Node* nodes = static_cast<Node*>(csp_queue_pool_allocate(sizeof(Node) * node_batch));
+            for (size_t i = 0; i < node_batch; ++i)
+            {
+                new (&nodes[i]) Node();
+                nodes[i].next = i + 1 < node_batch ? &nodes[i + 1] : nullptr;
+            }
+            cache.nodes = nodes;
+        }
+        Node* n = cache.nodes;
+        cache.nodes = n->next;
+        return n;
+    }
+
+    void release_free_nodes()
+    {
+        push_free_nodes(_free);
+        _free = nullptr;
+        _free_count = 0;
+    }
+
+    alignas(64) std::atomic<Node*> _head{nullptr};
+    std::atomic<size_t> _enqueued{0};
+
+    // consumer only
+    alignas(64) Node* _batch = nullptr;
+    Node* _free = nullptr;
+    size_t _free_count = 0;
+    std::atomic<size_t> _dequeued{0};   // read by size_approx, on any thread
+};
+
+template <typename T>
+CSP_Queue<T>* csp_queue_create(CSP_QueueKind kind, size_t capacity)
+{
+    switch (kind)
+    {
+    case CSP_QueueKind::SPSC: return new CSP_SPSCQueue<T>(capacity);
+    case CSP_QueueKind::MPSC: return new CSP_MPSCQueue<T>(capacity);
+    default: return new CSP_MPMCQueue<T>(capacity);
+    }
+}
+
+// Settings for a new CSP. The initial capacity is the number of events the
+// queue can hold before it first needs to grow; for an SPSC queue, it's the
+// fixed size of the ring. Events that handlers emit may cascade, each one
+// emitting more, up to max_cascade_depth; deeper events are dropped, as they
+// are most likely a loop.
+struct CSP_Config
+{
+    CSP_QueueKind queue = CSP_QueueKind::MPMC;
+    size_t initial_capacity = 6 * CSP_QUEUE_BLOCK_SIZE;
+    int max_cascade_depth = 16;
+};
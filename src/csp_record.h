@@ -0,0 +1,301 @@
+#pragma once
+
+#include "clock.h"
+#include "csp.h"
+#include "log.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Records the events emitted to a CSP, with their payloads, the emitting thread
+// and the time of the emit, to a compact binary log; and replays such a log into
+// a CSP, at the speed it was recorded, faster, or as fast as possible.
+//
+// Recording taps csp_emit; see CSP_EmitTap. The emitting thread only copies the
+// event into a queue, and a writer thread does the writing. Payloads are
+// recorded as the ids they are, so a replay reproduces events whose payload is
+// a value, such as an index, but not the contents of a blackboard.
+//
+// Layout, in native byte order:
+//     header
+//     records, each a CSP_RecordTag followed by
+//         name       uint16 index, uint8 length, the name's bytes
+//         event      int64 time, uint32 thread, int32 id, uint16 name index
+// A name is written the first time it is emitted, and numbered in order, and
+// events refer to it by its number.
+
+static constexpr char csp_record_magic[8] = { 'G', 'C', 'S', 'P', 'E', 'V', 'T', 0 };
+static constexpr uint32_t csp_record_version = 1;
+
+struct CSP_RecordHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t name_max;
+};
+
+enum CSP_RecordTag : uint8_t { CSP_RecordName = 1, CSP_RecordEventTag = 2 };
+
+// The fields of an event are written one after another, without padding.
+static constexpr size_t csp_record_event_size = 8 + 4 + 4 + 2;
+
+struct CSP_RecordEvent
+{
+    int64_t time_ns;        // of the virtual clock, at the emit
+    uint32_t thread;
+    int32_t id;
+    uint16_t name;
+};
+
+// An event, as queued for the writer.
+struct CSP_RecordedEvent
+{
+    int64_t time_ns;
+    uint32_t thread;
+    int32_t id;
+    char name[CSP_EVENT_NAME_MAX];
+};
+
+// Threads are numbered in the order they first emit while recording.
+uint32_t csp_record_thread()
+{
+    static std::atomic<uint32_t> next{1};
+    thread_local uint32_t thread = next++;
+    return thread;
+}
+
+struct CSP_Recorder : public CSP_EmitTap
+{
+    CSP_Recorder() : q(csp_queue_create<CSP_RecordedEvent>(CSP_QueueKind::MPMC, 4 * CSP_QUEUE_BLOCK_SIZE)) {}
+
+    void emitted(const CSP_Event& event) override
+    {
+        CSP_RecordedEvent r;
+        r.time_ns = vclock_now_ns();
+        r.thread = csp_record_thread();
+        r.id = event.id;
+        memcpy(r.name, event.name, strlen(event.name) + 1);
+        q->enqueue(r);
+    }
+
+    CSP* csp = nullptr;
+    FILE* f = nullptr;
+    std::unique_ptr<CSP_Queue<CSP_RecordedEvent>> q;
+    std::thread writer;
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> recorded{0};
+    bool ok = true;     // false once a write has failed
+};
+
+// Writes what has been queued, in time order; the queue only orders the events
+// of each thread. Called only by the writer.
+void csp_record_write(CSP_Recorder* r, std::vector<CSP_RecordedEvent>& batch,
+                      std::unordered_map<std::string, uint16_t>& names)
+{
+    batch.clear();
+    CSP_RecordedEvent e;
+    while (r->q->try_dequeue(e))
+        batch.push_back(e);
+    if (batch.empty())
+        return;
+
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const CSP_RecordedEvent& a, const CSP_RecordedEvent& b) { return a.time_ns < b.time_ns; });
+    for (auto& e : batch)
+    {
+        auto it = names.find(e.name);
+        if (it == names.end())
+        {
+            if (names.size() > UINT16_MAX)
+                continue;
+            uint16_t index = static_cast<uint16_t>(names.size());
+            uint8_t len = static_cast<uint8_t>(strlen(e.name));
+            uint8_t tag = CSP_RecordName;
+            r->ok = r->ok && fwrite(&tag, 1, 1, r->f) == 1 && fwrite(&index, sizeof(index), 1, r->f) == 1 &&
+                    fwrite(&len, 1, 1, r->f) == 1 && fwrite(e.name, 1, len, r->f) == len;
+            it = names.emplace(e.name, index).first;
+        }
+
+        char buff[1 + csp_record_event_size];
+        buff[0] = CSP_RecordEventTag;
+        memcpy(buff + 1, &e.time_ns, 8);
+        memcpy(buff + 9, &e.thread, 4);
+        memcpy(buff + 13, &e.id, 4);
+        memcpy(buff + 17, &it->second, 2);
+        r->ok = r->ok && fwrite(buff, sizeof(buff), 1, r->f) == 1;
+    }
+    r->recorded.fetch_add(batch.size(), std::memory_order_relaxed);
+}
+
+// Starts recording the events emitted to csp into a file at path. Returns
+// nullptr if the file can't be created, or csp already has a tap.
+CSP_Recorder* csp_record_start(CSP* csp, char const*const path)
+{
+    if (!csp || !path || csp->emit_tap.load())
+        return nullptr;
+
+    FILE* f = fopen(path, "wb");
+    if (!f)
+        return nullptr;
+
+    CSP_RecordHeader header = {};
+    memcpy(header.magic, csp_record_magic, sizeof(header.magic));
+    header.version = csp_record_version;
+    header.name_max = CSP_EVENT_NAME_MAX;
+    if (fwrite(&header, sizeof(header), 1, f) != 1)
+    {
+        fclose(f);
+        return nullptr;
+    }
+
+    CSP_Recorder* r = new CSP_Recorder();
+    r->csp = csp;
+    r->f = f;
+    r->running = true;
+    r->writer = std::thread([r]()
+    {
+        std::vector<CSP_RecordedEvent> batch;
+        std::unordered_map<std::string, uint16_t> names;
+        while (r->running.load(std::memory_order_acquire))
+        {
+            csp_record_write(r, batch, names);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        csp_record_write(r, batch, names);
+    });
+    csp_set_emit_tap(csp, r);
+    return r;
+}
+
+// Stops recording, writes what remains, and closes the file. Returns false if
+// any of the log could not be written.
+bool csp_record_stop(CSP_Recorder* r)
+{
+    if (!r)
+        return false;
+
+    csp_set_emit_tap(r->csp, nullptr);
+    r->running = false;
+    if (r->writer.joinable())
+        r->writer.join();
+    bool ok = fclose(r->f) == 0 && r->ok;
+    LOG_INFO("csp: recorded %llu events", static_cast<unsigned long long>(r->recorded.load()));
+    delete r;
+    return ok;
+}
+
+struct CSP_Recording
+{
+    std::vector<std::string> names;
+    std::vector<CSP_RecordEvent> events;
+};
+
+bool csp_record_read(char const*const path, CSP_Recording& recording)
+{
+    FILE* f = path ? fopen(path, "rb") : nullptr;
+    if (!f)
+        return false;
+
+    CSP_RecordHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              !memcmp(header.magic, csp_record_magic, sizeof(header.magic)) &&
+              header.version == csp_record_version;
+
+    uint8_t tag;
+    while (ok && fread(&tag, 1, 1, f) == 1)
+    {
+        if (tag == CSP_RecordName)
+        {
+            uint16_t index;
+            uint8_t len;
+            char name[256];
+            ok = fread(&index, sizeof(index), 1, f) == 1 && fread(&len, 1, 1, f) == 1 &&
+                 fread(name, 1, len, f) == len && index == recording.names.size();
+            if (ok)
+                recording.names.emplace_back(name, len);
+        }
+        else if (tag == CSP_RecordEventTag)
+        {
+            char buff[csp_record_event_size];
+            CSP_RecordEvent e;
+            ok = fread(buff, sizeof(buff), 1, f) == 1;
+            memcpy(&e.time_ns, buff, 8);
+            memcpy(&e.thread, buff + 8, 4);
+            memcpy(&e.id, buff + 12, 4);
+            memcpy(&e.name, buff + 16, 2);
+            ok = ok && e.name < recording.names.size();
+            if (ok)
+                recording.events.push_back(e);
+        }
+        else
+            ok = false;
+    }
+    fclose(f);
+    return ok;
+}
+
+struct CSP_ReplayStats
+{
+    size_t events = 0;
+    double seconds = 0;     // taken by the replay
+    double recorded_seconds = 0;
+};
+
+// Replays a recording into csp, updating it as it goes, on the calling thread.
+// At a speed of 1, events are emitted as far apart as they were recorded; at 10,
+// ten times closer together; and at 0, as fast as the CSP can take them. On
+// simulated time, the virtual clock is advanced to each event instead of waiting.
+bool csp_replay(CSP* csp, const CSP_Recording& recording, double speed, CSP_ReplayStats* stats = nullptr)
+{
+    if (!csp)
+        return false;
+
+    auto start = std::chrono::steady_clock::now();
+    const std::vector<CSP_RecordEvent>& events = recording.events;
+    int64_t first = events.size() ? events.front().time_ns : 0;
+    int64_t simulated_start = vclock_now_ns();
+    size_t since_update = 0;
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        const CSP_RecordEvent& e = events[i];
+        if (speed > 0)
+        {
+            int64_t offset = static_cast<int64_t>((e.time_ns - first) / speed);
+            if (vclock_simulated())
+                vclock_advance(simulated_start + offset - vclock_now_ns());
+            else
+            {
+                auto due = start + std::chrono::nanoseconds(offset);
+                if (due > std::chrono::steady_clock::now())
+                {
+                    csp_update(csp);
+                    since_update = 0;
+                    std::this_thread::sleep_until(due);
+                }
+            }
+        }
+
+        csp_emit(csp, recording.names[e.name].c_str(), e.id);
+        if (++since_update == 256)
+        {
+            csp_update(csp);
+            since_update = 0;
+        }
+    }
+    csp_update(csp);
+
+    if (stats)
+    {
+        stats->events = events.size();
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stats->recorded_seconds = events.size() ? (events.back().time_ns - first) * 1e-9 : 0;
+    }
+    return true;
+}
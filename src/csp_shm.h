@@ -0,0 +1,432 @@
+#pragma once
+
+#include "csp.h"
+#include "log.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A bridge that lets other processes on the same host emit events to a CSP.
+// The CSP's process creates a named shared memory segment, holding a ring of
+// events and a pool of payload slots, and a bridge thread that moves events
+// from the ring into the CSP, in bulk. Producers open the segment by name.
+//
+// The ring is a bounded multi producer queue, in which each cell carries a
+// sequence number that says whether it's free to write or ready to read, so
+// producers claim cells with a single compare and swap and never wait on each
+// other. When the ring is empty, the bridge sleeps on a futex in the segment,
+// which producers wake only if it's sleeping.
+//
+// A payload is written by the producer straight into a slot it has leased from
+// the pool, and the event's id becomes the slot's handle; the handler reads the
+// bytes where they lie with csp_shm_payload, and returns the slot with
+// csp_shm_release. A producer that dies holding a lease loses that slot.
+//
+// Linux only.
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the shared ring needs lock free 64 bit atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "the shared ring needs lock free 32 bit atomics");
+
+static constexpr char csp_shm_magic[8] = { 'G', 'C', 'S', 'P', 'S', 'H', 'M', 0 };
+static constexpr uint32_t csp_shm_version = 1;
+
+struct CSP_ShmConfig
+{
+    uint32_t capacity = 4096;           // events in the ring, rounded up to a power of two
+    uint32_t payload_slots = 256;
+    uint32_t payload_size = 4096;       // bytes per payload slot
+};
+
+struct CSP_ShmHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t payload_slots;             // a power of two
+    uint32_t payload_size;
+    uint64_t events_offset;
+    uint64_t free_offset;
+    uint64_t payloads_offset;
+    uint64_t size;
+
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    alignas(64) std::atomic<uint64_t> dequeue_pos;
+    alignas(64) std::atomic<uint64_t> free_enqueue_pos;
+    alignas(64) std::atomic<uint64_t> free_dequeue_pos;
+    alignas(64) std::atomic<uint32_t> signal;       // the futex word
+    std::atomic<uint32_t> sleeping;
+};
+
+struct CSP_ShmEventCell
+{
+    std::atomic<uint64_t> sequence;
+    char name[CSP_EVENT_NAME_MAX];
+    int32_t id;
+};
+
+// a free payload slot's index
+struct CSP_ShmIndexCell
+{
+    std::atomic<uint64_t> sequence;
+    uint32_t index;
+};
+
+// A bounded ring over cells in the segment; T is one of the cell types.
+template <typename T>
+struct CSP_ShmRing
+{
+    T* cells;
+    uint64_t mask;
+    std::atomic<uint64_t>* enqueue_pos;
+    std::atomic<uint64_t>* dequeue_pos;
+
+    // Claims a cell to write, or returns nullptr if the ring is full. The cell
+    // must be published once written.
+    T* claim(uint64_t& pos)
+    {
+        pos = enqueue_pos->load(std::memory_order_relaxed);
+        for (;;)
+        {
+            T* cell = &cells[pos & mask];
+            int64_t dif = static_cast<int64_t>(cell->sequence.load(std::memory_order_acquire) - pos);
+            if (dif == 0)
+            {
+                if (enqueue_pos->compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return cell;
+            }
+            else if (dif < 0)
+                return nullptr;
+            else
+                pos = enqueue_pos->load(std::memory_order_relaxed);
+        }
+    }
+
+    void publish(T* cell, uint64_t pos) { cell->sequence.store(pos + 1, std::memory_order_release); }
+
+    // Takes the oldest cell to read, or returns nullptr if there's none ready.
+    // The cell must be retired once read.
+    T* take(uint64_t& pos)
+    {
+        pos = dequeue_pos->load(std::memory_order_relaxed);
+        for (;;)
+        {
+            T* cell = &cells[pos & mask];
+            int64_t dif = static_cast<int64_t>(cell->sequence.load(std::memory_order_acquire) - (pos + 1));
+            if (dif == 0)
+            {
+                if (dequeue_pos->compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return cell;
+            }
+            else if (dif < 0)
+                return nullptr;
+            else
+                pos = dequeue_pos->load(std::memory_order_relaxed);
+        }
+    }
+
+    void retire(T* cell, uint64_t pos) { cell->sequence.store(pos + mask + 1, std::memory_order_release); }
+};
+
+// A mapping of the segment, as seen by either side.
+struct CSP_ShmMapping
+{
+    std::string name;
+    char* base = nullptr;
+    size_t size = 0;
+    CSP_ShmHeader* header = nullptr;
+    CSP_ShmRing<CSP_ShmEventCell> events;
+    CSP_ShmRing<CSP_ShmIndexCell> free;
+    char* payloads = nullptr;
+};
+
+uint32_t csp_shm_round_up(uint32_t n)
+{
+    uint32_t p = 2;
+    while (p < n)
+        p *= 2;
+    return p;
+}
+
+void csp_shm_bind(CSP_ShmMapping& m)
+{
+    CSP_ShmHeader* h = m.header = reinterpret_cast<CSP_ShmHeader*>(m.base);
+    m.events = { reinterpret_cast<CSP_ShmEventCell*>(m.base + h->events_offset), uint64_t(h->capacity) - 1,
+                 &h->enqueue_pos, &h->dequeue_pos };
+    m.free = { reinterpret_cast<CSP_ShmIndexCell*>(m.base + h->free_offset), uint64_t(h->payload_slots) - 1,
+               &h->free_enqueue_pos, &h->free_dequeue_pos };
+    m.payloads = m.base + h->payloads_offset;
+}
+
+long csp_shm_futex(std::atomic<uint32_t>* word, int op, uint32_t value, const timespec* timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, nullptr, 0);
+}
+
+// The consuming side.
+struct CSP_ShmBridge
+{
+    CSP* csp = nullptr;
+    CSP_ShmMapping m;
+    std::thread thread;
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> bridged{0};
+};
+
+// Moves what's in the ring into the CSP. Returns the number of events moved.
+size_t csp_shm_bridge_drain(CSP_ShmBridge* b, std::vector<CSP_Event>& batch)
+{
+    batch.clear();
+    uint64_t pos;
+    while (batch.size() < batch.capacity())
+    {
+        CSP_ShmEventCell* cell = b->m.events.take(pos);
+        if (!cell)
+            break;
+        CSP_Event e;
+        memcpy(e.name, cell->name, sizeof(e.name));
+        e.name[CSP_EVENT_NAME_MAX - 1] = '\0';
+        e.id = cell->id;
+        b->m.events.retire(cell, pos);
+        batch.push_back(e);
+    }
+    if (batch.size())
+    {
+        csp_emit_bulk(b->csp, batch.data(), batch.size());
+        b->bridged.fetch_add(batch.size(), std::memory_order_relaxed);
+    }
+    return batch.size();
+}
+
+void csp_shm_bridge_run(CSP_ShmBridge* b)
+{
+    CSP_ShmHeader* h = b->m.header;
+    std::vector<CSP_Event> batch;
+    batch.reserve(256);
+    while (b->running.load(std::memory_order_acquire))
+    {
+        if (csp_shm_bridge_drain(b, batch))
+            continue;
+
+        // announce the sleep, then look again, so that a producer that missed
+        // the announcement is seen before sleeping
+        uint32_t signal = h->signal.load(std::memory_order_acquire);
+        h->sleeping.store(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!csp_shm_bridge_drain(b, batch))
+        {
+            timespec timeout = { 0, 100 * 1000 * 1000 };
+            csp_shm_futex(&h->signal, FUTEX_WAIT, signal, &timeout);
+        }
+        h->sleeping.store(0, std::memory_order_relaxed);
+    }
+    csp_shm_bridge_drain(b, batch);
+}
+
+// Creates the segment /name, replacing any left by an earlier run, and starts
+// bridging it into csp. Returns nullptr if the segment can't be made.
+CSP_ShmBridge* csp_shm_bridge_open(CSP* csp, char const*const name, const CSP_ShmConfig& config = CSP_ShmConfig())
+{
+    if (!csp || !name)
+        return nullptr;
+
+    uint32_t capacity = csp_shm_round_up(config.capacity);
+    uint32_t slots = csp_shm_round_up(config.payload_slots);
+    uint32_t payload_size = (config.payload_size + 63) & ~63u;
+    auto align = [](uint64_t n) { return (n + 63) & ~uint64_t(63); };
+    uint64_t events_offset = align(sizeof(CSP_ShmHeader));
+    uint64_t free_offset = align(events_offset + uint64_t(capacity) * sizeof(CSP_ShmEventCell));
+    uint64_t payloads_offset = align(free_offset + uint64_t(slots) * sizeof(CSP_ShmIndexCell));
+    uint64_t size = payloads_offset + uint64_t(slots) * payload_size;
+
+    std::string path = std::string("/") + name;
+    shm_unlink(path.c_str());
+    int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return nullptr;
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0)
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        shm_unlink(path.c_str());
+        return nullptr;
+    }
+
+    CSP_ShmBridge* b = new CSP_ShmBridge();
+    b->csp = csp;
+    b->m.name = path;
+    b->m.base = static_cast<char*>(p);
+    b->m.size = size;
+
+    // the segment is fresh, and zeroed; the magic is written last, so that a
+    // producer that opens it early sees that it's not ready
+    CSP_ShmHeader* h = new (b->m.base) CSP_ShmHeader();
+    h->version = csp_shm_version;
+    h->capacity = capacity;
+    h->payload_slots = slots;
+    h->payload_size = payload_size;
+    h->events_offset = events_offset;
+    h->free_offset = free_offset;
+    h->payloads_offset = payloads_offset;
+    h->size = size;
+    csp_shm_bind(b->m);
+    for (uint32_t i = 0; i < capacity; ++i)
+        new (&b->m.events.cells[i]) CSP_ShmEventCell{ {i}, {}, 0 };
+    for (uint32_t i = 0; i < slots; ++i)
+        new (&b->m.free.cells[i]) CSP_ShmIndexCell{ {uint64_t(i) + 1}, i };   // every slot starts free
+    h->free_enqueue_pos.store(slots, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h->magic, csp_shm_magic, sizeof(h->magic));
+
+    b->running = true;
+    b->thread = std::thread([b]() { csp_shm_bridge_run(b); });
+    return b;
+}
+
+// Stops bridging, after moving whatever is in the ring, and removes the segment.
+void csp_shm_bridge_close(CSP_ShmBridge* b)
+{
+    if (!b)
+        return;
+    b->running = false;
+    b->m.header->signal.fetch_add(1);
+    csp_shm_futex(&b->m.header->signal, FUTEX_WAKE, 1, nullptr);
+    if (b->thread.joinable())
+        b->thread.join();
+    munmap(b->m.base, b->m.size);
+    shm_unlink(b->m.name.c_str());
+    LOG_INFO("csp: bridged %llu events from %s", static_cast<unsigned long long>(b->bridged.load()), b->m.name);
+    delete b;
+}
+
+// The bytes of the payload whose handle an event carried as its id, in place.
+const void* csp_shm_payload(CSP_ShmBridge* b, int handle)
+{
+    if (!b || handle < 1 || uint32_t(handle) > b->m.header->payload_slots)
+        return nullptr;
+    return b->m.payloads + uint64_t(handle - 1) * b->m.header->payload_size;
+}
+
+// Returns a payload slot to the pool, once its handler is done with it.
+void csp_shm_release(CSP_ShmBridge* b, int handle)
+{
+    if (!b || handle < 1 || uint32_t(handle) > b->m.header->payload_slots)
+        return;
+    uint64_t pos;
+    // there are as many cells as slots, so a released slot always has a cell
+    if (CSP_ShmIndexCell* cell = b->m.free.claim(pos))
+    {
+        cell->index = uint32_t(handle - 1);
+        b->m.free.publish(cell, pos);
+    }
+}
+
+// The producing side, in another process.
+struct CSP_ShmProducer
+{
+    CSP_ShmMapping m;
+};
+
+CSP_ShmProducer* csp_shm_connect(char const*const name)
+{
+    if (!name)
+        return nullptr;
+
+    std::string path = std::string("/") + name;
+    int fd = shm_open(path.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(CSP_ShmHeader))
+        p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    CSP_ShmHeader* h = static_cast<CSP_ShmHeader*>(p);
+    bool ok = !memcmp(h->magic, csp_shm_magic, sizeof(h->magic));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    ok = ok && h->version == csp_shm_version && h->size == uint64_t(st.st_size);
+    if (!ok)
+    {
+        munmap(p, static_cast<size_t>(st.st_size));
+        return nullptr;
+    }
+
+    CSP_ShmProducer* producer = new CSP_ShmProducer();
+    producer->m.name = path;
+    producer->m.base = static_cast<char*>(p);
+    producer->m.size = static_cast<size_t>(st.st_size);
+    csp_shm_bind(producer->m);
+    return producer;
+}
+
+void csp_shm_disconnect(CSP_ShmProducer* producer)
+{
+    if (!producer)
+        return;
+    munmap(producer->m.base, producer->m.size);
+    delete producer;
+}
+
+// Leases a payload slot to write into. Returns nullptr if every slot is in use,
+// or size is more than a slot holds.
+void* csp_shm_lease(CSP_ShmProducer* producer, size_t size, int& handle)
+{
+    if (!producer || size > producer->m.header->payload_size)
+        return nullptr;
+    uint64_t pos;
+    CSP_ShmIndexCell* cell = producer->m.free.take(pos);
+    if (!cell)
+        return nullptr;
+    uint32_t index = cell->index;
+    producer->m.free.retire(cell, pos);
+    handle = static_cast<int>(index) + 1;
+    return producer->m.payloads + uint64_t(index) * producer->m.header->payload_size;
+}
+
+// Emits an event to the bridged CSP. For an event with a payload, id is the
+// lease's handle. Returns false if the ring is full, or the name is too long.
+bool csp_shm_emit(CSP_ShmProducer* producer, char const*const name, int id)
+{
+    if (!producer || !name)
+        return false;
+    size_t len = strlen(name);
+    if (len >= CSP_EVENT_NAME_MAX)
+        return false;
+
+    uint64_t pos;
+    CSP_ShmEventCell* cell = producer->m.events.claim(pos);
+    if (!cell)
+        return false;
+    memcpy(cell->name, name, len + 1);
+    cell->id = id;
+    producer->m.events.publish(cell, pos);
+
+    // publishing is a release store, which could otherwise be ordered after
+    // the load of sleeping, missing a bridge that found the ring empty
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    CSP_ShmHeader* h = producer->m.header;
+    if (h->sleeping.load(std::memory_order_seq_cst))
+    {
+        h->signal.fetch_add(1, std::memory_order_release);
+        csp_shm_futex(&h->signal, FUTEX_WAKE, 1, nullptr);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "clock.h"
+#include "csp.h"
+#include "csp_queue.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Sinks receive the events a CSP has dispatched, in order, in batches, on a
+// thread of their own, so that a journal writer, a trace recorder or a debugging
+// view can follow the event stream without adding to the time taken by
+// csp_update. Each sink is fed through its own single producer, single consumer
+// ring, which csp_update fills without waiting.
+//
+// A sink that falls behind far enough to fill its ring either drops events,
+// counting them, or spills them to an overflow list without bound, and catches
+// up from there. Either way, its lag, in events and in seconds, is published to
+// the stats registry, and shown by the inspector.
+
+struct CSP_SinkEvent
+{
+    CSP_Event event;        // the call, if any, is cleared; it's not the sink's to complete
+    bool matched;
+    int64_t time_ns;        // of the virtual clock, when dispatched
+};
+
+struct CSP_Sink
+{
+    virtual ~CSP_Sink() = default;
+
+    // Called on the sink's thread.
+    virtual void consume(const CSP_SinkEvent* events, size_t count) = 0;
+};
+
+enum class CSP_SinkPolicy { Drop, Spill };
+
+struct CSP_SinkConfig
+{
+    std::string name = "sink";      // labels the sink's stats
+    size_t capacity = 4096;         // events the ring holds
+    size_t batch = 256;             // the most events given to consume at once
+    CSP_SinkPolicy policy = CSP_SinkPolicy::Drop;
+};
+
+struct CSP_SinkChannel : public CSP_DispatchTap
+{
+    CSP_SinkChannel(CSP_Sink* s, const CSP_SinkConfig& c)
+    : sink(s), config(c), ring(std::max<size_t>(c.capacity, 2))
+    {
+        batch.resize(std::max<size_t>(config.batch, 1));
+    }
+
+    void dispatched(const CSP_Event& event, bool matched) override;
+
+    CSP* csp = nullptr;
+    CSP_Sink* sink;
+    CSP_SinkConfig config;
+    CSP_SPSCQueue<CSP_SinkEvent> ring;
+    std::vector<CSP_SinkEvent> batch;       // the sink thread's
+
+    // once an event has spilled, the ones after it spill too, until the sink
+    // has taken the spill, so that the order is kept
+    std::mutex spill_mutex;
+    std::vector<CSP_SinkEvent> spill;
+    std::atomic<bool> spilling{false};
+
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> consumed{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> spilled{0};
+    std::atomic<int64_t> consumed_time_ns{0};   // dispatch time of the last event consumed
+
+    std::thread thread;
+    std::atomic<bool> running{false};
+};
+
+// Called by csp_update; never waits for the sink.
+void CSP_SinkChannel::dispatched(const CSP_Event& event, bool matched)
+{
+    CSP_SinkEvent e;
+    e.event = event;
+    e.event.call = nullptr;
+    e.matched = matched;
+    e.time_ns = vclock_now_ns();
+    published.fetch_add(1, std::memory_order_relaxed);
+
+    if (!spilling.load(std::memory_order_acquire) && ring.try_enqueue(e))
+        return;
+
+    if (config.policy == CSP_SinkPolicy::Drop)
+    {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(spill_mutex);
+    spill.push_back(e);
+    spilling.store(true, std::memory_order_release);
+    spilled.fetch_add(1, std::memory_order_relaxed);
+}
+
+void csp_sink_consume(CSP_SinkChannel* c, const CSP_SinkEvent* events, size_t count)
+{
+    if (!count)
+        return;
+    c->sink->consume(events, count);
+    c->consumed_time_ns.store(events[count - 1].time_ns, std::memory_order_relaxed);
+    c->consumed.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Consumes what the ring holds, a batch at a time, until it is empty.
+size_t csp_sink_drain_ring(CSP_SinkChannel* c)
+{
+    size_t total = 0;
+    size_t n;
+    do
+    {
+        n = 0;
+        while (n < c->batch.size() && c->ring.try_dequeue(c->batch[n]))
+            ++n;
+        csp_sink_consume(c, c->batch.data(), n);
+        total += n;
+    } while (n == c->batch.size());
+    return total;
+}
+
+// Takes everything waiting for the sink; the ring first, as whatever spilled
+// came after it. Returns the number of events consumed.
+size_t csp_sink_drain(CSP_SinkChannel* c, std::vector<CSP_SinkEvent>& spilled)
+{
+    size_t total = csp_sink_drain_ring(c);
+
+    if (c->spilling.load(std::memory_order_acquire))
+    {
+        // events may have gone into the ring after it was drained, and before
+        // the first spilled; nothing goes into the ring while spilling is set,
+        // so once it is seen, the ring holds only events that came earlier
+        total += csp_sink_drain_ring(c);
+        {
+            std::lock_guard<std::mutex> lock(c->spill_mutex);
+            spilled.swap(c->spill);
+            c->spilling.store(false, std::memory_order_release);
+        }
+        for (size_t i = 0; i < spilled.size(); i += c->batch.size())
+            csp_sink_consume(c, spilled.data() + i, std::min(c->batch.size(), spilled.size() - i));
+        total += spilled.size();
+        spilled.clear();
+    }
+    return total;
+}
+
+// Events dispatched that the sink has neither consumed nor had dropped.
+uint64_t csp_sink_lag(const CSP_SinkChannel* c)
+{
+    uint64_t consumed = c->consumed.load(std::memory_order_relaxed) + c->dropped.load(std::memory_order_relaxed);
+    uint64_t published = c->published.load(std::memory_order_relaxed);
+    return published > consumed ? published - consumed : 0;
+}
+
+// How long ago the last event the sink consumed was dispatched, if it has more
+// waiting; roughly, the age of the oldest event it has yet to see.
+double csp_sink_lag_seconds(const CSP_SinkChannel* c)
+{
+    if (!csp_sink_lag(c))
+        return 0;
+    return (vclock_now_ns() - c->consumed_time_ns.load(std::memory_order_relaxed)) * 1e-9;
+}
+
+std::string csp_sink_label(const CSP_SinkChannel* c)
+{
+    return "{sink=\"" + c->config.name + "\"}";
+}
+
+// Starts feeding csp's dispatched events to sink, which must outlive the
+// returned channel.
+CSP_SinkChannel* csp_add_sink(CSP* csp, CSP_Sink* sink, const CSP_SinkConfig& config = CSP_SinkConfig())
+{
+    if (!csp || !sink)
+        return nullptr;
+
+    CSP_SinkChannel* c = new CSP_SinkChannel(sink, config);
+    c->csp = csp;
+    c->consumed_time_ns = vclock_now_ns();
+    c->running = true;
+    c->thread = std::thread([c]()
+    {
+        std::vector<CSP_SinkEvent> spilled;
+        while (c->running.load(std::memory_order_acquire))
+            if (!csp_sink_drain(c, spilled))
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        csp_sink_drain(c, spilled);
+    });
+
+    std::string label = csp_sink_label(c);
+    stats_gauge("gusteau_csp_sink_lag_events" + label, "Events dispatched but not yet consumed by a sink",
+                [c]() { return static_cast<double>(csp_sink_lag(c)); });
+    stats_gauge("gusteau_csp_sink_lag_seconds" + label, "Age of the oldest event a sink has yet to consume",
+                [c]() { return csp_sink_lag_seconds(c); });
+    stats_gauge("gusteau_csp_sink_dropped" + label, "Events a sink was too far behind to be given",
+                [c]() { return static_cast<double>(c->dropped.load(std::memory_order_relaxed)); });
+    stats_gauge("gusteau_csp_sink_spilled" + label, "Events that overflowed a sink's ring",
+                [c]() { return static_cast<double>(c->spilled.load(std::memory_order_relaxed)); });
+
+    std::lock_guard<std::mutex> lock(csp->process_data_mutex);
+    csp->dispatch_taps.push_back(c);
+    return c;
+}
+
+// Stops feeding the sink; the events already dispatched are consumed first.
+void csp_remove_sink(CSP_SinkChannel* c)
+{
+    if (!c)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(c->csp->process_data_mutex);
+        auto& taps = c->csp->dispatch_taps;
+        taps.erase(std::remove(taps.begin(), taps.end(), c), taps.end());
+    }
+
+    std::string label = csp_sink_label(c);
+    stats_unregister("gusteau_csp_sink_lag_events" + label);
+    stats_unregister("gusteau_csp_sink_lag_seconds" + label);
+    stats_unregister("gusteau_csp_sink_dropped" + label);
+    stats_unregister("gusteau_csp_sink_spilled" + label);
+
+    c->running = false;
+    if (c->thread.joinable())
+        c->thread.join();
+    delete c;
+}
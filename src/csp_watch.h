@@ -0,0 +1,156 @@
+#pragma once
+
+#include "csp.h"
+#include "log.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+#include <sys/stat.h>
+
+// Watches a CSP definition file, and reloads the CSP whenever the file changes;
+// see csp_reload. On Linux, the file's directory is watched with inotify, which
+// also sees editors that save by replacing the file. Elsewhere, the file's
+// modification time is polled.
+
+struct CSP_Watcher
+{
+    CSP* csp = nullptr;
+    std::string path;
+    std::thread thread;
+    std::atomic<bool> running{false};
+    int poll_ms = 250;
+};
+
+bool csp_watch_read(const std::string& path, std::string& src)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return false;
+    src.clear();
+    char buff[4096];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), f)) > 0)
+        src.append(buff, n);
+    fclose(f);
+    return true;
+}
+
+void csp_watch_reload(CSP_Watcher* w)
+{
+    std::string src;
+    if (!csp_watch_read(w->path, src))
+        return;
+    if (csp_reload(w->csp, src.data(), src.size()))
+        LOG_INFO("csp: reloading %s", w->path);
+    else
+        LOG_WARN("csp: %s has an error, keeping the current definition", w->path);
+}
+
+int64_t csp_watch_mtime(const std::string& path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    return static_cast<int64_t>(st.st_mtime);
+}
+
+void csp_watch_poll(CSP_Watcher* w)
+{
+    int64_t mtime = csp_watch_mtime(w->path);
+    while (w->running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(w->poll_ms));
+        int64_t t = csp_watch_mtime(w->path);
+        if (t != mtime && t >= 0)
+        {
+            mtime = t;
+            csp_watch_reload(w);
+        }
+    }
+}
+
+#if defined(__linux__)
+// Returns false if inotify isn't available, so that the caller can poll instead.
+bool csp_watch_inotify(CSP_Watcher* w)
+{
+    size_t slash = w->path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : w->path.substr(0, slash);
+    std::string file = slash == std::string::npos ? w->path : w->path.substr(slash + 1);
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    std::vector<char> buff(64 * 1024);
+    while (w->running)
+    {
+        pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, 100) <= 0)
+            continue;
+
+        // an editor may touch the file several times in one save, so all
+        // pending events are read before reloading once
+        bool changed = false;
+        ssize_t n;
+        while ((n = read(fd, buff.data(), buff.size())) > 0)
+        {
+            for (char* e = buff.data(); e < buff.data() + n; )
+            {
+                inotify_event* event = reinterpret_cast<inotify_event*>(e);
+                if (event->len && file == event->name)
+                    changed = true;
+                e += sizeof(inotify_event) + event->len;
+            }
+        }
+        if (changed)
+            csp_watch_reload(w);
+    }
+    close(fd);
+    return true;
+}
+#endif
+
+CSP_Watcher* csp_watch(CSP* csp, char const*const path)
+{
+    if (!csp || !path)
+        return nullptr;
+
+    CSP_Watcher* w = new CSP_Watcher();
+    w->csp = csp;
+    w->path = path;
+    w->running = true;
+    w->thread = std::thread([w]()
+    {
+#if defined(__linux__)
+        if (csp_watch_inotify(w))
+            return;
+#endif
+        csp_watch_poll(w);
+    });
+    return w;
+}
+
+// Stops watching; must be called before the CSP is deleted.
+void csp_unwatch(CSP_Watcher* w)
+{
+    if (!w)
+        return;
+    w->running = false;
+    if (w->thread.joinable())
+        w->thread.join();
+    delete w;
+}
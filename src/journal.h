@@ -1,8 +1,11 @@
 #pragma once
 
+#include "InlineFunction.h"
 #include "TypedData.h"
-#include <functional>
+#include "alloc_profiler.h"
+#include <mutex>
 #include <string>
+#include <vector>
 
 struct JournalEntry
 {
@@ -37,15 +40,25 @@ struct JournalEntry
 
 struct Journal
 {
+    // The actions are stored inline so that committing a transaction doesn't
+    // allocate, as long as the history has room for it; see reserve().
     struct Transaction
     {
         std::string name;
-        std::function<void()> action;
-        std::function<void()> undo;
+        InlineFunction<void()> action;
+        InlineFunction<void()> undo;
     };
 
+    void reserve(size_t count)
+    {
+        ALLOC_ZONE(Journal);
+        std::lock_guard<std::mutex> lock(records_mutex);
+        records.reserve(count);
+    }
+
     void commit(Transaction&& e)
     {
+        ALLOC_ZONE(Journal);
         std::lock_guard<std::mutex> lock(records_mutex);
 
         // if index is in the middle of the undo/redo history, pop the undo history
@@ -65,6 +78,7 @@ struct Journal
         if (last_action_index < 0)
             return;
 
+        ALLOC_ZONE(Journal);
         std::lock_guard<std::mutex> lock(records_mutex);
         records[last_action_index].undo();
         --last_action_index;
@@ -74,11 +88,18 @@ struct Journal
     {
         if ((last_action_index + 1) < records.size())
         {
+            ALLOC_ZONE(Journal);
             ++last_action_index;
             records[last_action_index].action();
         }
     }
 
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(records_mutex);
+        return records.size();
+    }
+
     int last_action_index = -1;
     std::mutex records_mutex;
     std::vector<Transaction> records;
@@ -0,0 +1,381 @@
+#pragma once
+
+#include "clock.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// An asynchronous logger. A thread that logs writes a binary record, holding a
+// pointer to the format string and the raw arguments, into a ring of its own.
+// A background thread collects the records from every ring, and does the
+// formatting and the writing. Logging therefore never takes a lock, and costs
+// the calling thread little more than copying the arguments. If a thread's ring
+// is full, the record is dropped and counted, rather than making the thread wait.
+//
+// The format string must outlive the record, so it should be a literal. The
+// conversions are those of printf.
+//
+// Levels below GUSTEAU_LOG_LEVEL are compiled out, and log_set_level filters
+// further at run time. Records are stamped with the virtual clock's time, so a
+// simulation's log is the same from run to run.
+
+enum class LogLevel : int { Trace = 0, Debug, Info, Warning, Error, Off };
+
+#ifndef GUSTEAU_LOG_LEVEL
+#define GUSTEAU_LOG_LEVEL 1 // Debug
+#endif
+
+#define LOG_AT(level, ...) \
+    do { if (static_cast<int>(level) >= GUSTEAU_LOG_LEVEL && log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+
+#define LOG_TRACE(...) LOG_AT(LogLevel::Trace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LogLevel::Warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::Error, __VA_ARGS__)
+
+struct LogArg
+{
+    enum Type : uint8_t { Int, UInt, Double, String, Pointer };
+    Type type;
+    union
+    {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void* p;
+        uint16_t str;   // offset of the string in the record's text
+    };
+};
+
+struct LogRecord
+{
+    static constexpr int max_args = 8;
+    static constexpr int text_size = 120;
+
+    int64_t time_ns;
+    const char* format;
+    uint32_t thread;
+    LogLevel level;
+    uint8_t arg_count;
+    uint8_t text_used;
+    LogArg args[max_args];
+    char text[text_size];
+};
+
+// A single producer, single consumer ring per logging thread.
+struct LogRing
+{
+    static constexpr size_t capacity = 1024;
+
+    LogRecord records[capacity];
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) std::atomic<size_t> head{0};
+    std::atomic<bool> orphaned{false};  // set when the thread exits
+    uint32_t thread = 0;
+};
+
+struct Logger
+{
+    std::atomic<int> level{static_cast<int>(LogLevel::Info)};
+    std::atomic<size_t> dropped{0};
+    std::mutex rings_mutex;
+    std::mutex write_mutex;     // held by whoever is draining, so that writes stay in order
+    std::vector<std::unique_ptr<LogRing>> rings;
+    std::atomic<uint32_t> next_thread{1};
+    FILE* out = stderr;
+
+    std::atomic<bool> running{true};
+    std::thread writer;
+
+    Logger();
+    ~Logger();
+};
+
+Logger& log_instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+bool log_enabled(LogLevel level)
+{
+    return static_cast<int>(level) >= log_instance().level.load(std::memory_order_relaxed);
+}
+
+void log_set_level(LogLevel level)
+{
+    log_instance().level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+size_t log_dropped()
+{
+    return log_instance().dropped.load(std::memory_order_relaxed);
+}
+
+// The calling thread's ring is created on the first record it logs, and handed
+// back to the logger to free once drained when the thread exits.
+struct LogThreadRing
+{
+    LogRing* ring = nullptr;
+    ~LogThreadRing()
+    {
+        if (ring)
+            ring->orphaned.store(true, std::memory_order_release);
+    }
+};
+
+LogRing* log_thread_ring()
+{
+    thread_local LogThreadRing tls;
+    if (!tls.ring)
+    {
+        Logger& logger = log_instance();
+        std::unique_ptr<LogRing> ring(new LogRing());
+        ring->thread = logger.next_thread++;
+        tls.ring = ring.get();
+        std::lock_guard<std::mutex> lock(logger.rings_mutex);
+        logger.rings.emplace_back(std::move(ring));
+    }
+    return tls.ring;
+}
+
+template <typename T>
+void log_pack(LogRecord& r, T&& value)
+{
+    if (r.arg_count == LogRecord::max_args)
+        return;
+
+    using V = std::decay_t<T>;
+    LogArg& a = r.args[r.arg_count++];
+    if constexpr (std::is_same<V, char*>::value || std::is_same<V, const char*>::value || std::is_same<V, std::string>::value)
+    {
+        const char* s;
+        if constexpr (std::is_same<V, std::string>::value)
+            s = value.c_str();
+        else
+            s = value ? value : "(null)";
+        size_t room = LogRecord::text_size - r.text_used;
+        size_t len = strlen(s);
+        if (len >= room)
+            len = room ? room - 1 : 0;
+        a.type = LogArg::String;
+        a.str = r.text_used;
+        if (room)
+        {
+            memcpy(r.text + r.text_used, s, len);
+            r.text[r.text_used + len] = '\0';
+            r.text_used = static_cast<uint8_t>(r.text_used + len + 1);
+        }
+        else
+            a.str = LogRecord::text_size - 1;
+    }
+    else if constexpr (std::is_floating_point<V>::value)
+    {
+        a.type = LogArg::Double;
+        a.d = static_cast<double>(value);
+    }
+    else if constexpr (std::is_enum<V>::value)
+    {
+        a.type = LogArg::Int;
+        a.i = static_cast<long long>(value);
+    }
+    else if constexpr (std::is_signed<V>::value)
+    {
+        a.type = LogArg::Int;
+        a.i = static_cast<long long>(value);
+    }
+    else if constexpr (std::is_unsigned<V>::value)
+    {
+        a.type = LogArg::UInt;
+        a.u = static_cast<unsigned long long>(value);
+    }
+    else
+    {
+        a.type = LogArg::Pointer;
+        a.p = static_cast<const void*>(value);
+    }
+}
+
+template <typename... Args>
+void log_write(LogLevel level, const char* format, Args&&... args)
+{
+    LogRing* ring = log_thread_ring();
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= LogRing::capacity)
+    {
+        log_instance().dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecord& r = ring->records[tail % LogRing::capacity];
+    r.time_ns = vclock_now_ns();
+    r.format = format;
+    r.thread = ring->thread;
+    r.level = level;
+    r.arg_count = 0;
+    r.text_used = 0;
+    r.text[LogRecord::text_size - 1] = '\0';
+    (log_pack(r, std::forward<Args>(args)), ...);
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+// Interprets the format against the recorded arguments. Length modifiers in the
+// format are replaced by those of the recorded argument types.
+void log_format(const LogRecord& r, std::string& line)
+{
+    static char const*const level_names[] = { "trace", "debug", "info", "warning", "error" };
+    char buff[256];
+    snprintf(buff, sizeof(buff), "[%10.6f] %-7s t%u: ", r.time_ns * 1e-9,
+             level_names[static_cast<int>(r.level)], r.thread);
+    line.assign(buff);
+
+    int arg = 0;
+    for (const char* f = r.format; *f; ++f)
+    {
+        if (*f != '%')
+        {
+            line.push_back(*f);
+            continue;
+        }
+        if (f[1] == '%')
+        {
+            line.push_back('%');
+            ++f;
+            continue;
+        }
+
+        // copy flags, width and precision; drop length modifiers
+        char spec[32] = "%";
+        size_t n = 1;
+        ++f;
+        while (*f && strchr("-+ #0123456789.", *f) && n < 24)
+            spec[n++] = *f++;
+        while (*f && strchr("hlLqjzt", *f))
+            ++f;
+        char conversion = *f;
+        if (!conversion)
+            break;
+
+        if (arg >= r.arg_count)
+        {
+            line.append("(missing)");
+            continue;
+        }
+        const LogArg& a = r.args[arg++];
+        buff[0] = '\0';
+        switch (conversion)
+        {
+        case 'd': case 'i': case 'c':
+        case 'u': case 'x': case 'X': case 'o':
+            if (conversion != 'c')
+            {
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+            }
+            spec[n++] = conversion;
+            spec[n] = '\0';
+            if (a.type == LogArg::Double)
+                snprintf(buff, sizeof(buff), spec, static_cast<long long>(a.d));
+            else if (conversion == 'c')
+                snprintf(buff, sizeof(buff), spec, static_cast<int>(a.i));
+            else
+                snprintf(buff, sizeof(buff), spec, a.i);
+            break;
+        case 'f': case 'F': case 'g': case 'G': case 'e': case 'E': case 'a': case 'A':
+            spec[n++] = conversion;
+            spec[n] = '\0';
+            snprintf(buff, sizeof(buff), spec,
+                     a.type == LogArg::Double ? a.d : a.type == LogArg::UInt ? static_cast<double>(a.u) : static_cast<double>(a.i));
+            break;
+        case 's':
+            spec[n++] = 's';
+            spec[n] = '\0';
+            snprintf(buff, sizeof(buff), spec, a.type == LogArg::String ? r.text + a.str : "(not a string)");
+            break;
+        case 'p':
+            snprintf(buff, sizeof(buff), "%p", a.p);
+            break;
+        default:
+            break;
+        }
+        line.append(buff);
+    }
+    line.push_back('\n');
+}
+
+// Drains every ring, and writes the records in time order.
+void log_drain(Logger& logger, std::vector<LogRecord>& batch, std::string& line)
+{
+    std::lock_guard<std::mutex> write_lock(logger.write_mutex);
+    batch.clear();
+    {
+        std::lock_guard<std::mutex> lock(logger.rings_mutex);
+        for (auto it = logger.rings.begin(); it != logger.rings.end(); )
+        {
+            LogRing* ring = it->get();
+            bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+            size_t head = ring->head.load(std::memory_order_relaxed);
+            size_t tail = ring->tail.load(std::memory_order_acquire);
+            for (; head != tail; ++head)
+                batch.push_back(ring->records[head % LogRing::capacity]);
+            ring->head.store(head, std::memory_order_release);
+
+            if (orphaned)
+                it = logger.rings.erase(it);
+            else
+                ++it;
+        }
+    }
+    if (batch.empty())
+        return;
+
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const LogRecord& a, const LogRecord& b) { return a.time_ns < b.time_ns; });
+    for (auto& r : batch)
+    {
+        log_format(r, line);
+        fwrite(line.data(), 1, line.size(), logger.out);
+    }
+    fflush(logger.out);
+}
+
+Logger::Logger()
+{
+    writer = std::thread([this]()
+    {
+        std::vector<LogRecord> batch;
+        std::string line;
+        while (running.load(std::memory_order_acquire))
+        {
+            log_drain(*this, batch, line);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        log_drain(*this, batch, line);
+    });
+}
+
+Logger::~Logger()
+{
+    running.store(false, std::memory_order_release);
+    if (writer.joinable())
+        writer.join();
+}
+
+// Writes everything logged so far before returning.
+void log_flush()
+{
+    Logger& logger = log_instance();
+    std::vector<LogRecord> batch;
+    std::string line;
+    log_drain(logger, batch, line);
+}
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// A registry of counters, gauges and histograms that the subsystems register
+// into. Updating a metric is a relaxed atomic operation, so it can be done from
+// any thread without coordination. A gauge may instead be sampled, through a
+// function called only when the stats are exported.
+//
+// The registry is exported in the Prometheus text exposition format, to a file
+// that is rewritten periodically, and optionally to whoever connects to a Unix
+// domain socket.
+//
+// A metric's name may carry labels, as in gusteau_alloc_live_bytes{zone="csp"}.
+// Metrics sharing a name up to the labels are reported as one family.
+
+enum class StatsKind { Counter, Gauge, Histogram };
+
+struct StatsMetric
+{
+    StatsMetric(StatsKind k, const std::string& n, const std::string& h) : kind(k), name(n), help(h) {}
+    virtual ~StatsMetric() = default;
+    virtual void write(std::string& out) const = 0;
+
+    std::string family() const { return name.substr(0, name.find('{')); }
+
+    StatsKind kind;
+    std::string name;
+    std::string help;
+};
+
+struct StatsCounter : public StatsMetric
+{
+    StatsCounter(const std::string& n, const std::string& h) : StatsMetric(StatsKind::Counter, n, h) {}
+
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+
+    void write(std::string& out) const override
+    {
+        char buff[32];
+        snprintf(buff, sizeof(buff), " %llu\n", static_cast<unsigned long long>(value.load(std::memory_order_relaxed)));
+        out += name;
+        out += buff;
+    }
+
+    std::atomic<uint64_t> value{0};
+};
+
+struct StatsGauge : public StatsMetric
+{
+    StatsGauge(const std::string& n, const std::string& h, std::function<double()> s = nullptr)
+    : StatsMetric(StatsKind::Gauge, n, h), sample(std::move(s)) {}
+
+    void set(double v) { value.store(v, std::memory_order_relaxed); }
+
+    void write(std::string& out) const override
+    {
+        char buff[32];
+        snprintf(buff, sizeof(buff), " %.17g\n", sample ? sample() : value.load(std::memory_order_relaxed));
+        out += name;
+        out += buff;
+    }
+
+    std::atomic<double> value{0};
+    std::function<double()> sample;
+};
+
+// Each bucket counts the observations up to its bound, and above the previous
+// one; they are made cumulative when exported.
+struct StatsHistogram : public StatsMetric
+{
+    StatsHistogram(const std::string& n, const std::string& h, std::vector<double> b)
+    : StatsMetric(StatsKind::Histogram, n, h)
+    , bounds(std::move(b))
+    , buckets(new std::atomic<uint64_t>[bounds.size() + 1])
+    {
+        std::sort(bounds.begin(), bounds.end());
+        for (size_t i = 0; i <= bounds.size(); ++i)
+            buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    void observe(double v)
+    {
+        size_t i = 0;
+        while (i < bounds.size() && v > bounds[i])
+            ++i;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        double s = sum.load(std::memory_order_relaxed);
+        while (!sum.compare_exchange_weak(s, s + v, std::memory_order_relaxed)) {}
+    }
+
+    void write(std::string& out) const override
+    {
+        std::string f = family();
+        std::string labels = name.size() > f.size() ? name.substr(f.size() + 1, name.size() - f.size() - 2) + "," : "";
+        char buff[64];
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i)
+        {
+            cumulative += buckets[i].load(std::memory_order_relaxed);
+            if (i < bounds.size())
+                snprintf(buff, sizeof(buff), "%g", bounds[i]);
+            else
+                snprintf(buff, sizeof(buff), "+Inf");
+            out += f + "_bucket{" + labels + "le=\"" + buff + "\"}";
+            snprintf(buff, sizeof(buff), " %llu\n", static_cast<unsigned long long>(cumulative));
+            out += buff;
+        }
+        std::string suffix = labels.empty() ? "" : "{" + labels.substr(0, labels.size() - 1) + "}";
+        snprintf(buff, sizeof(buff), " %.17g\n", sum.load(std::memory_order_relaxed));
+        out += f + "_sum" + suffix + buff;
+        snprintf(buff, sizeof(buff), " %llu\n", static_cast<unsigned long long>(count.load(std::memory_order_relaxed)));
+        out += f + "_count" + suffix + buff;
+    }
+
+    std::vector<double> bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+    std::atomic<double> sum{0};
+    std::atomic<uint64_t> count{0};
+};
+
+struct StatsRegistry
+{
+    std::mutex metrics_mutex;
+    std::vector<std::unique_ptr<StatsMetric>> metrics;
+};
+
+// Leaked, so that metrics may be updated during static destruction.
+StatsRegistry& stats_registry()
+{
+    static StatsRegistry* registry = new StatsRegistry();
+    return *registry;
+}
+
+// Registering a name that is already registered, with the same kind, returns the
+// existing metric.
+template <typename T, typename... Args>
+T& stats_register(const std::string& name, const std::string& help, StatsKind kind, Args&&... args)
+{
+    StatsRegistry& r = stats_registry();
+    std::lock_guard<std::mutex> lock(r.metrics_mutex);
+    for (auto& m : r.metrics)
+        if (m->name == name && m->kind == kind)
+            return static_cast<T&>(*m);
+
+    r.metrics.emplace_back(new T(name, help, std::forward<Args>(args)...));
+    return static_cast<T&>(*r.metrics.back());
+}
+
+StatsCounter& stats_counter(const std::string& name, const std::string& help)
+{
+    return stats_register<StatsCounter>(name, help, StatsKind::Counter);
+}
+
+StatsGauge& stats_gauge(const std::string& name, const std::string& help)
+{
+    return stats_register<StatsGauge>(name, help, StatsKind::Gauge);
+}
+
+// A gauge whose value is obtained by calling sample at export time. The sample
+// function runs on the exporting thread. Replaces the sample of an existing gauge.
+StatsGauge& stats_gauge(const std::string& name, const std::string& help, std::function<double()> sample)
+{
+    StatsGauge& g = stats_register<StatsGauge>(name, help, StatsKind::Gauge);
+    std::lock_guard<std::mutex> lock(stats_registry().metrics_mutex);
+    g.sample = std::move(sample);
+    return g;
+}
+
+StatsHistogram& stats_histogram(const std::string& name, const std::string& help, std::vector<double> bounds)
+{
+    return stats_register<StatsHistogram>(name, help, StatsKind::Histogram, std::move(bounds));
+}
+
+// Removes a metric; used for metrics whose sample refers to an object that is
+// going away.
+void stats_unregister(const std::string& name)
+{
+    StatsRegistry& r = stats_registry();
+    std::lock_guard<std::mutex> lock(r.metrics_mutex);
+    r.metrics.erase(std::remove_if(r.metrics.begin(), r.metrics.end(),
+                                   [&name](const std::unique_ptr<StatsMetric>& m) { return m->name == name; }),
+                    r.metrics.end());
+}
+
+void stats_write_prometheus(std::string& out)
+{
+    static char const*const kind_names[] = { "counter", "gauge", "histogram" };
+
+    StatsRegistry& r = stats_registry();
+    std::lock_guard<std::mutex> lock(r.metrics_mutex);
+
+    std::vector<StatsMetric*> sorted;
+    sorted.reserve(r.metrics.size());
+    for (auto& m : r.metrics)
+        sorted.push_back(m.get());
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const StatsMetric* a, const StatsMetric* b) { return a->family() < b->family(); });
+
+    out.clear();
+    std::string family;
+    for (auto m : sorted)
+    {
+        std::string f = m->family();
+        if (f != family)
+        {
+            family = f;
+            out += "# HELP " + f + " " + m->help + "\n";
+            out += "# TYPE " + f + " " + kind_names[static_cast<int>(m->kind)] + "\n";
+        }
+        m->write(out);
+    }
+}
+
+struct StatsExportConfig
+{
+    std::string path;           // rewritten every period, if not empty
+    std::string socket_path;    // Unix domain socket, if not empty
+    int period_ms = 1000;
+};
+
+void stats_export_stop();
+
+struct StatsExporter
+{
+    ~StatsExporter() { stats_export_stop(); }
+
+    StatsExportConfig config;
+    std::thread thread;
+    std::atomic<bool> running{false};
+    int listen_fd = -1;
+};
+
+StatsExporter& stats_exporter()
+{
+    static StatsExporter exporter;
+    return exporter;
+}
+
+// The file is written beside its final name, and renamed over it, so that a
+// reader never sees a partial file.
+bool stats_write_file(const std::string& path, const std::string& text)
+{
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+#ifndef _WIN32
+int stats_listen(const std::string& socket_path)
+{
+    sockaddr_un addr = {};
+    if (socket_path.size() >= sizeof(addr.sun_path))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    unlink(socket_path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Every connection is sent the current stats, and closed.
+void stats_serve(int listen_fd, int timeout_ms, std::string& text)
+{
+    pollfd p = { listen_fd, POLLIN, 0 };
+    if (poll(&p, 1, timeout_ms) <= 0 || !(p.revents & POLLIN))
+        return;
+
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0)
+        return;
+
+    stats_write_prometheus(text);
+    size_t sent = 0;
+    while (sent < text.size())
+    {
+        ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    close(fd);
+}
+#endif
+
+// Starts a thread that writes the file every period and serves the socket.
+// The file is written once before starting, so that a path that can't be
+// written is reported here. Returns false if the file could not be written,
+// the socket could not be opened, or exporting has already started; failed,
+// if given, is set to the path of the target that failed.
+bool stats_export_start(const StatsExportConfig& config, std::string* failed = nullptr)
+{
+    StatsExporter& e = stats_exporter();
+    if (e.running)
+        return false;
+
+    if (config.path.size())
+    {
+        std::string text;
+        stats_write_prometheus(text);
+        if (!stats_write_file(config.path, text))
+        {
+            if (failed)
+                *failed = config.path;
+            return false;
+        }
+    }
+
+    e.config = config;
+    if (config.socket_path.size())
+    {
+#ifndef _WIN32
+        e.listen_fd = stats_listen(config.socket_path);
+        if (e.listen_fd < 0)
+        {
+            if (failed)
+                *failed = config.socket_path;
+            return false;
+        }
+#else
+        if (failed)
+            *failed = config.socket_path;
+        return false;
+#endif
+    }
+
+    e.running = true;
+    e.thread = std::thread([&e]()
+    {
+        std::string text;
+        auto period = std::chrono::milliseconds(std::max(e.config.period_ms, 1));
+        auto next = std::chrono::steady_clock::now();
+        while (e.running)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= next)
+            {
+                if (e.config.path.size())
+                {
+                    stats_write_prometheus(text);
+                    stats_write_file(e.config.path, text);
+                }
+                next = now + period;
+            }
+
+            // wake at least every 100ms to notice a stop
+            int timeout_ms = static_cast<int>(std::min<int64_t>(100,
+                std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1));
+#ifndef _WIN32
+            if (e.listen_fd >= 0)
+            {
+                stats_serve(e.listen_fd, timeout_ms, text);
+                continue;
+            }
+#endif
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+        }
+    });
+    return true;
+}
+
+void stats_export_stop()
+{
+    StatsExporter& e = stats_exporter();
+    if (!e.running)
+        return;
+
+    e.running = false;
+    if (e.thread.joinable())
+        e.thread.join();
+#ifndef _WIN32
+    if (e.listen_fd >= 0)
+    {
+        close(e.listen_fd);
+        unlink(e.config.socket_path.c_str());
+        e.listen_fd = -1;
+    }
+#endif
+}